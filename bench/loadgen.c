@@ -0,0 +1,274 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+// A small HTTP/1.1 load generator for bench/run.sh: each thread keeps one keep-alive connection
+// busy for the given duration, and latencies are reported as percentiles.
+//
+// loadgen -c concurrency -d seconds [-b bodyfile] host port path
+
+#define _GNU_SOURCE // strcasestr
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+typedef struct {
+  int fd;
+  char buffer[65536];
+  size_t start, end; // unread bytes of buffer
+} connection;
+
+typedef struct {
+  pthread_t thread;
+  long *latencies; // microseconds
+  size_t count, capacity;
+  long errors;
+} worker;
+
+static struct sockaddr_in address;
+static char *request;
+static size_t request_length;
+static double deadline;
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int connect_to_server(connection *c) {
+  c->start = c->end = 0;
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->fd < 0) return -1;
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(c->fd, (struct sockaddr*) &address, sizeof(address))) {
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static int fill(connection *c) {
+  if (c->start == c->end) c->start = c->end = 0;
+  if (c->end == sizeof(c->buffer)) {
+    memmove(c->buffer, c->buffer + c->start, c->end - c->start);
+    c->end -= c->start;
+    c->start = 0;
+  }
+  ssize_t n = read(c->fd, c->buffer + c->end, sizeof(c->buffer) - c->end);
+  if (n <= 0) return -1;
+  c->end += n;
+  return 0;
+}
+
+// Reads one line (without the CRLF) into [line].
+static int read_line(connection *c, char *line, size_t size) {
+  for (;;) {
+    char *newline = (char*) memchr(c->buffer + c->start, '\n', c->end - c->start);
+    if (newline) {
+      size_t length = newline - (c->buffer + c->start);
+      if (length && newline[-1] == '\r') length--;
+      if (length >= size) length = size - 1;
+      memcpy(line, c->buffer + c->start, length);
+      line[length] = 0;
+      c->start = newline + 1 - c->buffer;
+      return 0;
+    }
+    if (c->end - c->start == sizeof(c->buffer)) return -1; // line too long
+    if (fill(c)) return -1;
+  }
+}
+
+static int skip(connection *c, long length) {
+  while (length > 0) {
+    if (c->start == c->end && fill(c)) return -1;
+    size_t n = c->end - c->start;
+    if ((long) n > length) n = length;
+    c->start += n;
+    length -= n;
+  }
+  return 0;
+}
+
+// Reads a whole response, returning its status code, or -1 if the connection failed.
+static int read_response(connection *c, int *keepalive) {
+  char line[8192];
+  if (read_line(c, line, sizeof(line))) return -1;
+  int minor = 0, status = 0;
+  if (sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) return -1;
+  long length = -1;
+  int chunked = 0;
+  *keepalive = (minor > 0); // HTTP/1.0 closes unless asked not to
+  for (;;) {
+    if (read_line(c, line, sizeof(line))) return -1;
+    if (!*line) break;
+    if (!strncasecmp(line, "Content-Length:", 15)) length = atol(line + 15);
+    if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line, "chunked")) chunked = 1;
+    if (!strncasecmp(line, "Connection:", 11) && strcasestr(line, "close")) *keepalive = 0;
+    if (!strncasecmp(line, "Connection:", 11) && strcasestr(line, "keep-alive")) *keepalive = 1;
+  }
+  if (chunked) {
+    for (;;) {
+      if (read_line(c, line, sizeof(line))) return -1;
+      long size = strtol(line, NULL, 16);
+      if (!size) break;
+      if (skip(c, size) || read_line(c, line, sizeof(line))) return -1;
+    }
+    do {
+      if (read_line(c, line, sizeof(line))) return -1; // trailers
+    } while (*line);
+  } else if (length >= 0) {
+    if (skip(c, length)) return -1;
+  } else {
+    while (!fill(c)) c->start = c->end; // read until the server closes
+    *keepalive = 0;
+  }
+  return status;
+}
+
+static int send_all(int fd, const char *data, size_t length) {
+  while (length) {
+    ssize_t n = write(fd, data, length);
+    if (n <= 0) return -1;
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+static void *run(void *arg) {
+  worker *w = (worker*) arg;
+  connection *c = (connection*) malloc(sizeof(connection));
+  c->fd = -1;
+  while (now() < deadline) {
+    if (c->fd < 0 && connect_to_server(c)) {
+      w->errors++;
+      usleep(1000);
+      continue;
+    }
+    double start = now();
+    int keepalive = 0;
+    int status = send_all(c->fd, request, request_length) ? -1 : read_response(c, &keepalive);
+    if (status < 0 || !keepalive) {
+      close(c->fd);
+      c->fd = -1;
+    }
+    if (status != 200) {
+      w->errors++;
+      continue;
+    }
+    if (w->count == w->capacity) {
+      w->capacity = w->capacity ? w->capacity * 2 : 4096;
+      w->latencies = (long*) realloc(w->latencies, w->capacity * sizeof(long));
+    }
+    w->latencies[w->count++] = (long) ((now() - start) * 1e6);
+  }
+  if (c->fd >= 0) close(c->fd);
+  free(c);
+  return NULL;
+}
+
+static int compare_longs(const void *a, const void *b) {
+  long x = *(const long*) a, y = *(const long*) b;
+  return (x > y) - (x < y);
+}
+
+static char *read_file(const char *path, size_t *length) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+  fseek(f, 0, SEEK_END);
+  *length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *data = (char*) malloc(*length);
+  if (fread(data, 1, *length, f) != *length) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: loadgen -c concurrency -d seconds [-b bodyfile] host port path\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int concurrency = 1, opt;
+  double seconds = 10;
+  const char *body_file = NULL;
+  while ((opt = getopt(argc, argv, "c:d:b:")) != -1) {
+    switch (opt) {
+      case 'c': concurrency = atoi(optarg); break;
+      case 'd': seconds = atof(optarg); break;
+      case 'b': body_file = optarg; break;
+      default: usage();
+    }
+  }
+  if (argc - optind != 3 || concurrency < 1 || seconds <= 0) usage();
+  const char *host = argv[optind], *port = argv[optind + 1], *path = argv[optind + 2];
+
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &info)) {
+    fprintf(stderr, "loadgen: can't resolve %s:%s\n", host, port);
+    return 1;
+  }
+  memcpy(&address, info->ai_addr, sizeof(address));
+  freeaddrinfo(info);
+
+  size_t body_length = 0;
+  char *body = NULL;
+  if (body_file && !(body = read_file(body_file, &body_length))) {
+    fprintf(stderr, "loadgen: can't read %s\n", body_file);
+    return 1;
+  }
+  char header[1024];
+  int header_length = body
+    ? snprintf(header, sizeof(header), "POST %s HTTP/1.1\r\nHost: %s:%s\r\nContent-Type: application/octet-stream\r\nContent-Length: %lu\r\n\r\n",
+        path, host, port, (unsigned long) body_length)
+    : snprintf(header, sizeof(header), "GET %s HTTP/1.1\r\nHost: %s:%s\r\nUser-Agent: mod_dart-loadgen\r\nAccept: */*\r\n\r\n", path, host, port);
+  request_length = header_length + body_length;
+  request = (char*) malloc(request_length);
+  memcpy(request, header, header_length);
+  if (body) memcpy(request + header_length, body, body_length);
+
+  worker *workers = (worker*) calloc(concurrency, sizeof(worker));
+  double start = now();
+  deadline = start + seconds;
+  for (int i = 0; i < concurrency; i++) pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+  size_t total = 0;
+  long errors = 0;
+  for (int i = 0; i < concurrency; i++) {
+    pthread_join(workers[i].thread, NULL);
+    total += workers[i].count;
+    errors += workers[i].errors;
+  }
+  double elapsed = now() - start;
+
+  long *latencies = (long*) malloc((total ? total : 1) * sizeof(long));
+  size_t n = 0;
+  for (int i = 0; i < concurrency; i++) {
+    memcpy(latencies + n, workers[i].latencies, workers[i].count * sizeof(long));
+    n += workers[i].count;
+  }
+  qsort(latencies, total, sizeof(long), compare_longs);
+#define PERCENTILE(p) (total ? latencies[(size_t) ((total - 1) * (p))] : 0)
+  printf("requests=%lu errors=%ld rps=%.1f p50_us=%ld p90_us=%ld p99_us=%ld max_us=%ld\n",
+    (unsigned long) total, errors, total / elapsed, PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99), PERCENTILE(1.0));
+  return 0;
+}
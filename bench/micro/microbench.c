@@ -0,0 +1,349 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+// Runs mod_dart's handler in a loop against fake requests (see stubs.c), and reports the time per request,
+// or per call for the benchmarks of individual natives.
+//
+// microbench [-D Directive=value]... [-t seconds] [-j threads] scriptdir [benchmark...]
+//
+// A directive's arguments are separated by spaces, as in httpd.conf: -D "DartSnapshotDirectory=/srv/dart recursive".
+//
+// With -j, that many threads serve requests at once (like a worker MPM child with ThreadsPerChild threads),
+// and the time per request is the wall clock time divided by the total number of requests.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "httpd.h"
+#include "http_config.h"
+#include "apr_atomic.h"
+#include "apr_general.h"
+#include "apr_network_io.h"
+#include "apr_strings.h"
+#include "apr_thread_proc.h"
+
+#include "stubs.h"
+
+extern module AP_MODULE_DECLARE_DATA dart_module;
+
+typedef struct microbenchmark {
+  const char *name;
+  const char *script;
+  const char *query;
+  int ops; // calls per request with ?n=ops (and the query, if any); the time of ?n=0 is subtracted. 0 to time whole requests
+  apr_size_t body_size;
+  const char *baseline; // for whole requests, a script whose time per request is subtracted, or NULL
+} microbenchmark;
+
+static const microbenchmark benchmarks[] = {
+  { "request/hello", "hello.dart", NULL, 0, 0 },
+  { "request/snapshot", "snapshot.dart", NULL, 0, 0 },
+  { "request/query-20-params", "query.dart",
+    "a=1&b=2&c=3&d=4&e=5&f=6&g=7&h=8&i=9&j=10&k=11&l=12&m=13&n=14&o=15&p=16&q=17&r=18&s=19&t=hello+world%21", 0, 0 },
+  { "request/read-1mb", "read.dart", NULL, 0, 1 << 20 },
+  { "request/cache-hit", "cache.dart", "op=hit", 0, 0 },
+  { "request/cache-miss", "cache.dart", "op=miss", 0, 0 },
+  // Creating (and shutting down) an isolate, compared with reusing one
+  { "isolate/create", "fresh.dart", NULL, 0, 0, "empty.dart" },
+  { "native/write", "write.dart", NULL, 10000, 0 },
+  { "native/writeList-64", "writelist.dart", NULL, 10000, 0 },
+  { "native/header-lookup", "headers.dart", NULL, 1000, 0 },
+  // Resolving natives (NativeResolver), as a new isolate does on the first call of each
+  { "native/lookup-12", "natives.dart", NULL, 0, 0, "fresh.dart" },
+  { "native/shared-get", "shared.dart", "op=get", 1000, 0 },
+  { "native/shared-put", "shared.dart", "op=put", 1000, 0 },
+  { "native/shared-cas", "shared.dart", "op=cas", 1000, 0 },
+};
+
+static apr_pool_t *pconf;
+static server_rec *server;
+static void **dir_config;
+static char *body;
+static int threads = 1;
+static volatile apr_uint32_t request_count; // numbers requests across threads, see X-Microbench-Request
+
+static void **new_config_vector(apr_pool_t *pool, void *config) {
+  void **vector = (void**) apr_pcalloc(pool, sizeof(void*) * (dart_module.module_index + 1));
+  vector[dart_module.module_index] = config;
+  return vector;
+}
+
+static void fail(const char *message, const char *detail) {
+  fprintf(stderr, "microbench: %s%s\n", message, detail ? detail : "");
+  exit(1);
+}
+
+typedef const char *(*directive_take0)(cmd_parms*, void*);
+typedef const char *(*directive_take1)(cmd_parms*, void*, const char*);
+typedef const char *(*directive_take2)(cmd_parms*, void*, const char*, const char*);
+typedef const char *(*directive_flag)(cmd_parms*, void*, int);
+
+// Calls a directive's handler as httpd would, [arg] holding its arguments separated by spaces.
+static void directive(const char *name, const char *arg) {
+  for (const command_rec *cmd = dart_module.cmds; cmd->name; cmd++) {
+    if (strcasecmp(cmd->name, name)) continue;
+    cmd_parms parms;
+    memset(&parms, 0, sizeof(parms));
+    parms.pool = parms.temp_pool = pconf;
+    parms.server = server;
+    parms.info = cmd->cmd_data;
+    parms.cmd = cmd;
+    void *config = dir_config[dart_module.module_index];
+    char *state;
+    char *first = apr_strtok(apr_pstrdup(pconf, arg), " ", &state);
+    char *second = first ? apr_strtok(NULL, " ", &state) : NULL;
+    bool extra = second && apr_strtok(NULL, " ", &state);
+    const char *error;
+    switch (cmd->args_how) {
+      case RAW_ARGS: error = ((directive_take1) cmd->func)(&parms, config, arg); break;
+      case NO_ARGS: error = first ? "takes no arguments" : ((directive_take0) cmd->func)(&parms, config); break;
+      case TAKE1: error = (!first || second) ? "takes one argument" : ((directive_take1) cmd->func)(&parms, config, first); break;
+      case TAKE2: error = (!second || extra) ? "takes two arguments" : ((directive_take2) cmd->func)(&parms, config, first, second); break;
+      case TAKE12: error = (!first || extra) ? "takes one or two arguments" : ((directive_take2) cmd->func)(&parms, config, first, second); break;
+      case FLAG:
+        if (!first || second || (strcasecmp(first, "on") && strcasecmp(first, "off"))) {
+          error = "must be On or Off";
+        } else {
+          error = ((directive_flag) cmd->func)(&parms, config, !strcasecmp(first, "on"));
+        }
+        break;
+      default: error = "has arguments microbench can't pass";
+    }
+    if (error) fail(apr_pstrcat(pconf, cmd->name, " ", error, NULL), NULL);
+    return;
+  }
+  fail("Unknown directive ", name);
+}
+
+static void start(const char *scripts) {
+  process_rec *process = (process_rec*) apr_pcalloc(pconf, sizeof(process_rec));
+  process->pool = process->pconf = pconf;
+  process->short_name = "microbench";
+  server = (server_rec*) apr_pcalloc(pconf, sizeof(server_rec));
+  server->process = process;
+  server->server_hostname = "localhost";
+  server->port = 80;
+  server->module_config = (ap_conf_vector_t*) new_config_vector(pconf, dart_module.create_server_config(pconf, server));
+  dir_config = new_config_vector(pconf, dart_module.create_dir_config(pconf, NULL));
+  dart_module.register_hooks(pconf);
+  directive("DartSnapshot", apr_pstrcat(pconf, scripts, "/snapshot.dart", NULL));
+  // So that isolate/create and native/lookup-12 time the isolates, not parsing the scripts
+  directive("DartSnapshot", apr_pstrcat(pconf, scripts, "/empty.dart", NULL));
+  directive("DartSnapshot", apr_pstrcat(pconf, scripts, "/fresh.dart", NULL));
+  directive("DartSnapshot", apr_pstrcat(pconf, scripts, "/natives.dart", NULL));
+
+  body = (char*) apr_palloc(pconf, 1 << 20);
+  for (int i = 0; i < (1 << 20); i++) body[i] = (char) i;
+}
+
+// A connection for one thread, with its own pool and bucket allocator, as a worker MPM thread would have.
+static conn_rec *new_connection() {
+  apr_allocator_t *allocator;
+  apr_pool_t *pool;
+  apr_allocator_create(&allocator);
+  apr_pool_create_ex(&pool, pconf, NULL, allocator);
+  apr_allocator_owner_set(allocator, pool);
+  conn_rec *connection = (conn_rec*) apr_pcalloc(pool, sizeof(conn_rec));
+  connection->pool = pool;
+  connection->base_server = server;
+  connection->bucket_alloc = apr_bucket_alloc_create(pool);
+  connection->local_host = (char*) "localhost";
+  connection->local_ip = (char*) "127.0.0.1";
+  apr_sockaddr_info_get(&(connection->local_addr), "127.0.0.1", APR_INET, 80, 0, pool);
+  connection->keepalive = AP_CONN_UNKNOWN;
+  return connection;
+}
+
+static void init() {
+  for (int pass = 0; pass < 2; pass++) { // httpd's first pass is a dry run, which mod_dart skips
+    for (int i = 0; i < hooks.post_config_count; i++) {
+      if (hooks.post_configs[i](pconf, pconf, pconf, server) != OK) fail("post_config failed", NULL);
+    }
+  }
+  apr_pool_t *pchild;
+  apr_pool_create(&pchild, pconf);
+  hooks.child_init(pchild, server);
+}
+
+// Serves one request, like ap_invoke_handler and then the end of the request would.
+static void serve(conn_rec *connection, const char *filename, const char *query, apr_size_t body_size) {
+  apr_pool_t *pool;
+  apr_pool_create(&pool, connection->pool);
+  request_rec *r = (request_rec*) apr_pcalloc(pool, sizeof(request_rec));
+  r->pool = pool;
+  r->connection = connection;
+  r->server = server;
+  r->request_time = apr_time_now();
+  r->method = body_size ? "POST" : "GET";
+  r->method_number = body_size ? M_POST : M_GET;
+  r->protocol = (char*) "HTTP/1.1";
+  r->proto_num = 1001;
+  r->hostname = "localhost";
+  r->status = HTTP_OK;
+  // What a browser sends for a page
+  r->headers_in = apr_table_make(pool, 16);
+  apr_table_setn(r->headers_in, "Host", "localhost");
+  apr_table_setn(r->headers_in, "Connection", "keep-alive");
+  apr_table_setn(r->headers_in, "Cache-Control", "max-age=0");
+  apr_table_setn(r->headers_in, "Accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8");
+  apr_table_setn(r->headers_in, "User-Agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.11 (KHTML, like Gecko) "
+                                               "Chrome/23.0.1271.97 Safari/537.11");
+  apr_table_setn(r->headers_in, "Referer", "http://localhost/index.html");
+  apr_table_setn(r->headers_in, "Accept-Encoding", "gzip,deflate,sdch");
+  apr_table_setn(r->headers_in, "Accept-Language", "en-US,en;q=0.8");
+  apr_table_setn(r->headers_in, "Accept-Charset", "ISO-8859-1,utf-8;q=0.7,*;q=0.3");
+  apr_table_setn(r->headers_in, "Cookie", "session=5f2b8c1e9a7d4e3f; theme=dark; __utma=111872281.1974583722.1355000000.1355000000.1355000000.1");
+  apr_table_setn(r->headers_in, "If-None-Match", "\"3e86-410-3596fbbc\"");
+  apr_table_setn(r->headers_in, "If-Modified-Since", "Mon, 10 Dec 2012 08:00:00 GMT");
+  apr_table_setn(r->headers_in, "X-Microbench-Request", apr_itoa(pool, (int) apr_atomic_inc32(&request_count)));
+  if (body_size) apr_table_setn(r->headers_in, "Content-Length", apr_psprintf(pool, "%lu", (unsigned long) body_size));
+  r->headers_out = apr_table_make(pool, 8);
+  r->err_headers_out = apr_table_make(pool, 2);
+  r->subprocess_env = apr_table_make(pool, 2);
+  r->notes = apr_table_make(pool, 2);
+  r->handler = "dart";
+  r->filename = (char*) filename;
+  r->uri = r->parsed_uri.path = (char*) filename;
+  r->args = r->parsed_uri.query = (char*) query;
+  if (apr_stat(&(r->finfo), filename, APR_FINFO_MIN, pool) != APR_SUCCESS) fail("Can't stat ", filename);
+  r->per_dir_config = (ap_conf_vector_t*) dir_config;
+  r->request_config = (ap_conf_vector_t*) new_config_vector(pool, NULL);
+
+  fake_output *output = (fake_output*) apr_pcalloc(pool, sizeof(fake_output));
+  r->output_filters = (ap_filter_t*) apr_pcalloc(pool, sizeof(ap_filter_t));
+  r->output_filters->ctx = output;
+  fake_input *input = (fake_input*) apr_pcalloc(pool, sizeof(fake_input));
+  input->data = body;
+  input->length = body_size;
+  r->input_filters = (ap_filter_t*) apr_pcalloc(pool, sizeof(ap_filter_t));
+  r->input_filters->ctx = input;
+
+  int result = DECLINED;
+  for (int i = 0; i < hooks.handler_count && result == DECLINED; i++) result = hooks.handlers[i](r);
+  if (result != OK || r->status != HTTP_OK) fail("Request failed: ", filename);
+  apr_pool_destroy(pool); // checks the isolate back in
+}
+
+typedef struct measurement {
+  const char *filename;
+  const char *query;
+  apr_size_t body_size;
+  apr_time_t warm; // when the warm-up ends
+  apr_time_t end;
+  long requests; // served by this thread after the warm-up
+  apr_time_t finished;
+} measurement;
+
+static void * APR_THREAD_FUNC measure_thread(apr_thread_t *thread, void *data) {
+  measurement *m = (measurement*) data;
+  conn_rec *connection = new_connection();
+  while (apr_time_now() < m->warm) serve(connection, m->filename, m->query, m->body_size);
+  do {
+    serve(connection, m->filename, m->query, m->body_size);
+    m->requests++;
+  } while ((m->finished = apr_time_now()) < m->end);
+  apr_pool_destroy(connection->pool);
+  if (thread) apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+// Nanoseconds per request (of wall clock time, with several threads), after a short warm-up.
+static double measure(const char *filename, const char *query, apr_size_t body_size, double seconds, long *requests) {
+  measurement *m = (measurement*) apr_pcalloc(pconf, threads * sizeof(measurement));
+  apr_thread_t **running = (apr_thread_t**) apr_pcalloc(pconf, threads * sizeof(apr_thread_t*));
+  apr_time_t begin = apr_time_now() + (apr_interval_time_t) (seconds * APR_USEC_PER_SEC / 5);
+  for (int i = 0; i < threads; i++) {
+    m[i].filename = filename;
+    m[i].query = query;
+    m[i].body_size = body_size;
+    m[i].warm = begin;
+    m[i].end = begin + (apr_interval_time_t) (seconds * APR_USEC_PER_SEC);
+  }
+  if (threads == 1) {
+    measure_thread(NULL, m);
+  } else {
+    for (int i = 0; i < threads; i++) {
+      if (apr_thread_create(&running[i], NULL, measure_thread, &m[i], pconf) != APR_SUCCESS) fail("Can't start threads", NULL);
+    }
+    apr_status_t rv;
+    for (int i = 0; i < threads; i++) apr_thread_join(&rv, running[i]);
+  }
+  long count = 0;
+  apr_time_t finished = begin;
+  for (int i = 0; i < threads; i++) {
+    count += m[i].requests;
+    if (m[i].finished > finished) finished = m[i].finished;
+  }
+  *requests = count;
+  return (finished - begin) * 1000.0 / count;
+}
+
+static void run(const microbenchmark *benchmark, const char *scripts, const char *config, double seconds) {
+  const char *filename = apr_pstrcat(pconf, scripts, "/", benchmark->script, NULL);
+  long requests, baseline_requests;
+  double ns;
+  if (benchmark->ops) {
+    const char *query = benchmark->query ? apr_pstrcat(pconf, "&", benchmark->query, NULL) : "";
+    double baseline = measure(filename, apr_pstrcat(pconf, "n=0", query, NULL), benchmark->body_size, seconds, &baseline_requests);
+    ns = measure(filename, apr_psprintf(pconf, "n=%d%s", benchmark->ops, query), benchmark->body_size, seconds, &requests);
+    ns = (ns - baseline) / benchmark->ops;
+  } else {
+    ns = measure(filename, benchmark->query, benchmark->body_size, seconds, &requests);
+    if (benchmark->baseline) {
+      const char *baseline = apr_pstrcat(pconf, scripts, "/", benchmark->baseline, NULL);
+      ns -= measure(baseline, benchmark->query, benchmark->body_size, seconds, &baseline_requests);
+    }
+  }
+  printf("benchmark=%s config=%s threads=%d ns_per_op=%.1f requests=%ld\n", benchmark->name, config, threads, ns, requests);
+  fflush(stdout);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: microbench [-D Directive=value]... [-t seconds] [-j threads] scriptdir [benchmark...]\n");
+  exit(2);
+}
+
+int main(int argc, const char * const *argv) {
+  apr_app_initialize(&argc, &argv, NULL);
+  atexit(apr_terminate);
+  apr_pool_create(&pconf, NULL);
+
+  double seconds = 1;
+  const char *config = "default";
+  apr_array_header_t *directives = apr_array_make(pconf, 4, sizeof(const char*));
+  int opt;
+  while ((opt = getopt(argc, (char**) argv, "D:t:j:")) != -1) {
+    switch (opt) {
+      case 'D':
+        *(const char**) apr_array_push(directives) = optarg;
+        config = strcmp(config, "default") ? apr_pstrcat(pconf, config, ",", optarg, NULL) : optarg;
+        break;
+      case 't': seconds = atof(optarg); break;
+      case 'j': threads = atoi(optarg); break;
+      default: usage();
+    }
+  }
+  if (optind >= argc || seconds <= 0 || threads < 1) usage();
+  fake_threads = threads;
+  char *scripts;
+  if (apr_filepath_merge(&scripts, NULL, argv[optind], APR_FILEPATH_NOTRELATIVE, pconf) != APR_SUCCESS) usage();
+
+  start(scripts);
+  for (int i = 0; i < directives->nelts; i++) {
+    char *name = apr_pstrdup(pconf, ((const char**) directives->elts)[i]);
+    char *value = strchr(name, '=');
+    if (!value) usage();
+    *value++ = 0;
+    directive(name, value);
+  }
+  init();
+
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(microbenchmark); i++) {
+    bool selected = (optind + 1 == argc);
+    for (int arg = optind + 1; arg < argc; arg++) selected |= !strcmp(argv[arg], benchmarks[i].name);
+    if (selected) run(&benchmarks[i], scripts, config, seconds);
+  }
+  return 0;
+}
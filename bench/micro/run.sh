@@ -0,0 +1,59 @@
+#!/bin/bash
+# Builds bench/micro/microbench, which links mod_dart with a fake httpd (stubs.c), and runs it
+# with a few isolate configurations. Settings (environment variables):
+#   SECONDS_PER_RUN  time spent measuring each benchmark (default 1)
+#   BENCHMARKS       benchmarks to run (default: all, see microbench.c)
+#   THREADS          thread counts for the scaling runs of request/hello and request/snapshot (default "1 2 4 8")
+
+MICRO=$(cd "$(dirname "$0")" && pwd)
+cd "$MICRO/../.."
+. build.config
+
+type "$APXS" >/dev/null 2>&1 || APXS="apxs2"
+type "$APXS" >/dev/null 2>&1 || APXS="apxs"
+type "$APXS" >/dev/null || { echo "Couldn't find APXS, edit build.config"; exit 1; }
+
+UNAME=`uname`
+if [[ "$UNAME" == "Darwin" ]]; then
+  DART_LIB=$DART_SRC/runtime/xcodebuild/${DART_MODE}$DART_ARCH
+  DART_GEN=$DART_SRC/runtime/xcodebuild/DerivedSources/${DART_MODE}$DART_ARCH
+  LIBRARY_GROUP_START=
+  LIBRARY_GROUP_END=
+  WEB_GEN="$DART_LIB/../dart-runtime.build/${DART_MODE}$DART_ARCH/dart.build/Objects-normal/*/web_gen.o"
+else
+  DART_LIB=$DART_SRC/runtime/out/${DART_MODE}$DART_ARCH/obj.target/runtime
+  DART_GEN=$DART_SRC/runtime/out/${DART_MODE}$DART_ARCH/obj/gen
+  LIBRARY_GROUP_START=-Wl,--start-group
+  LIBRARY_GROUP_END=-Wl,--end-group
+  WEB_GEN=$DART_LIB/../dart/gen/web_gen.o
+fi
+
+if [[ "$DART_MODE" == "Debug" ]]; then
+  COPTS="-DDEBUG"
+else
+  COPTS="-DNDEBUG -O2"
+fi
+
+APR_CONFIG=$($APXS -q APR_CONFIG)
+APU_CONFIG=$($APXS -q APU_CONFIG)
+OUT=$MICRO/microbench
+
+rm -f src/mod_dart_gen.c; python $DART_SRC/runtime/tools/create_string_literal.py --output src/mod_dart_gen.c --include 'none' --input_cc src/mod_dart_gen.c.tmpl --var_name "mod_dart_source" src/mod_dart.dart
+rm -f src/mod_dart_cache_gen.c; python $DART_SRC/runtime/tools/create_string_literal.py --output src/mod_dart_cache_gen.c --include 'none' --input_cc src/mod_dart_gen.c.tmpl --var_name "mod_dart_cache_source" src/cache.dart
+rm -f src/mod_dart_shared_gen.c; python $DART_SRC/runtime/tools/create_string_literal.py --output src/mod_dart_shared_gen.c --include 'none' --input_cc src/mod_dart_gen.c.tmpl --var_name "mod_dart_shared_source" src/shared.dart
+g++ $COPTS -Wall -Werror -x c++ -pthread -o "$OUT" -I src -I "$MICRO" -I $DART_SRC/runtime -I $DART_GEN \
+  -I $($APXS -q INCLUDEDIR) $($APR_CONFIG --includes --cppflags) $($APU_CONFIG --includes) \
+  "$MICRO/microbench.c" "$MICRO/stubs.c" src/builtin.c src/mod_dart_gen.c src/mod_dart_cache_gen.c src/mod_dart_shared_gen.c src/apache_library.c src/cache.c src/status.c src/mod_dart.c \
+  -x none $LIBRARY_GROUP_START $DART_LIB/libdart_export.a $DART_LIB/libdart_builtin.a $DART_LIB/libdart_lib_withcore.a $DART_LIB/libdart_vm.a \
+  $DART_LIB/libjscre.a $DART_LIB/libdouble_conversion.a $WEB_GEN $LIBRARY_GROUP_END \
+  $($APU_CONFIG --link-ld --libs) $($APR_CONFIG --link-ld --libs) -lstdc++ || exit 1
+
+T="-t ${SECONDS_PER_RUN:-1}"
+"$OUT" $T "$MICRO/scripts" $BENCHMARKS
+"$OUT" $T -D DartIsolateMaxRequests=0 "$MICRO/scripts" $BENCHMARKS
+"$OUT" $T -D DartIsolatePoolSize=0 "$MICRO/scripts" request/hello request/snapshot
+# A fresh isolate per request, loading a snapshot that was warmed up first (compare with request/snapshot above)
+"$OUT" $T -D DartIsolatePoolSize=0 -D DartSnapshotWarmup=warmup "$MICRO/scripts" request/snapshot
+for threads in ${THREADS:-1 2 4 8}; do
+  "$OUT" $T -j $threads -D DartIsolateMaxRequests=0 "$MICRO/scripts" request/hello request/snapshot
+done
@@ -0,0 +1,13 @@
+#import('apache:handler');
+#import('apache:cache');
+
+// ?op=hit is cached once and then served from the cache. ?op=miss is keyed by a header that microbench
+// numbers, so every request runs the script and stores a new response.
+main() {
+  if (request.queryParameters['op'] == 'miss') {
+    cacheResponse(60, true, ['X-Microbench-Request']);
+  } else {
+    cacheResponse(60);
+  }
+  print("Hello, cached dart!");
+}
@@ -0,0 +1,4 @@
+#import('apache:handler');
+
+main() {
+}
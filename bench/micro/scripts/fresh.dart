@@ -0,0 +1,7 @@
+#import('apache:handler');
+#import('dart:isolate');
+
+// The open port stops the isolate from being reused, so every request gets a new one
+main() {
+  new ReceivePort();
+}
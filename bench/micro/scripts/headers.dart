@@ -0,0 +1,12 @@
+#import('apache:handler');
+
+main() {
+  var n = Math.parseInt(request.queryParameters['n']);
+  response.headers.set("X-Bench", "value");
+  var requestHeaders = request.headers;
+  var headers = response.headers;
+  for (var i = 0; i < n; i++) {
+    requestHeaders.value("accept-language");
+    headers.value("x-bench");
+  }
+}
@@ -0,0 +1,17 @@
+#import('apache:handler');
+#import('dart:isolate');
+
+// Like fresh.dart, and then calls 12 natives, which a new isolate looks up on their first call
+main() {
+  new ReceivePort();
+  request.uri;
+  request.path;
+  request.method;
+  request.persistentConnection;
+  request.protocolVersion;
+  request.headers.value("host");
+  response.statusCode;
+  response.contentLength;
+  response.headers.add("X-Bench", "value");
+  response.outputStream.writeString("x");
+}
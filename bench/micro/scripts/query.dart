@@ -0,0 +1,5 @@
+#import('apache:handler');
+
+main() {
+  print(request.queryParameters.length);
+}
@@ -0,0 +1,21 @@
+#import('apache:handler');
+#import('apache:shared');
+
+// ?op=get, put or cas on 16 keys, which are kept from one request to the next
+main() {
+  var n = Math.parseInt(request.queryParameters['n']);
+  var op = request.queryParameters['op'];
+  var value = "a value kept in shared memory for every request";
+  var keys = new List<String>(16);
+  for (var i = 0; i < keys.length; i++) {
+    keys[i] = "microbench/shared/$i";
+    if (shared[keys[i]] == null) shared[keys[i]] = value;
+  }
+  if (op == "get") {
+    for (var i = 0; i < n; i++) shared[keys[i & 15]];
+  } else if (op == "put") {
+    for (var i = 0; i < n; i++) shared[keys[i & 15]] = value;
+  } else {
+    for (var i = 0; i < n; i++) shared.compareAndSwap(keys[i & 15], value, value);
+  }
+}
@@ -0,0 +1,8 @@
+#import('apache:handler');
+
+main() {
+  print("Hello, dart!");
+}
+
+// For DartSnapshotWarmup=warmup
+warmup() => main();
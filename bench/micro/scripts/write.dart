@@ -0,0 +1,7 @@
+#import('apache:handler');
+
+main() {
+  var n = Math.parseInt(request.queryParameters['n']);
+  var out = response.outputStream;
+  for (var i = 0; i < n; i++) out.writeString("x");
+}
@@ -0,0 +1,9 @@
+#import('apache:handler');
+
+main() {
+  var n = Math.parseInt(request.queryParameters['n']);
+  var out = response.outputStream;
+  var data = new List<int>(64);
+  for (var i = 0; i < data.length; i++) data[i] = i;
+  for (var i = 0; i < n; i++) out.writeFrom(data, 0, data.length);
+}
@@ -0,0 +1,237 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+// Just enough of httpd for mod_dart to run inside microbench: the hooks it registers are
+// captured rather than run, filters are in-memory, and logging goes to stderr.
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "http_request.h"
+#include "ap_mpm.h"
+#include "ap_release.h"
+#include "apr_lib.h"
+#include "apr_md5.h"
+#include "apr_strings.h"
+#include "util_filter.h"
+#include "util_md5.h"
+#ifdef AP_NEED_SET_MUTEX_PERMS
+#include "unixd.h"
+#endif
+
+#include "stubs.h"
+
+#define AP_24 (AP_SERVER_MAJORVERSION_NUMBER == 2 && AP_SERVER_MINORVERSION_NUMBER >= 4)
+
+fake_hooks hooks;
+int fake_threads = 1;
+
+// Hooks
+
+AP_DECLARE(void) ap_hook_handler(ap_HOOK_handler_t *pf, const char * const *aszPre, const char * const *aszSucc, int nOrder) {
+  if (hooks.handler_count < FAKE_MAX_HOOKS) hooks.handlers[hooks.handler_count++] = pf;
+}
+
+AP_DECLARE(void) ap_hook_post_config(ap_HOOK_post_config_t *pf, const char * const *aszPre, const char * const *aszSucc, int nOrder) {
+  if (hooks.post_config_count < FAKE_MAX_HOOKS) hooks.post_configs[hooks.post_config_count++] = pf;
+}
+
+AP_DECLARE(void) ap_hook_child_init(ap_HOOK_child_init_t *pf, const char * const *aszPre, const char * const *aszSucc, int nOrder) {
+  hooks.child_init = pf;
+}
+
+// Configuration (the parentheses stop these being expanded when they are also macros)
+
+AP_DECLARE(void *) (ap_get_module_config)(const ap_conf_vector_t *cv, const module *m) {
+  return ((void **) cv)[m->module_index];
+}
+
+AP_DECLARE(void) (ap_set_module_config)(ap_conf_vector_t *cv, const module *m, void *val) {
+  ((void **) cv)[m->module_index] = val;
+}
+
+AP_DECLARE(const char *) ap_check_cmd_context(cmd_parms *cmd, unsigned forbidden) {
+  return NULL;
+}
+
+AP_DECLARE(char *) ap_server_root_relative(apr_pool_t *p, const char *fname) {
+  return apr_pstrdup(p, fname);
+}
+
+#ifdef AP_NEED_SET_MUTEX_PERMS
+#if AP_24
+AP_DECLARE(apr_status_t) ap_unixd_set_global_mutex_perms(apr_global_mutex_t *gmutex) {
+#else
+AP_DECLARE(apr_status_t) unixd_set_global_mutex_perms(apr_global_mutex_t *gmutex) {
+#endif
+  return APR_SUCCESS; // microbench is a single process
+}
+#endif
+
+// Logging
+
+static void log_message(const char *file, int line, int level, apr_status_t status, const char *fmt, va_list args) {
+  char buffer[256] = "";
+  if (status) apr_strerror(status, buffer, sizeof(buffer));
+  fprintf(stderr, "[%s:%d] ", file, line);
+  vfprintf(stderr, fmt, args);
+  fprintf(stderr, "%s%s\n", status ? ": " : "", buffer);
+}
+
+#if AP_24
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index, int level, apr_status_t status,
+                               const server_rec *s, const char *fmt, ...) {
+#else
+AP_DECLARE(void) ap_log_error(const char *file, int line, int level, apr_status_t status, const server_rec *s, const char *fmt, ...) {
+#endif
+  va_list args;
+  va_start(args, fmt);
+  log_message(file, line, level, status, fmt, args);
+  va_end(args);
+}
+
+#if AP_24
+AP_DECLARE(void) ap_log_rerror_(const char *file, int line, int module_index, int level, apr_status_t status,
+                                const request_rec *r, const char *fmt, ...) {
+#else
+AP_DECLARE(void) ap_log_rerror(const char *file, int line, int level, apr_status_t status, const request_rec *r, const char *fmt, ...) {
+#endif
+  va_list args;
+  va_start(args, fmt);
+  log_message(file, line, level, status, fmt, args);
+  va_end(args);
+}
+
+#if AP_24
+AP_DECLARE(void) ap_log_perror_(const char *file, int line, int module_index, int level, apr_status_t status,
+                                apr_pool_t *p, const char *fmt, ...) {
+#else
+AP_DECLARE(void) ap_log_perror(const char *file, int line, int level, apr_status_t status, apr_pool_t *p, const char *fmt, ...) {
+#endif
+  va_list args;
+  va_start(args, fmt);
+  log_message(file, line, level, status, fmt, args);
+  va_end(args);
+}
+
+// Filters: output is counted and thrown away, input comes from the fake_input in the filter's ctx.
+// Filters with an ap_filter_rec_t are called like httpd would
+
+AP_DECLARE(apr_status_t) ap_pass_brigade(ap_filter_t *filter, apr_bucket_brigade *bb) {
+  if (filter->frec) return filter->frec->filter_func.out_func(filter, bb); // a real filter, e.g. DartSnapshotWarmup's
+  fake_output *output = (fake_output*) filter->ctx;
+  for (apr_bucket *b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)) {
+    if (APR_BUCKET_IS_METADATA(b)) continue;
+    const char *data;
+    apr_size_t length;
+    apr_status_t rv = apr_bucket_read(b, &data, &length, APR_BLOCK_READ);
+    if (rv != APR_SUCCESS) return rv;
+    output->bytes += length;
+  }
+  output->passes++;
+  apr_brigade_cleanup(bb);
+  return APR_SUCCESS;
+}
+
+AP_DECLARE(apr_status_t) ap_get_brigade(ap_filter_t *filter, apr_bucket_brigade *bb, ap_input_mode_t mode,
+                                        apr_read_type_e block, apr_off_t readbytes) {
+  if (filter->frec) return filter->frec->filter_func.in_func(filter, bb, mode, block, readbytes);
+  fake_input *input = (fake_input*) filter->ctx;
+  if (input->offset < input->length) {
+    apr_size_t length = input->length - input->offset;
+    if ((apr_off_t) length > readbytes) length = readbytes;
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(input->data + input->offset, length, bb->bucket_alloc));
+    input->offset += length;
+  } else {
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+  }
+  return APR_SUCCESS;
+}
+
+// Responses
+
+AP_DECLARE(void) ap_set_content_length(request_rec *r, apr_off_t length) {
+  r->clength = length;
+  apr_table_setn(r->headers_out, "Content-Length", apr_off_t_toa(r->pool, length));
+}
+
+AP_DECLARE(void) ap_set_content_type(request_rec *r, const char *ct) {
+  r->content_type = ct;
+}
+
+#if AP_24
+AP_DECLARE(int) ap_rwrite(const void *buf, int nbyte, request_rec *r) {
+  ((fake_output*) r->output_filters->ctx)->bytes += nbyte;
+  return nbyte;
+}
+#else
+AP_DECLARE(int) ap_rputs(const char *str, request_rec *r) {
+  ((fake_output*) r->output_filters->ctx)->bytes += strlen(str);
+  return strlen(str);
+}
+#endif
+
+AP_DECLARE_NONSTD(int) ap_rprintf(request_rec *r, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  char *text = apr_pvsprintf(r->pool, fmt, args);
+  va_end(args);
+  ((fake_output*) r->output_filters->ctx)->bytes += strlen(text);
+  return strlen(text);
+}
+
+// MPM: a threaded one that never suspends requests (DartSuspend)
+
+AP_DECLARE(apr_status_t) ap_mpm_query(int query_code, int *result) {
+  *result = (query_code == AP_MPMQ_MAX_THREADS) ? fake_threads : 0;
+  return APR_SUCCESS;
+}
+
+#ifdef AP_MPMQ_CAN_SUSPEND
+AP_DECLARE(apr_status_t) ap_mpm_register_timed_callback(apr_time_t t, ap_mpm_callback_fn_t *cbfn, void *baton) {
+  return APR_ENOTIMPL;
+}
+
+AP_DECLARE(apr_status_t) ap_mpm_resume_suspended(conn_rec *c) {
+  return APR_ENOTIMPL;
+}
+
+AP_DECLARE(void) ap_finalize_request_protocol(request_rec *r) {
+}
+
+AP_DECLARE(void) ap_die(int type, request_rec *r) {
+}
+
+AP_DECLARE(void) ap_process_request_after_handler(request_rec *r) {
+}
+#endif
+
+// Utilities
+
+AP_DECLARE(char *) ap_field_noparam(apr_pool_t *p, const char *intype) {
+  const char *semi = strchr(intype, ';');
+  if (!semi) return apr_pstrdup(p, intype);
+  while (semi > intype && apr_isspace(semi[-1])) semi--;
+  return apr_pstrndup(p, intype, semi - intype);
+}
+
+#if AP_24
+AP_DECLARE(char *) ap_escape_html2(apr_pool_t *p, const char *s, int toasc) {
+#else
+AP_DECLARE(char *) ap_escape_html(apr_pool_t *p, const char *s) {
+#endif
+  return apr_pstrdup(p, s); // only used by the dart-status page
+}
+
+AP_DECLARE(char *) ap_md5(apr_pool_t *p, const unsigned char *string) {
+  unsigned char digest[APR_MD5_DIGESTSIZE];
+  apr_md5(digest, string, strlen((const char*) string));
+  char *result = (char*) apr_palloc(p, APR_MD5_DIGESTSIZE * 2 + 1);
+  for (int i = 0; i < APR_MD5_DIGESTSIZE; i++) sprintf(result + i * 2, "%02x", digest[i]);
+  return result;
+}
@@ -0,0 +1,41 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+#ifndef MOD_DART_BENCH_STUBS_H
+#define MOD_DART_BENCH_STUBS_H
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_request.h"
+
+#define FAKE_MAX_HOOKS 4
+
+// The hooks mod_dart registered, in order.
+typedef struct fake_hooks {
+  ap_HOOK_handler_t *handlers[FAKE_MAX_HOOKS];
+  int handler_count;
+  ap_HOOK_post_config_t *post_configs[FAKE_MAX_HOOKS];
+  int post_config_count;
+  ap_HOOK_child_init_t *child_init;
+} fake_hooks;
+
+extern fake_hooks hooks;
+
+// Threads per child reported to mod_dart by ap_mpm_query (microbench -j).
+extern int fake_threads;
+
+// ctx of the fake output filter.
+typedef struct fake_output {
+  apr_off_t bytes;
+  int passes;
+} fake_output;
+
+// ctx of the fake input filter, which serves data in chunks of the size requested.
+typedef struct fake_input {
+  const char *data;
+  apr_size_t length;
+  apr_size_t offset;
+} fake_input;
+
+#endif
@@ -0,0 +1,96 @@
+#!/bin/bash
+# Runs the mod_dart load benchmarks against a throwaway httpd on a loopback port.
+#
+# Each workload in bench/scripts is served with and without DartSnapshot, and driven by bench/loadgen
+# at each concurrency level. Results are printed one line per run:
+#   workload=hello snapshot=yes concurrency=4 requests=... errors=... rps=... p50_us=... p90_us=... p99_us=... max_us=...
+#
+# Settings (environment variables):
+#   MOD_DART     mod_dart.so to load (default: the one installed by build.sh)
+#   PORT         port to listen on (default 8971)
+#   MPM          MPM module to load, for Apache 2.4 (default prefork)
+#   CONCURRENCY  concurrency levels (default "1 4 16")
+#   DURATION     seconds per run (default 10), each run is preceded by a 1 second warm-up
+#   WORKLOADS    workloads to run (default: all of bench/scripts/*.dart)
+#   EXTRA_CONF   extra httpd.conf lines, e.g. "DartIsolateMaxRequests 0"
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+cd "$BENCH/.."
+. build.config
+
+type "$APXS" >/dev/null 2>&1 || APXS="apxs2"
+type "$APXS" >/dev/null 2>&1 || APXS="apxs"
+type "$APXS" >/dev/null || { echo "Couldn't find APXS, edit build.config"; exit 1; }
+
+type "$HTTPD" >/dev/null 2>&1 || HTTPD="httpd"
+type "$HTTPD" >/dev/null 2>&1 || HTTPD="apache2"
+type "$HTTPD" >/dev/null || { echo "Couldn't find httpd, edit build.config"; exit 1; }
+
+MODULES=$($APXS -q LIBEXECDIR)
+MOD_DART=${MOD_DART:-$MODULES/mod_dart.so}
+PORT=${PORT:-8971}
+MPM=${MPM:-prefork}
+CONCURRENCY=${CONCURRENCY:-1 4 16}
+DURATION=${DURATION:-10}
+if [[ -z "$WORKLOADS" ]]; then
+  WORKLOADS=$(cd "$BENCH/scripts" && ls *.dart | sed 's/\.dart$//')
+fi
+
+WORK=$(mktemp -d -t mod_dart_bench.XXXXXX)
+CONF=$WORK/httpd.conf
+trap '"$HTTPD" -f "$CONF" -k stop >/dev/null 2>&1; sleep 1; rm -rf "$WORK"' EXIT
+
+cc -O2 -Wall -pthread -o "$WORK/loadgen" "$BENCH/loadgen.c" || exit 1
+head -c 262144 /dev/urandom > "$WORK/upload.bin"
+
+# The same scripts are served from two directories, only one of which has DartSnapshot directives
+mkdir -p "$WORK/docs" "$WORK/logs"
+cp -R "$BENCH/scripts" "$WORK/docs/plain"
+cp -R "$BENCH/scripts" "$WORK/docs/snap"
+
+{
+  echo "ServerRoot $WORK"
+  echo "Listen 127.0.0.1:$PORT"
+  echo "ServerName 127.0.0.1"
+  echo "PidFile $WORK/logs/httpd.pid"
+  echo "ErrorLog $WORK/logs/error_log"
+  for module in mpm_$MPM unixd authz_core; do
+    [[ -f "$MODULES/mod_$module.so" ]] && echo "LoadModule ${module}_module $MODULES/mod_$module.so"
+  done
+  echo "LoadModule dart_module $MOD_DART"
+  echo "DocumentRoot $WORK/docs"
+  echo "KeepAlive On"
+  echo "MaxKeepAliveRequests 0"
+  echo "<Directory $WORK/docs>"
+  echo "  SetHandler dart"
+  echo "</Directory>"
+  for script in "$WORK"/docs/snap/*.dart; do
+    echo "DartSnapshot $script"
+  done
+  echo "$EXTRA_CONF"
+} > "$CONF"
+
+"$HTTPD" -f "$CONF" -k start || { echo "httpd failed to start, see $CONF"; exit 1; }
+for i in $(seq 50); do
+  (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null && break
+  sleep 0.2
+done
+
+for workload in $WORKLOADS; do
+  BODY=
+  [[ "$workload" == "upload" ]] && BODY="-b $WORK/upload.bin"
+  for mode in plain snap; do
+    snapshot=no
+    [[ "$mode" == "snap" ]] && snapshot=yes
+    for concurrency in $CONCURRENCY; do
+      "$WORK/loadgen" -c "$concurrency" -d 1 $BODY 127.0.0.1 "$PORT" "/$mode/$workload.dart" >/dev/null
+      result=$("$WORK/loadgen" -c "$concurrency" -d "$DURATION" $BODY 127.0.0.1 "$PORT" "/$mode/$workload.dart")
+      echo "workload=$workload snapshot=$snapshot concurrency=$concurrency $result"
+    done
+  done
+done
+
+if grep -qE "(warn|error)\]" "$WORK/logs/error_log"; then
+  echo "Warnings were logged:" >&2
+  grep -E "(warn|error)\]" "$WORK/logs/error_log" | tail -20 >&2
+fi
@@ -0,0 +1,14 @@
+#import('apache:handler');
+#import('dart:io');
+
+// 1MB of bytes, written from one list
+var data;
+
+main() {
+  if (data == null) {
+    data = new List<int>(1 << 20);
+    for (var i = 0; i < data.length; i++) data[i] = i & 0xff;
+  }
+  response.headers.contentType = new ContentType.fromString("application/octet-stream");
+  response.outputStream.writeFrom(data, 0, data.length);
+}
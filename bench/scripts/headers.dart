@@ -0,0 +1,9 @@
+#import('apache:handler');
+
+// Reads every request header and sets many response headers
+main() {
+  var count = 0;
+  request.headers.forEach((name, values) => count += values.length);
+  for (var i = 0; i < 50; i++) response.headers.add("X-Bench-$i", "value $i");
+  print(count);
+}
@@ -0,0 +1,10 @@
+#import('apache:handler');
+#import('lib/a.dart');
+#import('lib/b.dart');
+#import('lib/c.dart');
+#import('lib/d.dart');
+
+// A script spread over several libraries
+main() {
+  print(a() + b() + c() + d());
+}
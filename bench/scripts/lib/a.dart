@@ -0,0 +1,4 @@
+#library('a');
+#source('a_part.dart');
+
+int a() => aPart().length;
@@ -0,0 +1 @@
+String aPart() => "aaa";
@@ -0,0 +1,4 @@
+#library('b');
+#source('b_part.dart');
+
+int b() => bPart().length;
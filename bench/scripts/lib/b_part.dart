@@ -0,0 +1 @@
+String bPart() => "bbb";
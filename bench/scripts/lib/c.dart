@@ -0,0 +1,4 @@
+#library('c');
+#source('c_part.dart');
+
+int c() => cPart().length;
@@ -0,0 +1 @@
+String cPart() => "ccc";
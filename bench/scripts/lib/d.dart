@@ -0,0 +1,4 @@
+#library('d');
+#source('d_part.dart');
+
+int d() => dPart().length;
@@ -0,0 +1 @@
+String dPart() => "ddd";
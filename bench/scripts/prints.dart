@@ -0,0 +1,6 @@
+#import('apache:handler');
+
+// Many small writes, as templates tend to produce
+main() {
+  for (var i = 0; i < 2000; i++) print("<li>Item number $i</li>");
+}
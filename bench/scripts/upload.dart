@@ -0,0 +1,7 @@
+#import('apache:handler');
+
+// Reads the whole request body
+main() {
+  var body = request.inputStream.readAll();
+  print(body.length);
+}
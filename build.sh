@@ -35,8 +35,10 @@ else
 fi
 
 rm src/mod_dart_gen.c; python $DART_SRC/runtime/tools/create_string_literal.py --output src/mod_dart_gen.c --include 'none' --input_cc src/mod_dart_gen.c.tmpl --var_name "mod_dart_source" src/mod_dart.dart
+rm src/mod_dart_cache_gen.c; python $DART_SRC/runtime/tools/create_string_literal.py --output src/mod_dart_cache_gen.c --include 'none' --input_cc src/mod_dart_gen.c.tmpl --var_name "mod_dart_cache_source" src/cache.dart
+rm src/mod_dart_shared_gen.c; python $DART_SRC/runtime/tools/create_string_literal.py --output src/mod_dart_shared_gen.c --include 'none' --input_cc src/mod_dart_gen.c.tmpl --var_name "mod_dart_shared_source" src/shared.dart
 LTFLAGS="--tag=CC" $APXS -S CC=g++ -c $COPTS -o mod_dart.so -Wc,-Wall -Wc,-Werror -I $DART_SRC/runtime -lstdc++ -I $DART_GEN \
 -Wl,-Wl$LIBRARY_GROUP_START,$DART_LIB/libdart_export.a,$DART_LIB/libdart_builtin.a,$DART_LIB/libdart_lib_withcore.a,$DART_LIB/libdart_vm.a,$DART_LIB/libjscre.a,$DART_LIB/libdouble_conversion.a,$WEB_GEN$LIBRARY_GROUP_END \
-src/builtin.c src/mod_dart_gen.c src/apache_library.c src/mod_dart.c && \
+src/builtin.c src/mod_dart_gen.c src/mod_dart_cache_gen.c src/mod_dart_shared_gen.c src/apache_library.c src/cache.c src/status.c src/mod_dart.c && \
 sudo $APXS -i -a -n dart mod_dart.la && \
 sudo apachectl restart
@@ -2,7 +2,9 @@
 // Licensed under the Apache License, Version 2.0 (the "License")
 // You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
 
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "include/dart_api.h"
 
 #include "httpd.h"
@@ -12,23 +14,93 @@
 #include "ap_config.h"
 #include "apr_buckets.h"
 #include "apr_strings.h"
+#include "util_md5.h"
+
+#include "apache_library.h"
+#include "cache.h"
 
 #define AP_WARN(r, message, ...) ap_log_error(APLOG_MARK, LOG_WARNING, 0, (r)->server, message "\n", ##__VA_ARGS__)
-extern Dart_Handle LoadFile(const char* cpath);
 extern const char *mod_dart_source;
+extern const char *mod_dart_cache_source;
+extern const char *mod_dart_shared_source;
+extern module AP_MODULE_DECLARE_DATA dart_module;
 
 typedef struct {
   request_rec *request;
   apr_bucket_brigade *brigade;
-  uint8_t *buffer;
+  apr_off_t chunk_size; // bytes requested from the input filters at a time
   bool eos;
 } dart_stream;
 
-static void Throw(const char* library, const char* exception, const char* message) {
-  Dart_Handle lib = Dart_LookupLibrary(Dart_NewString(library));
-  if (Dart_IsError(lib)) Dart_PropagateError(lib);
-  Dart_Handle cls = Dart_GetClass(lib, Dart_NewString(exception));
-  if (Dart_IsError(cls)) Dart_PropagateError(cls);
+// Per-request state of the natives, stored in r->request_config.
+// Response output is collected in brigade, and only passed to the output filters when
+// buffer_size is reached, on flush(), or when the request ends.
+typedef struct {
+  apr_bucket_brigade *brigade;
+  apr_off_t buffered; // bytes in brigade
+  apr_off_t buffer_size;
+  bool passed; // whether any output has been passed to the output filters yet
+  apr_off_t input_chunk_size;
+  dart_stream *input; // the request body, shared by inputStream and the form parser
+  apr_off_t form_max_size;
+  int form_max_fields;
+  dart_cache_capture *cache; // NULL unless the script called cacheResponse()
+} dart_request_state;
+
+typedef enum {
+  kException,
+  kStreamException
+} ExceptionType;
+
+static Dart_Handle keep(Dart_Handle handle, bool persistent) {
+  return (persistent && !Dart_IsError(handle)) ? Dart_NewPersistentHandle(handle) : handle;
+}
+
+static Dart_Handle load_handles(dart_library_handles *handles, bool persistent) {
+  // Looked up as local handles first, so that a failure leaves no persistent handles behind
+  dart_library_handles found;
+  Dart_Handle core = Dart_LookupLibrary(Dart_NewString("dart:core"));
+  if (Dart_IsError(core)) return core;
+  Dart_Handle io = Dart_LookupLibrary(Dart_NewString("dart:io"));
+  if (Dart_IsError(io)) return io;
+  found.library = Dart_LookupLibrary(Dart_NewString("apache:handler"));
+  if (Dart_IsError(found.library)) return found.library;
+  found.cache_library = Dart_LookupLibrary(Dart_NewString("apache:cache"));
+  if (Dart_IsError(found.cache_library)) return found.cache_library;
+  found.shared_library = Dart_LookupLibrary(Dart_NewString("apache:shared"));
+  if (Dart_IsError(found.shared_library)) return found.shared_library;
+  found.exception = Dart_GetClass(core, Dart_NewString("Exception"));
+  if (Dart_IsError(found.exception)) return found.exception;
+  found.stream_exception = Dart_GetClass(io, Dart_NewString("StreamException"));
+  if (Dart_IsError(found.stream_exception)) return found.stream_exception;
+  handles->library = keep(found.library, persistent);
+  handles->cache_library = keep(found.cache_library, persistent);
+  handles->shared_library = keep(found.shared_library, persistent);
+  handles->exception = keep(found.exception, persistent);
+  handles->stream_exception = keep(found.stream_exception, persistent);
+  handles->reset_request = keep(Dart_NewString("_resetRequest"), persistent);
+  handles->get_request = keep(Dart_NewString("get:request"), persistent);
+  handles->loaded = true;
+  return Dart_Null();
+}
+
+// Sets [result] to the current isolate's handles, loading them the first time.
+// Isolates without a cache (e.g. while snapshotting) look them up into [scratch] instead.
+static Dart_Handle get_handles(dart_library_handles **result, dart_library_handles *scratch) {
+  dart_library_handles *handles = DartIsolateHandles();
+  if (handles && handles->loaded) {
+    *result = handles;
+    return Dart_Null();
+  }
+  *result = handles ? handles : scratch;
+  return load_handles(*result, handles != NULL);
+}
+
+static void Throw(ExceptionType type, const char* message) {
+  dart_library_handles scratch, *handles;
+  Dart_Handle result = get_handles(&handles, &scratch);
+  if (Dart_IsError(result)) Dart_PropagateError(result);
+  Dart_Handle cls = (type == kStreamException) ? handles->stream_exception : handles->exception;
   Dart_Handle msg = message ? Dart_NewString(message) : Dart_Null();
   Dart_Handle exc = Dart_New(cls, Dart_Null(), message ? 1 : 0, &msg);
   if (Dart_IsError(exc)) Dart_PropagateError(exc);
@@ -38,21 +110,21 @@ static void Throw(const char* library, const char* exception, const char* messag
 static request_rec *get_request(Dart_Handle request) {
   intptr_t rptr;
   Dart_GetNativeInstanceField(request, 0, &rptr);
-  if (!rptr) Throw("dart:core", "Exception", "request.record_rec was NULL!");
+  if (!rptr) Throw(kException, "request.record_rec was NULL!");
   return (request_rec*) rptr;
 }
 
 static dart_stream *get_stream(Dart_Handle streamHandle) {
   intptr_t sptr;
   Dart_GetNativeInstanceField(streamHandle, 0, &sptr);
-  if (!sptr) Throw("dart:core", "Exception", "stream.dart_stream was NULL!");
+  if (!sptr) Throw(kException, "stream.dart_stream was NULL!");
   return (dart_stream*) sptr;
 }
 
 static apr_table_t *get_table(Dart_Handle headers) {
   intptr_t tptr;
   Dart_GetNativeInstanceField(headers, 0, &tptr);
-  if (!tptr) Throw("dart:core", "Exception", "headers.apr_table was NULL!");
+  if (!tptr) Throw(kException, "headers.apr_table was NULL!");
   return (apr_table_t*) tptr;
 }
 
@@ -60,21 +132,198 @@ static void ThrowIfError(int code, const char* name, request_rec *r) {
   if (code) {
     char buf[1024];
     apr_strerror(code, buf, 1024);
-    Throw("dart:io", "StreamException", apr_psprintf(r->pool, "%s failed: %s", name, buf));    
+    Throw(kStreamException, apr_psprintf(r->pool, "%s failed: %s", name, buf));    
   }
 }
 
+static dart_request_state *get_state(request_rec *r) {
+  dart_request_state *state = (dart_request_state*) ap_get_module_config(r->request_config, &dart_module);
+  if (!state) Throw(kException, "request state was NULL!");
+  return state;
+}
+
+// Keeps a copy of the output for the cache, until it gets too big to cache
+static void output_capture(dart_request_state *state) {
+  dart_cache_capture *capture = state->cache;
+  capture->body_length += state->buffered;
+  if (capture->body_length > capture->max_length) {
+    state->cache = NULL;
+    return;
+  }
+  for (apr_bucket *b = APR_BRIGADE_FIRST(state->brigade); b != APR_BRIGADE_SENTINEL(state->brigade); b = APR_BUCKET_NEXT(b)) {
+    apr_bucket *copy;
+    if (apr_bucket_copy(b, &copy) != APR_SUCCESS) {
+      state->cache = NULL;
+      return;
+    }
+    APR_BRIGADE_INSERT_TAIL(capture->body, copy);
+  }
+}
+
+static apr_status_t output_pass(request_rec *r, dart_request_state *state) {
+  if (state->cache) output_capture(state);
+  state->buffered = 0;
+  state->passed = true;
+  apr_status_t rv = ap_pass_brigade(r->output_filters, state->brigade);
+  apr_brigade_cleanup(state->brigade);
+  return rv;
+}
+
+// Returns space for [length] bytes at the end of the output buffer, to be filled and then passed to output_commit.
+// Small writes share the last heap bucket while it has room, larger ones get a bucket of their own.
+// Heap buckets are owned by the brigade, so Apache never has to copy them again to set them aside.
+static char *output_reserve(request_rec *r, dart_request_state *state, apr_size_t length) {
+  apr_bucket_brigade *brigade = state->brigade;
+  if (!APR_BRIGADE_EMPTY(brigade)) {
+    apr_bucket *last = APR_BRIGADE_LAST(brigade);
+    if (APR_BUCKET_IS_HEAP(last)) {
+      apr_bucket_heap *heap = (apr_bucket_heap*) last->data;
+      apr_size_t used = last->start + last->length;
+      if (heap->refcount.refcount == 1 && heap->alloc_len - used >= length) return heap->base + used;
+    }
+  }
+  apr_size_t size = (length > APR_BUCKET_BUFF_SIZE) ? length : APR_BUCKET_BUFF_SIZE;
+  char *buffer = (char*) apr_bucket_alloc(size, brigade->bucket_alloc);
+  if (!buffer) Throw(kException, apr_psprintf(r->pool, "Failed to allocate %ld bytes of output", (long) size));
+  apr_bucket *bucket = apr_bucket_heap_create(buffer, size, apr_bucket_free, brigade->bucket_alloc);
+  bucket->length = 0; // grows as output_commit is called
+  APR_BRIGADE_INSERT_TAIL(brigade, bucket);
+  return buffer;
+}
+
+static void output_commit(request_rec *r, dart_request_state *state, apr_size_t length) {
+  APR_BRIGADE_LAST(state->brigade)->length += length;
+  state->buffered += length;
+  if (state->buffered >= state->buffer_size) ThrowIfError(output_pass(r, state), "ap_pass_brigade", r);
+}
+
+// How Apache_Response_Write encodes strings, numbered as in mod_dart.dart
+typedef enum {
+  kEncodingUtf8 = 0,
+  kEncodingLatin1,
+  kEncodingAscii
+} dart_encoding;
+
+// Expands the [length] ISO-8859-1 characters at [buffer] to UTF-8 in place, and returns the new length.
+// There must be room for 2 * [length] bytes.
+static apr_size_t latin1_to_utf8(uint8_t *buffer, apr_size_t length) {
+  apr_size_t high = 0;
+  for (apr_size_t i = 0; i < length; i++) high += buffer[i] >> 7;
+  if (!high) return length; // ASCII, the common case
+  uint8_t *in = buffer + length;
+  uint8_t *out = in + high;
+  while (in > buffer) { // backwards, so nothing is overwritten before it's read
+    uint8_t c = *--in;
+    if (c < 0x80) {
+      *--out = c;
+    } else {
+      *--out = 0x80 | (c & 0x3F);
+      *--out = 0xC0 | (c >> 6);
+    }
+  }
+  return length + high;
+}
+
+// Writes [c] as UTF-8 (at most 4 bytes), and returns the number of bytes written. Surrogates, which
+// UTF-8 can't encode on their own, and values past U+10FFFF are written as U+FFFD.
+static apr_size_t utf8_encode(char *out, apr_uint32_t c) {
+  if (c >= 0xD800 && c < 0xE000) c = 0xFFFD;
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    out[0] = 0xC0 | (c >> 6);
+    out[1] = 0x80 | (c & 0x3F);
+    return 2;
+  } else if (c < 0x10000) {
+    out[0] = 0xE0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3F);
+    out[2] = 0x80 | (c & 0x3F);
+    return 3;
+  } else if (c < 0x110000) {
+    out[0] = 0xF0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3F);
+    out[2] = 0x80 | ((c >> 6) & 0x3F);
+    out[3] = 0x80 | (c & 0x3F);
+    return 4;
+  }
+  return utf8_encode(out, 0xFFFD);
+}
+
+// Encodes [text] straight into the output buffer, followed by a newline if [newline] is set. Unlike
+// Dart_StringToCString, this keeps embedded NULs, and strings of code points < 256 (nearly all output)
+// are copied out of the VM just once. ASCII and ISO-8859-1 output replaces characters they lack with '?'.
+static void output_write_string(request_rec *r, Dart_Handle text, dart_encoding encoding, bool newline) {
+  intptr_t length;
+  Dart_Handle result = Dart_StringLength(text, &length);
+  if (Dart_IsError(result)) Dart_PropagateError(result);
+  if (!length && !newline) return;
+  dart_request_state *state = get_state(r);
+  apr_size_t written = 0;
+  if (Dart_IsString8(text)) {
+    uint8_t *out = (uint8_t*) output_reserve(r, state, ((encoding == kEncodingUtf8) ? 2 * length : length) + newline);
+    result = Dart_StringGet8(text, out, &length);
+    if (Dart_IsError(result)) Dart_PropagateError(result);
+    if (encoding == kEncodingUtf8) {
+      written = latin1_to_utf8(out, length);
+    } else {
+      if (encoding == kEncodingAscii) {
+        for (intptr_t i = 0; i < length; i++) if (out[i] >= 0x80) out[i] = '?';
+      }
+      written = length;
+    }
+    if (newline) out[written++] = '\n';
+    output_commit(r, state, written);
+    return;
+  }
+
+  // Wider strings are copied out as code points first, then encoded
+  bool wide = !Dart_IsString16(text);
+  apr_size_t unit = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+  apr_size_t max = (encoding == kEncodingUtf8) ? (wide ? 4 : 3) * length : length;
+  char *out = output_reserve(r, state, max + newline);
+  uint32_t small[512];
+  void *units = (length * unit <= sizeof(small)) ? small : malloc(length * unit);
+  if (!units) Throw(kException, apr_psprintf(r->pool, "Failed to allocate %ld bytes of output", (long) (length * unit)));
+  result = wide ? Dart_StringGet32(text, (uint32_t*) units, &length) : Dart_StringGet16(text, (uint16_t*) units, &length);
+  if (Dart_IsError(result)) {
+    if (units != small) free(units);
+    Dart_PropagateError(result);
+  }
+  apr_uint32_t limit = (encoding == kEncodingAscii) ? 0x80 : 0x100;
+  for (intptr_t i = 0; i < length; i++) {
+    apr_uint32_t c = wide ? ((uint32_t*) units)[i] : ((uint16_t*) units)[i];
+    if (encoding != kEncodingUtf8) {
+      out[written++] = (c < limit) ? c : '?';
+      continue;
+    }
+    if (!wide && c >= 0xD800 && c < 0xDC00 && i + 1 < length) { // a surrogate pair, if the VM made one (else U+FFFD)
+      apr_uint32_t low = ((uint16_t*) units)[i + 1];
+      if (low >= 0xDC00 && low < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        i++;
+      }
+    }
+    written += utf8_encode(out + written, c);
+  }
+  if (units != small) free(units);
+  if (newline) out[written++] = '\n';
+  output_commit(r, state, written);
+}
+
 static void Apache_Response_Write(Dart_NativeArguments arguments) {
   Dart_EnterScope();
   request_rec *r = get_request(Dart_GetNativeArgument(arguments, 0));
-  
-  Dart_Handle text = Dart_GetNativeArgument(arguments, 1);
-  const char* ctext;
-  Dart_StringToCString(text, &ctext);
 
-  apr_bucket_brigade *out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
-  APR_BRIGADE_INSERT_TAIL(out, apr_bucket_transient_create(ctext, strlen(ctext), out->bucket_alloc));
-  ThrowIfError(ap_pass_brigade(r->output_filters, out), "ap_pass_brigade", r);
+  Dart_Handle text = Dart_GetNativeArgument(arguments, 1);
+  int64_t encoding;
+  bool newline;
+  if (!Dart_IsString(text)) Throw(kException, "Only strings can be written");
+  if (Dart_IsError(Dart_IntegerToInt64(Dart_GetNativeArgument(arguments, 2), &encoding))
+      || Dart_IsError(Dart_BooleanValue(Dart_GetNativeArgument(arguments, 3), &newline))) {
+    Throw(kException, "Bad arguments to Apache_Response_Write");
+  }
+  output_write_string(r, text, (dart_encoding) encoding, newline);
 
   Dart_ExitScope();
 }
@@ -91,27 +340,24 @@ static void Apache_Response_WriteList(Dart_NativeArguments arguments) {
   Dart_IntegerToInt64(offHandle, &off);
   Dart_IntegerToInt64(lenHandle, &len);
 
-  uint8_t* ctext = (uint8_t*) malloc(len);
-  Dart_Handle result = Dart_ListGetAsBytes(list, off, ctext, len);
-  if (Dart_IsError(result)) {
-    free(ctext);
-    Dart_PropagateError(result);
+  // Copy the bytes straight into the output bucket: this is the only copy
+  if (len > 0) {
+    dart_request_state *state = get_state(r);
+    uint8_t *target = (uint8_t*) output_reserve(r, state, len);
+    Dart_Handle result = Dart_ListGetAsBytes(list, off, target, len);
+    if (Dart_IsError(result)) Dart_PropagateError(result);
+    output_commit(r, state, len);
   }
 
-  apr_bucket_brigade *out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
-  APR_BRIGADE_INSERT_TAIL(out, apr_bucket_transient_create((const char*) ctext, len, out->bucket_alloc));
-  ThrowIfError(ap_pass_brigade(r->output_filters, out), "ap_pass_brigade", r);
-
   Dart_ExitScope();
 }
 
 static void Apache_Request_Flush(Dart_NativeArguments arguments) {
   Dart_EnterScope();
   request_rec *r = get_request(Dart_GetNativeArgument(arguments, 0));
-
-  apr_bucket_brigade *out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
-  APR_BRIGADE_INSERT_TAIL(out, apr_bucket_flush_create(out->bucket_alloc));
-  ThrowIfError(ap_pass_brigade(r->output_filters, out), "ap_pass_brigade", r);
+  dart_request_state *state = get_state(r);
+  APR_BRIGADE_INSERT_TAIL(state->brigade, apr_bucket_flush_create(state->brigade->bucket_alloc));
+  ThrowIfError(output_pass(r, state), "ap_pass_brigade", r);
 
   Dart_ExitScope();
 }
@@ -162,31 +408,24 @@ static void Apache_Request_GetQueryString(Dart_NativeArguments arguments) {
   Dart_ExitScope();
 }
 
+// Built like dart:uri's Uri.toString() would, without creating a Uri.
 static void Apache_Request_GetUri(Dart_NativeArguments arguments) {
   Dart_EnterScope();
   request_rec *r = get_request(Dart_GetNativeArgument(arguments, 0));
-  Dart_Handle empty = Dart_NewString("");
-  Dart_Handle scheme = Dart_NewString(r->server->server_scheme ? r->server->server_scheme : "http");
-  Dart_Handle userInfo = empty;
-  Dart_Handle host = Dart_NewString(r->parsed_uri.hostname ? r->parsed_uri.hostname
+  const char *host = r->parsed_uri.hostname ? r->parsed_uri.hostname
     : r->hostname ? r->hostname
     : r->connection->local_host ? r->connection->local_host
     : r->server->server_hostname ? r->server->server_hostname
-    : r->connection->local_ip ? r->connection->local_ip : "localhost");
-  Dart_Handle port = r->parsed_uri.port_str ? Dart_NewInteger(r->parsed_uri.port) : Dart_NewInteger(0);
-  Dart_Handle path = Dart_NewString(r->parsed_uri.path);
-  Dart_Handle query = r->parsed_uri.query ? Dart_NewString(r->parsed_uri.query) : empty;
-  Dart_Handle fragment = empty;
-
-  Dart_Handle uri_library = Dart_LookupLibrary(Dart_NewString("dart:uri"));
-  if (Dart_IsError(uri_library)) Dart_PropagateError(uri_library);
-  Dart_Handle uri_class = Dart_GetClass(uri_library, Dart_NewString("Uri"));
-  if (Dart_IsError(uri_class)) Dart_PropagateError(uri_class);
-
-  Dart_Handle args[] = {scheme, userInfo, host, port, path, query, fragment};
-  Dart_Handle uri = Dart_New(uri_class, Dart_Null(), 7, args);
-  if (Dart_IsError(uri)) Dart_PropagateError(uri);
-  Dart_SetReturnValue(arguments, Dart_ToString(uri));
+    : r->connection->local_ip ? r->connection->local_ip : "localhost";
+  bool has_port = r->parsed_uri.port_str && r->parsed_uri.port;
+  bool has_query = r->parsed_uri.query && *r->parsed_uri.query;
+  const char *uri = apr_pstrcat(r->pool,
+    r->server->server_scheme ? r->server->server_scheme : "http", "://", host,
+    has_port ? apr_psprintf(r->pool, ":%u", (unsigned) r->parsed_uri.port) : "",
+    r->parsed_uri.path ? r->parsed_uri.path : "",
+    has_query ? "?" : "", has_query ? r->parsed_uri.query : "",
+    NULL);
+  Dart_SetReturnValue(arguments, Dart_NewString(uri));
   Dart_ExitScope();
 }
 
@@ -323,29 +562,69 @@ static void Apache_Headers_Remove(Dart_NativeArguments arguments) {
   Dart_ExitScope();
 }
 
-struct iterate_state {
-  Dart_Handle callback;
-  Dart_Handle error;
+// Header names and values are usually ASCII, but HTTP allows ISO-8859-1, which isn't valid UTF-8.
+static Dart_Handle header_string(const char *text) {
+  Dart_Handle result = Dart_NewString(text);
+  if (Dart_IsError(result)) result = Dart_NewString8((const uint8_t*) text, strlen(text));
+  return result;
+}
+
+struct get_all_state {
+  Dart_Handle list; // NULL while counting
+  intptr_t count;
 };
 
-static int iterate_callback(void *ctx, const char *key, const char *value) {
-  Dart_EnterScope();
-  Dart_Handle args[2] = {Dart_NewString(key), Dart_NewString(value)};
-  struct iterate_state *state = (struct iterate_state*) ctx;
-  Dart_Handle result = Dart_InvokeClosure(state->callback, 2, args);
-  if (Dart_IsError(result)) {
-    state->error = result;
-    return 0; // Don't exit scope, we don't want to lose [result].
+static int get_all_callback(void *ctx, const char *key, const char *value) {
+  struct get_all_state *state = (struct get_all_state*) ctx;
+  if (state->list) {
+    Dart_Handle result = Dart_ListSetAt(state->list, state->count, header_string(value));
+    if (Dart_IsError(result)) Dart_PropagateError(result);
   }
-  Dart_ExitScope();
+  state->count++;
   return 1;
 }
 
-static void Apache_Headers_Iterate(Dart_NativeArguments arguments) {
+// Returns all values of a header as a list, matching the name case-insensitively.
+static void Apache_Headers_GetAll(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  apr_table_t *t = get_table(Dart_GetNativeArgument(arguments, 0));
+
+  Dart_Handle name = Dart_GetNativeArgument(arguments, 1);
+  const char* cname;
+  Dart_StringToCString(name, &cname);
+
+  struct get_all_state state = {NULL, 0};
+  apr_table_do(get_all_callback, &state, t, cname, NULL);
+  state.list = Dart_NewList(state.count);
+  if (Dart_IsError(state.list)) Dart_PropagateError(state.list);
+  state.count = 0;
+  apr_table_do(get_all_callback, &state, t, cname, NULL);
+  Dart_SetReturnValue(arguments, state.list);
+  Dart_ExitScope();
+}
+
+// Returns the whole table in one list: [name0, value0, name1, value1, ...].
+static void Apache_Headers_ToList(Dart_NativeArguments arguments) {
   Dart_EnterScope();
   apr_table_t *t = get_table(Dart_GetNativeArgument(arguments, 0));
-  struct iterate_state state = {Dart_GetNativeArgument(arguments, 1), Dart_Null()};
-  if (!apr_table_do(iterate_callback, &state, t, NULL)) Dart_PropagateError(state.error);
+  const apr_array_header_t *elts = apr_table_elts(t);
+  const apr_table_entry_t *entries = (const apr_table_entry_t*) elts->elts;
+  intptr_t count = 0;
+  for (int i = 0; i < elts->nelts; i++) {
+    if (entries[i].key) count++;
+  }
+  Dart_Handle list = Dart_NewList(count * 2);
+  if (Dart_IsError(list)) Dart_PropagateError(list);
+  intptr_t index = 0;
+  for (int i = 0; i < elts->nelts; i++) {
+    if (!entries[i].key) continue;
+    Dart_Handle name = header_string(entries[i].key);
+    Dart_Handle value = header_string(entries[i].val);
+    Dart_Handle result = Dart_IsError(name) ? name : Dart_ListSetAt(list, index++, name);
+    if (!Dart_IsError(result)) result = Dart_IsError(value) ? value : Dart_ListSetAt(list, index++, value);
+    if (Dart_IsError(result)) Dart_PropagateError(result);
+  }
+  Dart_SetReturnValue(arguments, list);
   Dart_ExitScope();
 }
 
@@ -363,60 +642,496 @@ static void Apache_Response_InitHeaders(Dart_NativeArguments arguments) {
   Dart_ExitScope();  
 }
 
-#define DART_INPUT_BUFFER_SIZE 4096
+static dart_stream *get_input(request_rec *r) {
+  dart_request_state *state = get_state(r);
+  if (!state->input) {
+    dart_stream *stream = (dart_stream*) apr_pcalloc(r->pool, sizeof(dart_stream));
+    stream->request = r;
+    stream->brigade = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    stream->chunk_size = state->input_chunk_size;
+    stream->eos = false;
+    state->input = stream;
+  }
+  return state->input;
+}
+
 static void Apache_RequestInputStream_Init(Dart_NativeArguments arguments) {
   Dart_EnterScope();
   Dart_Handle streamHandle = Dart_GetNativeArgument(arguments, 0);
   request_rec *r = get_request(Dart_GetNativeArgument(arguments, 1));
-  dart_stream *stream = (dart_stream*) apr_pcalloc(r->pool, sizeof(dart_stream));
-  stream->request = r;
-  stream->brigade = apr_brigade_create(r->pool, r->connection->bucket_alloc);
-  stream->buffer = (uint8_t*) apr_pcalloc(r->pool, DART_INPUT_BUFFER_SIZE);
-  stream->eos = false;
-  Dart_SetNativeInstanceField(streamHandle, 0, (intptr_t) stream);
-  ThrowIfError(ap_get_brigade(stream->request->input_filters, stream->brigade, AP_MODE_READBYTES, APR_BLOCK_READ, DART_INPUT_BUFFER_SIZE),
-    "ap_get_brigade", stream->request);
+  Dart_SetNativeInstanceField(streamHandle, 0, (intptr_t) get_input(r));
+  Dart_ExitScope();
+}
+
+// Makes sure the first bucket of the brigade is a data bucket of known length, reading from the input filters if needed.
+// Returns false at the end of the body.
+static bool input_fill(dart_stream *stream) {
+  while (!stream->eos) {
+    while (!APR_BRIGADE_EMPTY(stream->brigade)) {
+      apr_bucket *bucket = APR_BRIGADE_FIRST(stream->brigade);
+      if (APR_BUCKET_IS_EOS(bucket)) {
+        stream->eos = true;
+        apr_brigade_cleanup(stream->brigade);
+        return false;
+      }
+      if (APR_BUCKET_IS_METADATA(bucket) || !bucket->length) {
+        apr_bucket_delete(bucket);
+        continue;
+      }
+      if (bucket->length == (apr_size_t) -1) { // e.g. a socket bucket: reading morphs it into a data bucket
+        const char *data;
+        apr_size_t data_len;
+        ThrowIfError(apr_bucket_read(bucket, &data, &data_len, APR_BLOCK_READ), "apr_bucket_read", stream->request);
+        continue;
+      }
+      return true;
+    }
+    ThrowIfError(ap_get_brigade(stream->request->input_filters, stream->brigade, AP_MODE_READBYTES, APR_BLOCK_READ, stream->chunk_size),
+      "ap_get_brigade", stream->request);
+    if (APR_BRIGADE_EMPTY(stream->brigade)) stream->eos = true;
+  }
+  return false;
+}
+
+// Bytes of body already read from the input filters.
+static intptr_t input_buffered(dart_stream *stream) {
+  intptr_t total = 0;
+  for (apr_bucket *bucket = APR_BRIGADE_FIRST(stream->brigade); bucket != APR_BRIGADE_SENTINEL(stream->brigade); bucket = APR_BUCKET_NEXT(bucket)) {
+    if (APR_BUCKET_IS_EOS(bucket) || bucket->length == (apr_size_t) -1) break;
+    if (!APR_BUCKET_IS_METADATA(bucket)) total += bucket->length;
+  }
+  return total;
+}
+
+// Copies up to [length] buffered bytes straight from the buckets into [target], without reading more.
+static intptr_t input_copy(dart_stream *stream, Dart_Handle target, intptr_t offset, intptr_t length) {
+  intptr_t copied = 0;
+  while (copied < length && !APR_BRIGADE_EMPTY(stream->brigade)) {
+    apr_bucket *bucket = APR_BRIGADE_FIRST(stream->brigade);
+    if (APR_BUCKET_IS_EOS(bucket) || bucket->length == (apr_size_t) -1) break;
+    if (APR_BUCKET_IS_METADATA(bucket)) {
+      apr_bucket_delete(bucket);
+      continue;
+    }
+    const char *data;
+    apr_size_t data_len;
+    ThrowIfError(apr_bucket_read(bucket, &data, &data_len, APR_BLOCK_READ), "apr_bucket_read", stream->request);
+    apr_size_t count = (data_len < (apr_size_t) (length - copied)) ? data_len : (apr_size_t) (length - copied);
+    Dart_Handle result = Dart_ListSetAsBytes(target, offset + copied, (uint8_t*) data, count);
+    if (Dart_IsError(result)) Dart_PropagateError(result);
+    if (count < data_len) apr_bucket_split(bucket, count);
+    apr_bucket_delete(bucket);
+    copied += count;
+  }
+  return copied;
+}
+
+static void Apache_RequestInputStream_Available(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  dart_stream *stream = get_stream(Dart_GetNativeArgument(arguments, 0));
+  Dart_SetReturnValue(arguments, Dart_NewInteger(input_buffered(stream)));
   Dart_ExitScope();
 }
 
+// Returns a byte array of up to maxLength buffered bytes (reading some if none are buffered), or null at the end of the body.
 static void Apache_RequestInputStream_Read(Dart_NativeArguments arguments) {
   Dart_EnterScope();
   dart_stream *stream = get_stream(Dart_GetNativeArgument(arguments, 0));
-  if (stream->eos) {
-    Dart_SetReturnValue(arguments, Dart_NewInteger(-1));    
-  } else if (APR_BRIGADE_EMPTY(stream->brigade)) {
-    printf("Brigade empty!\n");
+  Dart_Handle maxHandle = Dart_GetNativeArgument(arguments, 1);
+  if (!input_fill(stream)) {
     Dart_SetReturnValue(arguments, Dart_Null());
   } else {
-    apr_bucket *bucket = APR_BRIGADE_FIRST(stream->brigade);
-    if (APR_BUCKET_IS_EOS(bucket)) {
-      stream->eos = true;
-      Dart_SetReturnValue(arguments, Dart_NewInteger(-1));
-    } else {
-      const char *data;
-      apr_size_t data_len;
-      ThrowIfError(apr_bucket_read(bucket, &data, &data_len, APR_BLOCK_READ), "apr_bucket_read", stream->request);
-      memmove(stream->buffer, data, data_len);
-      Dart_SetReturnValue(arguments, Dart_NewInteger(data_len));
-      apr_bucket_delete(bucket);
+    intptr_t length = input_buffered(stream);
+    if (!Dart_IsNull(maxHandle)) {
+      int64_t max;
+      Dart_IntegerToInt64(maxHandle, &max);
+      if (max < length) length = max;
     }
+    Dart_Handle result = Dart_NewByteArray(length);
+    if (Dart_IsError(result)) Dart_PropagateError(result);
+    input_copy(stream, result, 0, length);
+    Dart_SetReturnValue(arguments, result);
   }
-  Dart_ExitScope();  
+  Dart_ExitScope();
 }
 
-static void Apache_RequestInputStream_CopyBuffer(Dart_NativeArguments arguments) {
+// Reads up to [length] bytes into [target], blocking only if nothing is buffered. Returns -1 at the end of the body.
+static void Apache_RequestInputStream_ReadInto(Dart_NativeArguments arguments) {
   Dart_EnterScope();
   dart_stream *stream = get_stream(Dart_GetNativeArgument(arguments, 0));
-  Dart_Handle array = Dart_GetNativeArgument(arguments, 1);
-  Dart_Handle tOffsetHandle = Dart_GetNativeArgument(arguments, 2);
-  Dart_Handle sOffsetHandle = Dart_GetNativeArgument(arguments, 3);
-  Dart_Handle lengthHandle = Dart_GetNativeArgument(arguments, 4);
-  int64_t t_offset, s_offset, length;
-  Dart_IntegerToInt64(tOffsetHandle, &t_offset);
-  Dart_IntegerToInt64(sOffsetHandle, &s_offset);
+  Dart_Handle target = Dart_GetNativeArgument(arguments, 1);
+  Dart_Handle offsetHandle = Dart_GetNativeArgument(arguments, 2);
+  Dart_Handle lengthHandle = Dart_GetNativeArgument(arguments, 3);
+  int64_t offset, length;
+  Dart_IntegerToInt64(offsetHandle, &offset);
   Dart_IntegerToInt64(lengthHandle, &length);
-  Dart_Handle result = Dart_ListSetAsBytes(array, t_offset, &(stream->buffer[s_offset]), length);
+  intptr_t count = input_fill(stream) ? input_copy(stream, target, offset, length) : -1;
+  Dart_SetReturnValue(arguments, Dart_NewInteger(count));
+  Dart_ExitScope();
+}
+
+// Reads the rest of the body into a NUL-terminated buffer from the request pool, throwing if it exceeds [max] bytes.
+static char *input_read_all(dart_stream *stream, apr_off_t max, apr_size_t *length) {
+  request_rec *r = stream->request;
+  apr_bucket_brigade *body = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  apr_off_t total = 0;
+  while (input_fill(stream)) {
+    apr_bucket *bucket = APR_BRIGADE_FIRST(stream->brigade);
+    total += bucket->length;
+    if (total > max) {
+      apr_brigade_destroy(body);
+      Throw(kException, apr_psprintf(r->pool, "Request body is larger than DartFormMaxSize (%ld bytes)", (long) max));
+    }
+    APR_BUCKET_REMOVE(bucket);
+    APR_BRIGADE_INSERT_TAIL(body, bucket);
+  }
+  char *data = (char*) apr_palloc(r->pool, total + 1);
+  *length = total;
+  ThrowIfError(apr_brigade_flatten(body, data, length), "apr_brigade_flatten", r);
+  data[*length] = '\0';
+  apr_brigade_destroy(body);
+  return data;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Decodes '+' and %XX escapes in place, NUL-terminates the result (which is never longer) and returns its length,
+// which counts any %00 as a character. Malformed escapes are kept as they are.
+static apr_size_t url_decode(char *text, apr_size_t length) {
+  char *out = text;
+  for (apr_size_t i = 0; i < length; i++) {
+    if (text[i] == '+') {
+      *out++ = ' ';
+    } else if (text[i] == '%' && i + 2 < length && hex_value(text[i + 1]) >= 0 && hex_value(text[i + 2]) >= 0) {
+      *out++ = (char) (hex_value(text[i + 1]) * 16 + hex_value(text[i + 2]));
+      i += 2;
+    } else {
+      *out++ = text[i];
+    }
+  }
+  *out = '\0';
+  return out - text;
+}
+
+// Decodes the [length] bytes of UTF-8 at [text] into [out], which has room for [length] code points, and
+// returns how many there were, or -1 if the text isn't valid UTF-8.
+static intptr_t utf8_decode(const char *text, apr_size_t length, uint32_t *out) {
+  const uint8_t *in = (const uint8_t*) text, *end = in + length;
+  intptr_t count = 0;
+  while (in < end) {
+    uint32_t c = *in++;
+    int more = (c < 0x80) ? 0 : (c >= 0xC2 && c < 0xE0) ? 1 : (c >= 0xE0 && c < 0xF0) ? 2 : (c >= 0xF0 && c < 0xF5) ? 3 : -1;
+    if (more < 0 || end - in < more) return -1;
+    if (more) c &= 0x3F >> more;
+    for (int i = 0; i < more; i++) {
+      if ((*in & 0xC0) != 0x80) return -1;
+      c = (c << 6) | (*in++ & 0x3F);
+    }
+    // Overlong forms, surrogates and values past U+10FFFF
+    if ((more == 2 && c < 0x800) || (more == 3 && (c < 0x10000 || c > 0x10FFFF)) || (c >= 0xD800 && c < 0xE000)) return -1;
+    out[count++] = c;
+  }
+  return count;
+}
+
+// A decoded name or value of [length] bytes, which may include NULs from %00. Text that isn't valid UTF-8
+// is taken as ISO-8859-1, rather than failing the request.
+static Dart_Handle url_string(const char *text, apr_size_t length) {
+  Dart_Handle result;
+  if (!memchr(text, 0, length)) {
+    result = Dart_NewString(text);
+  } else {
+    // Dart_NewString would stop at the first NUL
+    uint32_t *chars = (uint32_t*) malloc(length * sizeof(uint32_t) + 1);
+    if (!chars) Throw(kException, "Failed to allocate a parameter");
+    intptr_t count = utf8_decode(text, length, chars);
+    result = (count < 0) ? Dart_NewString8((const uint8_t*) text, length) : Dart_NewString32(chars, count);
+    free(chars);
+  }
+  if (Dart_IsError(result)) result = Dart_NewString8((const uint8_t*) text, length);
   if (Dart_IsError(result)) Dart_PropagateError(result);
+  return result;
+}
+
+// Parses application/x-www-form-urlencoded [data] (which is modified) into a flat [name, value, ...] list,
+// in order and keeping repeated names. A field without '=' has a null value, empty fields are skipped.
+static Dart_Handle url_parse(request_rec *r, char *data, apr_size_t length, int max_fields) {
+  int fields = 0;
+  for (apr_size_t i = 0; i < length; i++) {
+    if ((i == 0 || data[i - 1] == '&') && data[i] != '&') fields++;
+  }
+  if (fields > max_fields) {
+    Throw(kException, apr_psprintf(r->pool, "%d parameters is more than DartFormMaxFields (%d)", fields, max_fields));
+  }
+  Dart_Handle list = Dart_NewList(fields * 2);
+  if (Dart_IsError(list)) Dart_PropagateError(list);
+  intptr_t index = 0;
+  char *end = data + length;
+  for (char *field = data; field < end; ) {
+    char *next = (char*) memchr(field, '&', end - field);
+    if (!next) next = end;
+    if (next > field) {
+      char *equals = (char*) memchr(field, '=', next - field);
+      char *name_end = equals ? equals : next;
+      Dart_Handle value = Dart_Null();
+      if (equals) {
+        value = url_string(equals + 1, url_decode(equals + 1, next - equals - 1));
+      }
+      Dart_ListSetAt(list, index++, url_string(field, url_decode(field, name_end - field)));
+      Dart_ListSetAt(list, index++, value);
+    }
+    field = next + 1;
+  }
+  return list;
+}
+
+// Returns the query string's parameters as a flat [name, value, ...] list.
+static void Apache_Request_ParseQuery(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  request_rec *r = get_request(Dart_GetNativeArgument(arguments, 0));
+  const char *query = r->parsed_uri.query ? r->parsed_uri.query : "";
+  apr_size_t length = strlen(query);
+  Dart_SetReturnValue(arguments, url_parse(r, apr_pstrmemdup(r->pool, query, length), length, get_state(r)->form_max_fields));
+  Dart_ExitScope();
+}
+
+// Reads an application/x-www-form-urlencoded request body and returns its fields as a flat [name, value, ...] list.
+// Bodies of other types are left alone, and give an empty list.
+static void Apache_Request_ParseForm(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  request_rec *r = get_request(Dart_GetNativeArgument(arguments, 0));
+  const char *type = apr_table_get(r->headers_in, "Content-Type");
+  if (!type || strcasecmp(ap_field_noparam(r->pool, type), "application/x-www-form-urlencoded")) {
+    Dart_SetReturnValue(arguments, Dart_NewList(0));
+  } else {
+    dart_request_state *state = get_state(r);
+    apr_size_t length;
+    char *data = input_read_all(get_input(r), state->form_max_size, &length);
+    Dart_SetReturnValue(arguments, url_parse(r, data, length, state->form_max_fields));
+  }
+  Dart_ExitScope();
+}
+
+// Starts capturing the response for the cache, see cacheResponse() in cache.dart.
+static void Apache_Cache_Response(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  request_rec *r = get_request(Dart_GetNativeArgument(arguments, 0));
+  int64_t seconds;
+  bool query;
+  intptr_t count;
+  Dart_Handle headers = Dart_GetNativeArgument(arguments, 3);
+  if (Dart_IsError(Dart_IntegerToInt64(Dart_GetNativeArgument(arguments, 1), &seconds))
+      || Dart_IsError(Dart_BooleanValue(Dart_GetNativeArgument(arguments, 2), &query))
+      || Dart_IsError(Dart_ListLength(headers, &count))) {
+    Throw(kException, "cacheResponse expects seconds, whether to key by query string, and a list of header names");
+  }
+  const char **names = (const char**) apr_palloc(r->pool, (count ? count : 1) * sizeof(const char*));
+  for (intptr_t i = 0; i < count; i++) {
+    Dart_Handle name = Dart_ListGetAt(headers, i);
+    if (Dart_IsError(name) || Dart_IsError(Dart_StringToCString(name, &(names[i])))) {
+      Throw(kException, "cacheResponse expects header names to be strings");
+    }
+  }
+  // Output that has already been passed can't be captured
+  dart_request_state *state = get_state(r);
+  state->cache = state->passed ? NULL : DartCacheCapture(r, seconds > INT_MAX ? INT_MAX : (int) seconds, query, names, count);
+  Dart_ExitScope();
+}
+
+// Converts a string to a type byte followed by its characters, malloc'd, with an explicit [length] so that
+// U+0000 survives. Each string has a single encoding, so that compareAndSwap can compare the bytes.
+// Sets [nul] if the string contains U+0000.
+static const char *shared_encode_string(Dart_Handle text, char **data, apr_size_t *length, bool *nul) {
+  intptr_t count;
+  if (Dart_IsError(Dart_StringLength(text, &count))) return "apache:shared couldn't convert a string";
+  *nul = false;
+  if (Dart_IsString8(text)) {
+    *length = 1 + count;
+    if (!(*data = (char*) malloc(*length))) return "Failed to allocate an apache:shared value";
+    if (Dart_IsError(Dart_StringGet8(text, (uint8_t*) *data + 1, &count))) return "apache:shared couldn't convert a string";
+    (*data)[0] = kSharedString;
+    *nul = memchr(*data + 1, 0, count) != NULL;
+    return NULL;
+  }
+
+  uint32_t *chars = (uint32_t*) malloc(count * sizeof(uint32_t) + 1);
+  if (!chars) return "Failed to allocate an apache:shared value";
+  Dart_Handle result;
+  if (Dart_IsString16(text)) {
+    // Copied into the front of the buffer, then widened in place from the back
+    result = Dart_StringGet16(text, (uint16_t*) chars, &count);
+    for (intptr_t i = count - 1; !Dart_IsError(result) && i >= 0; i--) chars[i] = ((uint16_t*) chars)[i];
+  } else {
+    result = Dart_StringGet32(text, chars, &count);
+  }
+  if (Dart_IsError(result)) {
+    free(chars);
+    return "apache:shared couldn't convert a string";
+  }
+  uint32_t max = 0;
+  for (intptr_t i = 0; i < count; i++) {
+    if (chars[i] > max) max = chars[i];
+    if (!chars[i]) *nul = true;
+  }
+  apr_size_t width = (max < 0x100) ? 1 : (max < 0x10000) ? 2 : 4;
+  *length = 1 + count * width;
+  if ((*data = (char*) malloc(*length))) {
+    (*data)[0] = (width == 1) ? kSharedString : (width == 2) ? kSharedString16 : kSharedString32;
+    for (intptr_t i = 0; i < count; i++) {
+      if (width == 1) {
+        (*data)[1 + i] = (char) chars[i];
+      } else if (width == 2) {
+        uint16_t c = (uint16_t) chars[i];
+        memcpy(*data + 1 + 2 * i, &c, 2);
+      } else {
+        memcpy(*data + 1 + 4 * i, &chars[i], 4);
+      }
+    }
+  }
+  free(chars);
+  return *data ? NULL : "Failed to allocate an apache:shared value";
+}
+
+// Keys are C strings in the cache, so a key can't contain U+0000 (which would cut it short).
+static const char *shared_key(Dart_Handle key) {
+  if (!Dart_IsString(key)) Throw(kException, "apache:shared keys must be strings");
+  char *data = NULL;
+  apr_size_t length;
+  bool nul;
+  const char *error = shared_encode_string(key, &data, &length, &nul);
+  free(data);
+  if (error) Throw(kException, error);
+  if (nul) Throw(kException, "apache:shared keys can't contain U+0000");
+  const char *ckey;
+  if (Dart_IsError(Dart_StringToCString(key, &ckey))) Throw(kException, "apache:shared keys must be strings");
+  return ckey;
+}
+
+// Converts an apache:shared value to a type byte followed by its bytes, malloc'd, or NULL for null.
+// Returns why it couldn't, rather than throwing, so that callers can free what they have allocated.
+static const char *shared_encode(Dart_Handle value, char **data, apr_size_t *length) {
+  *data = NULL;
+  *length = 0;
+  if (Dart_IsNull(value)) return NULL;
+  char type;
+  if (Dart_IsString(value)) {
+    bool nul;
+    const char *error = shared_encode_string(value, data, length, &nul);
+    if (error) {
+      free(*data);
+      *data = NULL;
+    }
+    return error;
+  } else if (Dart_IsInteger(value)) {
+    int64_t number;
+    if (Dart_IsError(Dart_IntegerToInt64(value, &number))) return "apache:shared ints must fit in 64 bits";
+    type = kSharedInt;
+    *length = 1 + sizeof(number);
+    if ((*data = (char*) malloc(*length))) memcpy(*data + 1, &number, sizeof(number));
+  } else if (Dart_IsList(value)) {
+    intptr_t count;
+    if (Dart_IsError(Dart_ListLength(value, &count))) return "apache:shared couldn't read a list";
+    type = kSharedBytes;
+    *length = 1 + count;
+    if ((*data = (char*) malloc(*length)) && Dart_IsError(Dart_ListGetAsBytes(value, 0, (uint8_t*) *data + 1, count))) {
+      free(*data);
+      *data = NULL;
+      return "apache:shared lists must hold bytes";
+    }
+  } else {
+    return "apache:shared values must be strings, ints or lists of bytes";
+  }
+  if (!*data) return "Failed to allocate an apache:shared value";
+  (*data)[0] = type;
+  return NULL;
+}
+
+static Dart_Handle shared_decode(const char *data, apr_size_t length) {
+  if (data[0] == kSharedString) return Dart_NewString8((const uint8_t*) data + 1, length - 1);
+  if (data[0] == kSharedString16 || data[0] == kSharedString32) {
+    // Copied out, as the characters in [data] needn't be aligned
+    apr_size_t width = (data[0] == kSharedString16) ? 2 : 4, count = (length - 1) / width;
+    void *chars = malloc(count * width + 1);
+    if (!chars) return Dart_Error("Failed to allocate an apache:shared value");
+    memcpy(chars, data + 1, count * width);
+    Dart_Handle result = (width == 2) ? Dart_NewString16((const uint16_t*) chars, count) : Dart_NewString32((const uint32_t*) chars, count);
+    free(chars);
+    return result;
+  }
+  if (data[0] == kSharedInt) {
+    int64_t number;
+    memcpy(&number, data + 1, sizeof(number));
+    return Dart_NewInteger(number);
+  }
+  Dart_Handle bytes = Dart_NewByteArray(length - 1);
+  if (!Dart_IsError(bytes)) Dart_ListSetAsBytes(bytes, 0, (uint8_t*) data + 1, length - 1);
+  return bytes;
+}
+
+static void ThrowIfSharedError(apr_status_t rv) {
+  if (rv == APR_ENOTIMPL) Throw(kException, "apache:shared is disabled, see DartCacheSize");
+  if (rv == APR_ENOSPC) Throw(kException, "The value doesn't fit in apache:shared, see DartCacheSize");
+  if (rv == APR_EINVAL) Throw(kException, "The apache:shared value isn't an int");
+  if (rv != APR_SUCCESS) Throw(kException, "apache:shared failed");
+}
+
+static void Apache_Shared_Get(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  char *value;
+  apr_size_t length;
+  apr_status_t rv = DartSharedGet(shared_key(Dart_GetNativeArgument(arguments, 1)), &value, &length);
+  ThrowIfSharedError(rv);
+  Dart_Handle result = value ? shared_decode(value, length) : Dart_Null();
+  free(value);
+  if (Dart_IsError(result)) Dart_PropagateError(result);
+  Dart_SetReturnValue(arguments, result);
+  Dart_ExitScope();
+}
+
+static void Apache_Shared_Put(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  const char *key = shared_key(Dart_GetNativeArgument(arguments, 1));
+  char *value;
+  apr_size_t length;
+  const char *error = shared_encode(Dart_GetNativeArgument(arguments, 2), &value, &length);
+  if (error) Throw(kException, error);
+  apr_status_t rv = DartSharedPut(key, value, length);
+  free(value);
+  ThrowIfSharedError(rv);
+  Dart_ExitScope();
+}
+
+static void Apache_Shared_CompareAndSwap(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  const char *key = shared_key(Dart_GetNativeArgument(arguments, 1));
+  char *expected, *value = NULL;
+  apr_size_t expected_length, length = 0;
+  const char *error = shared_encode(Dart_GetNativeArgument(arguments, 2), &expected, &expected_length);
+  if (!error) error = shared_encode(Dart_GetNativeArgument(arguments, 3), &value, &length);
+  bool swapped = false;
+  apr_status_t rv = error ? APR_SUCCESS : DartSharedCompareAndSwap(key, true, expected, expected_length, value, length, &swapped);
+  free(expected);
+  free(value);
+  if (error) Throw(kException, error);
+  ThrowIfSharedError(rv);
+  Dart_SetReturnValue(arguments, Dart_NewBoolean(swapped));
+  Dart_ExitScope();
+}
+
+static void Apache_Shared_Increment(Dart_NativeArguments arguments) {
+  Dart_EnterScope();
+  const char *key = shared_key(Dart_GetNativeArgument(arguments, 1));
+  int64_t delta, result = 0;
+  if (Dart_IsError(Dart_IntegerToInt64(Dart_GetNativeArgument(arguments, 2), &delta))) {
+    Throw(kException, "apache:shared increments must be ints");
+  }
+  ThrowIfSharedError(DartSharedIncrement(key, delta, &result));
+  Dart_SetReturnValue(arguments, Dart_NewInteger(result));
   Dart_ExitScope();
 }
 
@@ -429,43 +1144,85 @@ static void Apache_NewByteArray(Dart_NativeArguments arguments) {
   Dart_ExitScope();
 }
 
+typedef struct dart_native {
+  const char* name;
+  int args;
+  Dart_NativeFunction function;
+} dart_native;
+
+#define NATIVE(function, args) { #function, args, function }
+
+// Must be sorted by name (as strcmp orders them) then argument count, NativeResolver uses a binary search.
+static const dart_native natives[] = {
+  NATIVE(Apache_Cache_Response, 4),
+  NATIVE(Apache_Connection_IsKeepalive, 1),
+  NATIVE(Apache_Connection_SetKeepalive, 2),
+  NATIVE(Apache_Headers_Add, 3),
+  NATIVE(Apache_Headers_Get, 2),
+  NATIVE(Apache_Headers_GetAll, 2),
+  NATIVE(Apache_Headers_Remove, 2),
+  NATIVE(Apache_Headers_ToList, 1),
+  NATIVE(Apache_NewByteArray, 1),
+  NATIVE(Apache_RequestInputStream_Available, 1),
+  NATIVE(Apache_RequestInputStream_Init, 2),
+  NATIVE(Apache_RequestInputStream_Read, 2),
+  NATIVE(Apache_RequestInputStream_ReadInto, 4),
+  NATIVE(Apache_Request_Flush, 1),
+  NATIVE(Apache_Request_GetHost, 1),
+  NATIVE(Apache_Request_GetMethod, 1),
+  NATIVE(Apache_Request_GetPath, 1),
+  NATIVE(Apache_Request_GetPort, 1),
+  NATIVE(Apache_Request_GetProtocolVersion, 1),
+  NATIVE(Apache_Request_GetQueryString, 1),
+  NATIVE(Apache_Request_GetUri, 1),
+  NATIVE(Apache_Request_InitHeaders, 2),
+  NATIVE(Apache_Request_ParseForm, 1),
+  NATIVE(Apache_Request_ParseQuery, 1),
+  NATIVE(Apache_Response_GetContentLength, 1),
+  NATIVE(Apache_Response_GetContentType, 1),
+  NATIVE(Apache_Response_GetStatusCode, 1),
+  NATIVE(Apache_Response_GetStatusLine, 1),
+  NATIVE(Apache_Response_InitHeaders, 2),
+  NATIVE(Apache_Response_SetContentLength, 2),
+  NATIVE(Apache_Response_SetContentType, 2),
+  NATIVE(Apache_Response_SetStatusCode, 2),
+  NATIVE(Apache_Response_SetStatusLine, 2),
+  NATIVE(Apache_Response_Write, 4),
+  NATIVE(Apache_Response_WriteList, 4),
+  NATIVE(Apache_Shared_CompareAndSwap, 4),
+  NATIVE(Apache_Shared_Get, 2),
+  NATIVE(Apache_Shared_Increment, 3),
+  NATIVE(Apache_Shared_Put, 3),
+};
+
+#undef NATIVE
+
+static int compare_natives(const void *a, const void *b) {
+  const dart_native *x = (const dart_native*) a;
+  const dart_native *y = (const dart_native*) b;
+  int result = strcmp(x->name, y->name);
+  return result ? result : x->args - y->args;
+}
+
 static Dart_NativeFunction NativeResolver(Dart_Handle name, int args) {
   const char* cname;
   if (Dart_IsError(Dart_StringToCString(name, &cname))) return NULL; // not enough context to log!
-  if (!strcmp(cname, "Apache_Connection_IsKeepalive") && (args == 1)) return Apache_Connection_IsKeepalive;
-  if (!strcmp(cname, "Apache_Connection_SetKeepalive") && (args == 2)) return Apache_Connection_SetKeepalive;
-  if (!strcmp(cname, "Apache_Response_Write") && (args == 2)) return Apache_Response_Write;
-  if (!strcmp(cname, "Apache_Response_WriteList") && (args == 4)) return Apache_Response_WriteList;
-  if (!strcmp(cname, "Apache_Request_Flush") && (args == 1)) return Apache_Request_Flush;
-  if (!strcmp(cname, "Apache_Request_InitHeaders") && (args == 2)) return Apache_Request_InitHeaders;
-  if (!strcmp(cname, "Apache_Request_GetHost") && (args == 1)) return Apache_Request_GetHost;
-  if (!strcmp(cname, "Apache_Request_GetPort") && (args == 1)) return Apache_Request_GetPort;
-  if (!strcmp(cname, "Apache_Request_GetProtocolVersion") && (args == 1)) return Apache_Request_GetProtocolVersion;
-  if (!strcmp(cname, "Apache_Request_GetMethod") && (args == 1)) return Apache_Request_GetMethod;
-  if (!strcmp(cname, "Apache_Request_GetPath") && (args == 1)) return Apache_Request_GetPath;
-  if (!strcmp(cname, "Apache_Request_GetQueryString") && (args == 1)) return Apache_Request_GetQueryString;
-  if (!strcmp(cname, "Apache_Request_GetUri") && (args == 1)) return Apache_Request_GetUri;
-  if (!strcmp(cname, "Apache_RequestInputStream_Init") && (args == 2)) return Apache_RequestInputStream_Init;  
-  if (!strcmp(cname, "Apache_RequestInputStream_Read") && (args == 1)) return Apache_RequestInputStream_Read;  
-  if (!strcmp(cname, "Apache_RequestInputStream_CopyBuffer") && (args == 5)) return Apache_RequestInputStream_CopyBuffer;  
-  if (!strcmp(cname, "Apache_NewByteArray") && (args == 1)) return Apache_NewByteArray;  
-  if (!strcmp(cname, "Apache_Response_GetStatusCode") && (args == 1)) return Apache_Response_GetStatusCode;
-  if (!strcmp(cname, "Apache_Response_SetStatusCode") && (args == 2)) return Apache_Response_SetStatusCode;
-  if (!strcmp(cname, "Apache_Response_GetStatusLine") && (args == 1)) return Apache_Response_GetStatusLine;
-  if (!strcmp(cname, "Apache_Response_SetStatusLine") && (args == 2)) return Apache_Response_SetStatusLine;
-  if (!strcmp(cname, "Apache_Response_GetContentType") && (args == 1)) return Apache_Response_GetContentType;
-  if (!strcmp(cname, "Apache_Response_SetContentType") && (args == 2)) return Apache_Response_SetContentType;
-  if (!strcmp(cname, "Apache_Response_GetContentLength") && (args == 1)) return Apache_Response_GetContentLength;
-  if (!strcmp(cname, "Apache_Response_SetContentLength") && (args == 2)) return Apache_Response_SetContentLength;
-  if (!strcmp(cname, "Apache_Response_InitHeaders") && (args == 2)) return Apache_Response_InitHeaders;
-  if (!strcmp(cname, "Apache_Headers_Get") && (args == 2)) return Apache_Headers_Get;
-  if (!strcmp(cname, "Apache_Headers_Add") && (args == 3)) return Apache_Headers_Add;
-  if (!strcmp(cname, "Apache_Headers_Iterate") && (args == 2)) return Apache_Headers_Iterate;
-  if (!strcmp(cname, "Apache_Headers_Remove") && (args == 2)) return Apache_Headers_Remove;
-  return NULL;
+  dart_native key = { cname, args, NULL };
+  const dart_native *native = (const dart_native*) bsearch(&key, natives, sizeof(natives) / sizeof(dart_native), sizeof(dart_native), compare_natives);
+  return native ? native->function : NULL;
+}
+
+extern "C" const char *ApacheLibraryBuildId(apr_pool_t *pool) {
+  const char *sources = apr_pstrcat(pool, Dart_VersionString(), "\n", mod_dart_source, mod_dart_cache_source, mod_dart_shared_source, NULL);
+  return ap_md5(pool, (const unsigned char*) sources);
 }
 
 extern "C" Dart_Handle ApacheLibraryLoad() {
+#ifdef DEBUG
+  for (size_t i = 1; i < sizeof(natives) / sizeof(dart_native); i++) {
+    if (compare_natives(&natives[i - 1], &natives[i]) >= 0) return Dart_Error("natives[] is not sorted at %s", natives[i].name);
+  }
+#endif
   Dart_Handle library = Dart_LoadLibrary(Dart_NewString("apache:handler"), Dart_NewString(mod_dart_source));
   if (Dart_IsError(library)) return library;
 
@@ -476,17 +1233,128 @@ extern "C" Dart_Handle ApacheLibraryLoad() {
   wrapper = Dart_CreateNativeWrapperClass(library, Dart_NewString("RequestInputStreamNative"), 1);
   if (Dart_IsError(wrapper)) return wrapper;
 
+  // apache:cache imports apache:handler, so it is loaded second
+  Dart_Handle cache = Dart_LoadLibrary(Dart_NewString("apache:cache"), Dart_NewString(mod_dart_cache_source));
+  if (Dart_IsError(cache)) return cache;
+  Dart_Handle shared = Dart_LoadLibrary(Dart_NewString("apache:shared"), Dart_NewString(mod_dart_shared_source));
+  if (Dart_IsError(shared)) return shared;
+
   return library;  
 }
 
-extern "C" Dart_Handle ApacheLibraryInit(request_rec *r) {
-  Dart_Handle library = Dart_LookupLibrary(Dart_NewString("apache:handler"));
-  if (Dart_IsError(library)) return library;
-  Dart_Handle result = Dart_SetNativeResolver(library, NativeResolver);
+extern "C" Dart_Handle ApacheLibraryInit(request_rec *r, const dart_request_config *config) {
+  dart_library_handles scratch, *handles;
+  Dart_Handle result = get_handles(&handles, &scratch);
+  if (Dart_IsError(result)) return result;
+  result = Dart_SetNativeResolver(handles->library, NativeResolver);
+  if (Dart_IsError(result)) return result;
+  result = Dart_SetNativeResolver(handles->cache_library, NativeResolver);
+  if (Dart_IsError(result)) return result;
+  result = Dart_SetNativeResolver(handles->shared_library, NativeResolver);
   if (Dart_IsError(result)) return result;
-  Dart_Handle request = Dart_Invoke(library, Dart_NewString("get:request"), 0, NULL);
+  result = Dart_Invoke(handles->library, handles->reset_request, 0, NULL);
+  if (Dart_IsError(result)) return result;
+  Dart_Handle request = Dart_Invoke(handles->library, handles->get_request, 0, NULL);
   if (Dart_IsError(request)) return request;
   result = Dart_SetNativeInstanceField(request, 0, (intptr_t) r);
   r->content_type = "text/plain";
+
+  dart_request_state *state = (dart_request_state*) apr_pcalloc(r->pool, sizeof(dart_request_state));
+  state->brigade = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  state->buffer_size = config->output_buffer_size;
+  state->input_chunk_size = config->input_chunk_size;
+  state->form_max_size = config->form_max_size;
+  state->form_max_fields = config->form_max_fields;
+  ap_set_module_config(r->request_config, &dart_module, state);
   return Dart_IsError(result) ? result : Dart_Null();
 }
+
+// The filters of the synthetic request used by ApacheLibraryWarmup: output is thrown away, and the body is empty.
+static apr_status_t warmup_output(ap_filter_t *filter, apr_bucket_brigade *brigade) {
+  apr_brigade_cleanup(brigade);
+  return APR_SUCCESS;
+}
+
+static apr_status_t warmup_input(ap_filter_t *filter, apr_bucket_brigade *brigade, ap_input_mode_t mode,
+                                 apr_read_type_e block, apr_off_t readbytes) {
+  APR_BRIGADE_INSERT_TAIL(brigade, apr_bucket_eos_create(brigade->bucket_alloc));
+  return APR_SUCCESS;
+}
+
+static ap_filter_t *warmup_filter(apr_pool_t *pool, request_rec *r, bool output) {
+  ap_filter_rec_t *frec = (ap_filter_rec_t*) apr_pcalloc(pool, sizeof(ap_filter_rec_t));
+  frec->name = "dart_warmup";
+  if (output) {
+    frec->filter_func.out_func = warmup_output;
+  } else {
+    frec->filter_func.in_func = warmup_input;
+  }
+  ap_filter_t *filter = (ap_filter_t*) apr_pcalloc(pool, sizeof(ap_filter_t));
+  filter->frec = frec;
+  filter->r = r;
+  filter->c = r->connection;
+  return filter;
+}
+
+// Calls [function] in [library], with request set up for a synthetic GET of [filename] on server [s].
+// Used to exercise a script before it is snapshotted, so its classes are finalized in the snapshot.
+extern "C" Dart_Handle ApacheLibraryWarmup(server_rec *s, Dart_Handle library, const char *function,
+                                           const char *filename, const dart_request_config *config) {
+  apr_pool_t *pool;
+  if (apr_pool_create(&pool, NULL) != APR_SUCCESS) return Dart_Error("Failed to create a pool for the warm-up request");
+  conn_rec *c = (conn_rec*) apr_pcalloc(pool, sizeof(conn_rec));
+  c->pool = pool;
+  c->base_server = s;
+  c->bucket_alloc = apr_bucket_alloc_create(pool);
+  c->local_host = (char*) "localhost";
+  c->local_ip = (char*) "127.0.0.1";
+  apr_sockaddr_info_get(&(c->local_addr), "127.0.0.1", APR_INET, s->port ? s->port : 80, 0, pool);
+  c->keepalive = AP_CONN_CLOSE;
+
+  request_rec *r = (request_rec*) apr_pcalloc(pool, sizeof(request_rec));
+  r->pool = pool;
+  r->connection = c;
+  r->server = s;
+  r->request_time = apr_time_now();
+  r->protocol = (char*) "HTTP/1.1";
+  r->proto_num = HTTP_VERSION(1, 1);
+  r->method = "GET";
+  r->method_number = M_GET;
+  r->status = HTTP_OK;
+  r->filename = apr_pstrdup(pool, filename);
+  r->uri = apr_pstrcat(pool, "/", ap_strrchr_c(filename, '/') ? ap_strrchr_c(filename, '/') + 1 : filename, NULL);
+  apr_uri_parse(pool, r->uri, &(r->parsed_uri));
+  r->headers_in = apr_table_make(pool, 1);
+  r->headers_out = apr_table_make(pool, 1);
+  r->err_headers_out = apr_table_make(pool, 1);
+  r->subprocess_env = apr_table_make(pool, 1);
+  r->notes = apr_table_make(pool, 1);
+  // Only mod_dart's slot of the config vector is used
+  r->request_config = (ap_conf_vector_t*) apr_pcalloc(pool, sizeof(void*) * (dart_module.module_index + 1));
+  r->output_filters = warmup_filter(pool, r, true);
+  r->input_filters = warmup_filter(pool, r, false);
+  apr_table_setn(r->headers_in, "Host", "localhost");
+
+  Dart_Handle result = ApacheLibraryInit(r, config);
+  if (!Dart_IsError(result)) result = Dart_Invoke(library, Dart_NewString(function), 0, NULL);
+  if (!Dart_IsError(result)) result = ApacheLibraryFinish(r, false) == APR_SUCCESS ? Dart_Null() : Dart_Error("Failed to pass output");
+  // Don't leave the request (and its dangling request_rec) in apache:handler
+  dart_library_handles scratch, *handles;
+  if (!Dart_IsError(get_handles(&handles, &scratch))) Dart_Invoke(handles->library, handles->reset_request, 0, NULL);
+  if (Dart_IsError(result)) result = Dart_Error("Warm-up %s() failed: %s", function, Dart_GetError(result));
+  apr_pool_destroy(pool);
+  return result;
+}
+
+// Passes any buffered output. If the script completed and all its output was buffered,
+// the Content-Length is set (unless the script set it), and if it asked for its response to be cached, it is.
+extern "C" apr_status_t ApacheLibraryFinish(request_rec *r, bool completed) {
+  dart_request_state *state = (dart_request_state*) ap_get_module_config(r->request_config, &dart_module);
+  if (!state) return APR_SUCCESS;
+  if (completed && !state->passed && !apr_table_get(r->headers_out, "Content-Length")) {
+    ap_set_content_length(r, state->buffered);
+  }
+  apr_status_t rv = APR_BRIGADE_EMPTY(state->brigade) ? APR_SUCCESS : output_pass(r, state);
+  if (completed && state->cache && rv == APR_SUCCESS) DartCacheStore(r, state->cache);
+  return rv;
+}
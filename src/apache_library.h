@@ -0,0 +1,42 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+#ifndef MOD_DART_APACHE_LIBRARY_H
+#define MOD_DART_APACHE_LIBRARY_H
+
+#include "include/dart_api.h"
+#include "httpd.h"
+
+// Per-request settings for the apache:handler natives, resolved from the directory config.
+typedef struct dart_request_config {
+  apr_off_t output_buffer_size;
+  apr_off_t input_chunk_size;
+  apr_off_t form_max_size; // largest urlencoded body the form parser reads
+  int form_max_fields; // most parameters in a query string or form body
+} dart_request_config;
+
+// Handles the natives use on most requests, looked up once per isolate and kept as persistent handles.
+typedef struct dart_library_handles {
+  bool loaded;
+  Dart_Handle library; // apache:handler
+  Dart_Handle cache_library; // apache:cache
+  Dart_Handle shared_library; // apache:shared
+  Dart_Handle exception; // dart:core's Exception class
+  Dart_Handle stream_exception; // dart:io's StreamException class
+  Dart_Handle reset_request; // names of apache:handler functions
+  Dart_Handle get_request;
+} dart_library_handles;
+
+// Provided by mod_dart.c: the current isolate's dart_library_handles, or NULL if it has none.
+extern "C" dart_library_handles *DartIsolateHandles();
+
+extern "C" Dart_Handle ApacheLibraryLoad();
+// Identifies the Dart VM and the apache: libraries' sources, which script snapshots are only valid with
+extern "C" const char *ApacheLibraryBuildId(apr_pool_t *pool);
+extern "C" Dart_Handle ApacheLibraryInit(request_rec* r, const dart_request_config *config);
+extern "C" apr_status_t ApacheLibraryFinish(request_rec *r, bool completed);
+extern "C" Dart_Handle ApacheLibraryWarmup(server_rec *s, Dart_Handle library, const char *function,
+                                           const char *filename, const dart_request_config *config);
+
+#endif
@@ -0,0 +1,571 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+#include <stdlib.h>
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "ap_config.h"
+#include "ap_release.h"
+#include "apr_atomic.h"
+#include "apr_global_mutex.h"
+#include "apr_hash.h"
+#include "apr_rmm.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+
+#include "cache.h"
+
+#ifdef AP_NEED_SET_MUTEX_PERMS
+#include "unixd.h"
+#if AP_SERVER_MAJORVERSION_NUMBER == 2 && AP_SERVER_MINORVERSION_NUMBER >= 4
+#define set_mutex_perms ap_unixd_set_global_mutex_perms
+#else
+#define set_mutex_perms unixd_set_global_mutex_perms
+#endif
+#endif
+
+// The response cache is a hash table in shared memory created before the children fork, so every
+// child serves what any of them cached. Entries are allocated with apr_rmm under cache_mutex, and each range
+// of buckets has its own lock, so lookups in different buckets don't wait for each other or for allocations.
+//
+// Each cached script has two kinds of entry: its spec, keyed by filename, which says how its responses
+// are keyed ('q' or '-' for whether the query string is part of the key, then a request header name
+// per line), and the responses themselves, keyed by filename, the script's mtime, URI, query string and header values
+// (one per line). Each bucket counts the specs in it, so that requests for scripts that never cached anything
+// can see so without taking the lock. A response entry holds the content type, NUL-terminated, then r->headers_out and
+// r->err_headers_out, each as NUL-terminated name and value pairs ending with an empty name, and the body.
+//
+// apache:shared's entries live in the same table, their keys prefixed with DART_SHARED_PREFIX (which no filename
+// starts with). They never expire, but like responses they are evicted when memory runs out: a batch of buckets at
+// a time, expired responses first, else the least recently used entry in the batch.
+
+#define DART_CACHE_BUCKETS 4096
+#define DART_CACHE_FOREVER APR_INT64_C(0x7fffffffffffffff)
+#define DART_SHARED_PREFIX '\001'
+#define DART_CACHE_STRIPES 16 // locks, each for DART_CACHE_BUCKETS / DART_CACHE_STRIPES buckets
+#define DART_CACHE_EVICT_BATCH 64 // buckets evict() looks at, within one stripe
+
+typedef struct dart_cache_entry {
+  apr_rmm_off_t next; // in the bucket's chain, 0 at the end
+  apr_uint32_t hash;
+  apr_time_t expires;
+  apr_time_t used; // when it was last read or written, for eviction
+  apr_size_t key_length;
+  apr_size_t data_length;
+  bool spec; // counted in dart_cache.specs
+  // followed by the key, then the data
+} dart_cache_entry;
+
+typedef struct dart_cache {
+  apr_rmm_off_t buckets[DART_CACHE_BUCKETS]; // chains of entries, 0 if empty
+  volatile apr_uint32_t specs[DART_CACHE_BUCKETS]; // spec entries in each bucket. Written under the lock, read without it
+  volatile apr_uint32_t hand; // the next bucket evict() looks at, a multiple of DART_CACHE_EVICT_BATCH
+} dart_cache;
+
+static dart_cache *cache = NULL; // NULL if DartCacheSize is 0, or the cache couldn't be created
+static apr_rmm_t *cache_rmm = NULL; // manages the shared memory after *cache
+static apr_size_t cache_max_entry = 0;
+// cache_mutex guards cache_rmm's allocations, and each stripe mutex a range of buckets: their chains and their
+// entries. A thread holds at most one of these locks at a time, so there is no lock order to get wrong.
+static apr_global_mutex_t *cache_mutex = NULL;
+static apr_global_mutex_t *stripe_mutexes[DART_CACHE_STRIPES];
+
+// Response headers that are recomputed when a cached response is served
+static const char *uncached_headers[] = { "Connection", "Content-Length", "Keep-Alive", "Transfer-Encoding" };
+
+static apr_status_t create_mutex(apr_global_mutex_t **mutex, apr_pool_t *pconf) {
+  apr_status_t rv = apr_global_mutex_create(mutex, NULL, APR_LOCK_DEFAULT, pconf);
+#ifdef AP_NEED_SET_MUTEX_PERMS
+  // The children may run as a different user to the parent
+  if (rv == APR_SUCCESS) rv = set_mutex_perms(*mutex);
+#endif
+  return rv;
+}
+
+extern "C" void DartCacheCreate(apr_pool_t *pconf, server_rec *s, apr_size_t size) {
+  cache = NULL;
+  if (!size) return;
+  if (size < sizeof(dart_cache) * 2) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, 0, s, "mod_dart: DartCacheSize must be at least %ld bytes, the cache is disabled",
+                 (long) sizeof(dart_cache) * 2);
+    return;
+  }
+  apr_shm_t *shm;
+  apr_status_t rv = apr_shm_create(&shm, size, NULL, pconf);
+  if (rv == APR_SUCCESS) rv = create_mutex(&cache_mutex, pconf);
+  for (int i = 0; i < DART_CACHE_STRIPES && rv == APR_SUCCESS; i++) rv = create_mutex(&stripe_mutexes[i], pconf);
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, rv, s, "mod_dart: Failed to create the response cache, it is disabled");
+    return;
+  }
+  char *base = (char*) apr_shm_baseaddr_get(shm);
+  memset(base, 0, sizeof(dart_cache));
+  rv = apr_rmm_init(&cache_rmm, NULL, base + sizeof(dart_cache), size - sizeof(dart_cache), pconf);
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, rv, s, "mod_dart: Failed to create the response cache, it is disabled");
+    return;
+  }
+  cache = (dart_cache*) base;
+  cache_max_entry = (size - sizeof(dart_cache)) / 4; // so one response can't flush the whole cache
+}
+
+extern "C" void DartCacheChildInit(apr_pool_t *p, server_rec *s) {
+  if (!cache) return;
+  apr_status_t rv = apr_global_mutex_child_init(&cache_mutex, NULL, p);
+  for (int i = 0; i < DART_CACHE_STRIPES && rv == APR_SUCCESS; i++) rv = apr_global_mutex_child_init(&stripe_mutexes[i], NULL, p);
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, rv, s, "mod_dart: Failed to attach to the response cache's lock, it is disabled");
+    cache = NULL;
+  }
+}
+
+static bool cache_lock() {
+  return apr_global_mutex_lock(cache_mutex) == APR_SUCCESS;
+}
+
+static void cache_unlock() {
+  apr_global_mutex_unlock(cache_mutex);
+}
+
+static apr_global_mutex_t *stripe_mutex(apr_uint32_t hash) {
+  return stripe_mutexes[(hash % DART_CACHE_BUCKETS) / (DART_CACHE_BUCKETS / DART_CACHE_STRIPES)];
+}
+
+// Locks the buckets that include the one for [hash].
+static bool stripe_lock(apr_uint32_t hash) {
+  return apr_global_mutex_lock(stripe_mutex(hash)) == APR_SUCCESS;
+}
+
+static void stripe_unlock(apr_uint32_t hash) {
+  apr_global_mutex_unlock(stripe_mutex(hash));
+}
+
+static dart_cache_entry *entry_at(apr_rmm_off_t offset) {
+  return (dart_cache_entry*) apr_rmm_addr_get(cache_rmm, offset);
+}
+
+static char *entry_key(dart_cache_entry *entry) {
+  return (char*) (entry + 1);
+}
+
+static char *entry_data(dart_cache_entry *entry) {
+  return entry_key(entry) + entry->key_length;
+}
+
+static apr_uint32_t hash_key(const char *key, apr_size_t length) {
+  apr_ssize_t hash_length = length;
+  return apr_hashfunc_default(key, &hash_length);
+}
+
+// Returns the link (bucket or next field) that points at [key]'s entry, or NULL if it has none. Call with the stripe locked.
+static apr_rmm_off_t *find_link(const char *key, apr_size_t length, apr_uint32_t hash) {
+  apr_rmm_off_t *link = &(cache->buckets[hash % DART_CACHE_BUCKETS]);
+  while (*link) {
+    dart_cache_entry *entry = entry_at(*link);
+    if (entry->hash == hash && entry->key_length == length && !memcmp(entry_key(entry), key, length)) return link;
+    link = &(entry->next);
+  }
+  return NULL;
+}
+
+// Takes the entry [link] points at out of its bucket, and returns it for free_entries. Call with the stripe locked.
+static apr_rmm_off_t unlink_entry(apr_rmm_off_t *link) {
+  apr_rmm_off_t offset = *link;
+  dart_cache_entry *entry = entry_at(offset);
+  if (entry->spec) cache->specs[entry->hash % DART_CACHE_BUCKETS]--;
+  *link = entry->next;
+  entry->next = 0;
+  return offset;
+}
+
+// Frees [offset] and the unlinked entries chained after it. Call with no lock held.
+static void free_entries(apr_rmm_off_t offset) {
+  if (!offset || !cache_lock()) return;
+  while (offset) {
+    apr_rmm_off_t next = entry_at(offset)->next;
+    apr_rmm_free(cache_rmm, offset);
+    offset = next;
+  }
+  cache_unlock();
+}
+
+// Puts the new entry at [offset] in its bucket, and returns the entry it replaced (0 if none) for free_entries.
+// Call with the stripe locked.
+static apr_rmm_off_t link_entry(apr_rmm_off_t offset) {
+  dart_cache_entry *entry = entry_at(offset);
+  apr_rmm_off_t *link = find_link(entry_key(entry), entry->key_length, entry->hash);
+  apr_rmm_off_t replaced = link ? unlink_entry(link) : 0;
+  apr_uint32_t bucket = entry->hash % DART_CACHE_BUCKETS;
+  entry->next = cache->buckets[bucket];
+  cache->buckets[bucket] = offset;
+  if (entry->spec) cache->specs[bucket]++;
+  return replaced;
+}
+
+// Frees the expired entries in the next DART_CACHE_EVICT_BATCH buckets, or if there are none, the least recently
+// used entry among them. Returns false if those buckets are empty. Call with no lock held.
+static bool evict(apr_time_t now) {
+  apr_uint32_t first = apr_atomic_add32(&(cache->hand), DART_CACHE_EVICT_BATCH) % DART_CACHE_BUCKETS;
+  if (!stripe_lock(first)) return false; // the whole batch is in first's stripe
+  apr_rmm_off_t freed = 0;
+  apr_rmm_off_t *oldest = NULL;
+  apr_time_t oldest_used = 0;
+  for (apr_uint32_t i = first; i < first + DART_CACHE_EVICT_BATCH; i++) {
+    apr_rmm_off_t *link = &(cache->buckets[i]);
+    while (*link) {
+      dart_cache_entry *entry = entry_at(*link);
+      if (entry->expires <= now) {
+        apr_rmm_off_t offset = unlink_entry(link);
+        entry->next = freed;
+        freed = offset;
+        continue;
+      }
+      if (!oldest || entry->used < oldest_used) {
+        oldest = link;
+        oldest_used = entry->used;
+      }
+      link = &(entry->next);
+    }
+  }
+  if (!freed && oldest) freed = unlink_entry(oldest); // no entry was unlinked, so [oldest] is still valid
+  stripe_unlock(first);
+  free_entries(freed);
+  return freed != 0;
+}
+
+// Allocates an entry for [key] holding [data], evicting others if there isn't room, but doesn't link it in
+// (see link_entry). Returns 0 if there is no room. Call with no lock held.
+static apr_rmm_off_t new_entry(const char *key, apr_size_t key_length, apr_uint32_t hash, const char *data, apr_size_t length,
+                               apr_time_t expires, bool spec) {
+  apr_size_t size = sizeof(dart_cache_entry) + key_length + length;
+  apr_time_t now = apr_time_now();
+  apr_rmm_off_t offset = 0;
+  int empty = 0; // batches in a row that evict() found empty
+  while (!offset) {
+    if (!cache_lock()) return 0;
+    offset = apr_rmm_malloc(cache_rmm, size);
+    cache_unlock();
+    if (offset) break;
+    if (evict(now)) {
+      empty = 0;
+    } else if (++empty >= DART_CACHE_BUCKETS / DART_CACHE_EVICT_BATCH) {
+      return 0; // the cache is empty, or the entries are too small to make room
+    }
+  }
+  dart_cache_entry *entry = entry_at(offset);
+  entry->next = 0;
+  entry->hash = hash;
+  entry->expires = expires;
+  entry->used = now;
+  entry->key_length = key_length;
+  entry->data_length = length;
+  entry->spec = spec;
+  memcpy(entry_key(entry), key, key_length);
+  memcpy(entry_data(entry), data, length);
+  return offset;
+}
+
+// Returns [key]'s entry, or NULL if it has none or it has expired. Call with the stripe locked.
+static dart_cache_entry *find_entry(const char *key, apr_size_t key_length, apr_uint32_t hash) {
+  apr_rmm_off_t *link = find_link(key, key_length, hash);
+  if (!link) return NULL;
+  dart_cache_entry *entry = entry_at(*link);
+  apr_time_t now = apr_time_now();
+  if (entry->expires <= now) return NULL;
+  entry->used = now;
+  return entry;
+}
+
+// Copies the data of [key]'s entry into [pool], or returns NULL if it has none or it has expired. Takes the stripe's lock.
+static char *get_entry(apr_pool_t *pool, const char *key, apr_size_t key_length, apr_size_t *length) {
+  apr_uint32_t hash = hash_key(key, key_length);
+  if (!stripe_lock(hash)) return NULL;
+  dart_cache_entry *entry = find_entry(key, key_length, hash);
+  char *data = NULL;
+  if (entry) {
+    *length = entry->data_length;
+    data = (char*) apr_pmemdup(pool, entry_data(entry), entry->data_length);
+  }
+  stripe_unlock(hash);
+  return data;
+}
+
+static char *make_key(request_rec *r, bool query, const char **headers, int header_count, apr_size_t *length) {
+  apr_array_header_t *lines = apr_array_make(r->pool, header_count + 4, sizeof(const char*));
+  APR_ARRAY_PUSH(lines, const char*) = r->filename;
+  APR_ARRAY_PUSH(lines, const char*) = apr_psprintf(r->pool, "%" APR_TIME_T_FMT, r->finfo.mtime); // so an edit takes effect at once
+  APR_ARRAY_PUSH(lines, const char*) = r->uri;
+  APR_ARRAY_PUSH(lines, const char*) = (query && r->args) ? r->args : "";
+  for (int i = 0; i < header_count; i++) {
+    const char *value = apr_table_get(r->headers_in, headers[i]);
+    APR_ARRAY_PUSH(lines, const char*) = value ? apr_pstrcat(r->pool, headers[i], ":", value, NULL) : "";
+  }
+  char *key = apr_array_pstrcat(r->pool, lines, '\n');
+  *length = strlen(key);
+  return key;
+}
+
+static bool is_cacheable(request_rec *r) {
+  return cache && r->method_number == M_GET && !r->header_only && !r->main;
+}
+
+extern "C" int DartCacheServe(request_rec *r) {
+  if (!is_cacheable(r)) return DECLINED;
+  // Nearly every script never calls cacheResponse(), and this way its requests don't contend for the lock
+  apr_size_t filename_length = strlen(r->filename);
+  if (!cache->specs[hash_key(r->filename, filename_length) % DART_CACHE_BUCKETS]) return DECLINED;
+  apr_size_t spec_length, key_length, length;
+  char *spec = get_entry(r->pool, r->filename, filename_length, &spec_length);
+  if (!spec || !spec_length) return DECLINED;
+
+  apr_array_header_t *headers = apr_array_make(r->pool, 4, sizeof(const char*));
+  char *state;
+  spec = apr_pstrndup(r->pool, spec, spec_length);
+  for (char *name = apr_strtok(spec + 1, "\n", &state); name; name = apr_strtok(NULL, "\n", &state)) {
+    APR_ARRAY_PUSH(headers, const char*) = name;
+  }
+  char *key = make_key(r, spec[0] == 'q', (const char**) headers->elts, headers->nelts, &key_length);
+  char *data = get_entry(r->pool, key, key_length, &length);
+  if (!data) return DECLINED;
+
+  char *end = data + length;
+  if (*data) ap_set_content_type(r, data);
+  data += strlen(data) + 1;
+  apr_table_t *tables[] = { r->headers_out, r->err_headers_out };
+  for (int i = 0; i < 2; i++) {
+    while (*data) {
+      char *name = data;
+      char *value = name + strlen(name) + 1;
+      apr_table_addn(tables[i], name, value);
+      data = value + strlen(value) + 1;
+    }
+    data++;
+  }
+  ap_set_content_length(r, end - data);
+  apr_bucket_alloc_t *alloc = r->connection->bucket_alloc;
+  apr_bucket_brigade *brigade = apr_brigade_create(r->pool, alloc);
+  APR_BRIGADE_INSERT_TAIL(brigade, apr_bucket_pool_create(data, end - data, r->pool, alloc));
+  apr_status_t rv = ap_pass_brigade(r->output_filters, brigade);
+  if (rv != APR_SUCCESS) ap_log_rerror(APLOG_MARK, LOG_DEBUG, rv, r, "mod_dart: Failed to send a cached response");
+  return OK;
+}
+
+extern "C" dart_cache_capture *DartCacheCapture(request_rec *r, int seconds, bool query, const char **headers, int header_count) {
+  if (!is_cacheable(r) || seconds <= 0) return NULL;
+  dart_cache_capture *capture = (dart_cache_capture*) apr_pcalloc(r->pool, sizeof(dart_cache_capture));
+  apr_array_header_t *lines = apr_array_make(r->pool, header_count + 1, sizeof(const char*));
+  APR_ARRAY_PUSH(lines, const char*) = query ? "q" : "-";
+  for (int i = 0; i < header_count; i++) {
+    if (strchr(headers[i], '\n')) return NULL;
+    APR_ARRAY_PUSH(lines, const char*) = headers[i];
+  }
+  capture->spec = apr_array_pstrcat(r->pool, lines, '\n');
+  capture->spec_length = strlen(capture->spec);
+  capture->key = make_key(r, query, headers, header_count, &(capture->key_length));
+  capture->expires = apr_time_now() + apr_time_from_sec(seconds);
+  capture->body = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  capture->max_length = cache_max_entry;
+  return capture;
+}
+
+static int add_header(void *data, const char *name, const char *value) {
+  if (!*name) return 1; // would end the table early
+  for (size_t i = 0; i < sizeof(uncached_headers) / sizeof(const char*); i++) {
+    if (!strcasecmp(name, uncached_headers[i])) return 1;
+  }
+  apr_array_header_t *fields = (apr_array_header_t*) data;
+  APR_ARRAY_PUSH(fields, const char*) = name;
+  APR_ARRAY_PUSH(fields, const char*) = value;
+  return 1;
+}
+
+extern "C" void DartCacheStore(request_rec *r, dart_cache_capture *capture) {
+  if (r->status != HTTP_OK || capture->body_length > capture->max_length) return;
+  // A cached cookie would be handed to everyone
+  if (apr_table_get(r->headers_out, "Set-Cookie") || apr_table_get(r->err_headers_out, "Set-Cookie")) return;
+
+  apr_array_header_t *fields = apr_array_make(r->pool, 16, sizeof(const char*));
+  APR_ARRAY_PUSH(fields, const char*) = r->content_type ? r->content_type : "";
+  apr_table_do(add_header, fields, r->headers_out, NULL);
+  APR_ARRAY_PUSH(fields, const char*) = ""; // the empty name ending each table
+  apr_table_do(add_header, fields, r->err_headers_out, NULL);
+  APR_ARRAY_PUSH(fields, const char*) = "";
+  apr_size_t length = capture->body_length;
+  for (int i = 0; i < fields->nelts; i++) length += strlen(APR_ARRAY_IDX(fields, i, const char*)) + 1;
+  if (length > (apr_size_t) capture->max_length) return;
+  char *data = (char*) apr_palloc(r->pool, length);
+  char *next = data;
+  for (int i = 0; i < fields->nelts; i++) {
+    const char *field = APR_ARRAY_IDX(fields, i, const char*);
+    apr_size_t field_length = strlen(field) + 1;
+    memcpy(next, field, field_length);
+    next += field_length;
+  }
+  apr_size_t body_length = capture->body_length;
+  if (apr_brigade_flatten(capture->body, next, &body_length) != APR_SUCCESS || (apr_off_t) body_length != capture->body_length) return;
+
+  // Both entries are allocated before either is linked in, so a response is never stored without its spec
+  apr_size_t filename_length = strlen(r->filename);
+  apr_uint32_t spec_hash = hash_key(r->filename, filename_length), key_hash = hash_key(capture->key, capture->key_length);
+  apr_rmm_off_t spec = new_entry(r->filename, filename_length, spec_hash, capture->spec, capture->spec_length, capture->expires, true);
+  if (!spec) return;
+  apr_rmm_off_t response = new_entry(capture->key, capture->key_length, key_hash, data, length, capture->expires, false);
+  if (!response) {
+    free_entries(spec);
+    return;
+  }
+  if (!stripe_lock(spec_hash)) {
+    free_entries(spec);
+    free_entries(response);
+    return;
+  }
+  // The spec lives as long as the longest-lived response keyed by it
+  dart_cache_entry *old = find_entry(r->filename, filename_length, spec_hash);
+  if (old && old->data_length == capture->spec_length && !memcmp(entry_data(old), capture->spec, capture->spec_length)
+      && old->expires > capture->expires) {
+    entry_at(spec)->expires = old->expires;
+  }
+  apr_rmm_off_t replaced = link_entry(spec);
+  stripe_unlock(spec_hash);
+  free_entries(replaced);
+  if (!stripe_lock(key_hash)) {
+    free_entries(response);
+    return;
+  }
+  replaced = link_entry(response);
+  stripe_unlock(key_hash);
+  free_entries(replaced);
+}
+
+static const char *shared_key(const char *key, apr_size_t *length) {
+  apr_size_t key_length = strlen(key);
+  char *result = (char*) malloc(key_length + 1);
+  if (!result) return NULL;
+  result[0] = DART_SHARED_PREFIX;
+  memcpy(result + 1, key, key_length);
+  *length = key_length + 1;
+  return result;
+}
+
+extern "C" apr_status_t DartSharedGet(const char *key, char **value, apr_size_t *length) {
+  *value = NULL;
+  if (!cache) return APR_ENOTIMPL;
+  apr_size_t key_length;
+  const char *full_key = shared_key(key, &key_length);
+  if (!full_key) return APR_ENOMEM;
+  apr_uint32_t hash = hash_key(full_key, key_length);
+  apr_status_t rv = APR_EGENERAL;
+  if (stripe_lock(hash)) {
+    dart_cache_entry *entry = find_entry(full_key, key_length, hash);
+    rv = APR_SUCCESS;
+    if (entry) {
+      *length = entry->data_length;
+      *value = (char*) malloc(entry->data_length);
+      if (*value) {
+        memcpy(*value, entry_data(entry), entry->data_length);
+      } else {
+        rv = APR_ENOMEM;
+      }
+    }
+    stripe_unlock(hash);
+  }
+  free((void*) full_key);
+  return rv;
+}
+
+extern "C" apr_status_t DartSharedPut(const char *key, const char *value, apr_size_t length) {
+  bool swapped;
+  return DartSharedCompareAndSwap(key, false, NULL, 0, value, length, &swapped);
+}
+
+extern "C" apr_status_t DartSharedCompareAndSwap(const char *key, bool compare, const char *expected, apr_size_t expected_length,
+                                                 const char *value, apr_size_t length, bool *swapped) {
+  *swapped = false;
+  if (!cache) return APR_ENOTIMPL;
+  if (value && length > cache_max_entry) return APR_ENOSPC;
+  apr_size_t key_length;
+  const char *full_key = shared_key(key, &key_length);
+  if (!full_key) return APR_ENOMEM;
+  apr_uint32_t hash = hash_key(full_key, key_length);
+  // Allocated first, so that running out of room leaves the current value alone
+  apr_rmm_off_t fresh = value ? new_entry(full_key, key_length, hash, value, length, DART_CACHE_FOREVER, false) : 0;
+  apr_status_t rv = (value && !fresh) ? APR_ENOSPC : APR_EGENERAL;
+  apr_rmm_off_t unused = fresh;
+  if (rv != APR_ENOSPC && stripe_lock(hash)) {
+    dart_cache_entry *entry = find_entry(full_key, key_length, hash);
+    if (!compare) {
+      *swapped = true;
+    } else if (expected) {
+      *swapped = entry && entry->data_length == expected_length && !memcmp(entry_data(entry), expected, expected_length);
+    } else {
+      *swapped = !entry;
+    }
+    rv = APR_SUCCESS;
+    if (*swapped && fresh) {
+      unused = link_entry(fresh);
+    } else if (*swapped && entry) {
+      apr_rmm_off_t removed = unlink_entry(find_link(full_key, key_length, hash));
+      entry_at(removed)->next = unused;
+      unused = removed;
+    }
+    stripe_unlock(hash);
+  }
+  free_entries(unused);
+  free((void*) full_key);
+  return rv;
+}
+
+extern "C" apr_status_t DartSharedIncrement(const char *key, apr_int64_t delta, apr_int64_t *result) {
+  if (!cache) return APR_ENOTIMPL;
+  apr_size_t key_length;
+  const char *full_key = shared_key(key, &key_length);
+  if (!full_key) return APR_ENOMEM;
+  apr_uint32_t hash = hash_key(full_key, key_length);
+  apr_rmm_off_t fresh = 0, unused = 0; // [fresh] holds [delta], in case the key has no entry
+  apr_status_t rv = APR_EGENERAL;
+  for (;;) {
+    if (!stripe_lock(hash)) {
+      rv = APR_EGENERAL;
+      unused = fresh;
+      break;
+    }
+    dart_cache_entry *entry = find_entry(full_key, key_length, hash);
+    bool done = true;
+    rv = APR_SUCCESS;
+    if (entry) {
+      apr_int64_t number;
+      if (entry->data_length == 1 + sizeof(number) && entry_data(entry)[0] == kSharedInt) {
+        memcpy(&number, entry_data(entry) + 1, sizeof(number));
+        number += delta;
+        memcpy(entry_data(entry) + 1, &number, sizeof(number)); // same size, so it is updated in place
+        *result = number;
+      } else {
+        rv = APR_EINVAL;
+      }
+      unused = fresh; // another request added the key meanwhile
+    } else if (fresh) {
+      *result = delta;
+      unused = link_entry(fresh);
+    } else {
+      done = false;
+    }
+    stripe_unlock(hash);
+    if (done) break;
+    // Allocating may evict, which takes other locks, so it is done with the lock released and then looked up again
+    char value[1 + sizeof(apr_int64_t)];
+    value[0] = kSharedInt;
+    memcpy(value + 1, &delta, sizeof(delta));
+    fresh = new_entry(full_key, key_length, hash, value, sizeof(value), DART_CACHE_FOREVER, false);
+    if (!fresh) {
+      rv = APR_ENOSPC;
+      break;
+    }
+  }
+  free_entries(unused);
+  free((void*) full_key);
+  return rv;
+}
@@ -0,0 +1,18 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+#library('cache');
+#import('apache:handler');
+
+/**
+ * Caches the response to the current request for [seconds], shared by all of Apache's children.
+ * Later GET requests for the same script and path are answered from the cache without running
+ * the script, as long as their query string (unless [query] is false) and the request [headers]
+ * named match. Only complete 200 responses that don't set cookies are cached.
+ */
+void cacheResponse(int seconds, [bool query = true, List<String> headers = const []]) {
+  _cacheResponse(request, seconds, query, headers);
+}
+
+_cacheResponse(request, seconds, query, headers) native 'Apache_Cache_Response';
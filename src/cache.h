@@ -0,0 +1,57 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+#ifndef MOD_DART_CACHE_H
+#define MOD_DART_CACHE_H
+
+#include "httpd.h"
+#include "apr_buckets.h"
+
+// A response being captured for the cache (apache:cache's cacheResponse), allocated from the request pool.
+typedef struct dart_cache_capture {
+  const char *spec; // how the script's responses are keyed, see cache.c
+  apr_size_t spec_length;
+  const char *key;
+  apr_size_t key_length;
+  apr_time_t expires;
+  apr_bucket_brigade *body; // copies of the buckets passed to the output filters
+  apr_off_t body_length;
+  apr_off_t max_length; // responses any bigger aren't cached
+} dart_cache_capture;
+
+// Creates the shared memory for the cache, [size] bytes, 0 to disable it. Called by dart_snapshots.
+extern "C" void DartCacheCreate(apr_pool_t *pconf, server_rec *s, apr_size_t size);
+extern "C" void DartCacheChildInit(apr_pool_t *p, server_rec *s);
+// Serves r from the cache and returns OK, or returns DECLINED if no cached response matches.
+extern "C" int DartCacheServe(request_rec *r);
+// Starts capturing r's response, to be cached for [seconds] under a key made from r's path and
+// (optionally) query string and request [headers]. Returns NULL if the response can't be cached.
+extern "C" dart_cache_capture *DartCacheCapture(request_rec *r, int seconds, bool query, const char **headers, int header_count);
+// Caches the captured response, if it completed with 200 OK.
+extern "C" void DartCacheStore(request_rec *r, dart_cache_capture *capture);
+
+// apache:shared's values are stored as one of these type bytes followed by the value's bytes: a string's
+// characters, in the narrowest of 8, 16 or 32 bits per character that holds them all, an apr_int64_t, or the bytes of a list.
+typedef enum {
+  kSharedString = 's',
+  kSharedString16 = 'u',
+  kSharedString32 = 'w',
+  kSharedInt = 'i',
+  kSharedBytes = 'b'
+} dart_shared_type;
+
+// The functions for apache:shared return APR_ENOTIMPL if the cache is disabled, and APR_ENOSPC if the value doesn't fit.
+// Sets [value] to a malloc'd copy of [key]'s value, or NULL if it has none.
+extern "C" apr_status_t DartSharedGet(const char *key, char **value, apr_size_t *length);
+// Sets [key]'s value, or removes it if [value] is NULL.
+extern "C" apr_status_t DartSharedPut(const char *key, const char *value, apr_size_t length);
+// Like DartSharedPut, but if [compare] is set, only if the current value is [expected] (or there is none, if
+// [expected] is NULL). Sets [swapped] to whether the value was replaced.
+extern "C" apr_status_t DartSharedCompareAndSwap(const char *key, bool compare, const char *expected, apr_size_t expected_length,
+                                                 const char *value, apr_size_t length, bool *swapped);
+// Adds [delta] to [key]'s integer value (0 if it has none), and sets [result] to the sum.
+// Returns APR_EINVAL if the value isn't an integer.
+extern "C" apr_status_t DartSharedIncrement(const char *key, apr_int64_t delta, apr_int64_t *result);
+
+#endif
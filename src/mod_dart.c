@@ -11,12 +11,40 @@
 #include "http_config.h"
 #include "http_log.h"
 #include "http_protocol.h"
+#include "http_request.h"
 #include "ap_config.h"
+#include "ap_mpm.h"
+#include "apr_atomic.h"
+#include "apr_file_io.h"
 #include "apr_hash.h"
+#include "apr_mmap.h"
+#include "apr_shm.h"
 #include "apr_strings.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_rwlock.h"
+#include "util_md5.h"
+
+#if defined(__linux__) && APR_HAS_FORK
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#define DART_SNAPSHOT_WATCH
+#endif
+
+#include "apache_library.h"
+#include "cache.h"
+#include "status.h"
 
 extern const uint8_t* snapshot_buffer; // corelib, dart:io etc
 
+// Snapshots saved in DartSnapshotCacheDir are only valid for the Dart VM and apache: libraries that created them,
+// see ApacheLibraryBuildId. Set by dart_snapshots in the parent.
+static const char *snapshot_build_id = "";
+
 typedef enum {
   kNull = 0,
   kNo,
@@ -25,95 +53,265 @@ typedef enum {
 
 typedef struct dart_dir_config {
   NullableBool debug;
+  NullableBool auto_snapshot;
+  NullableBool suspend;
+  apr_off_t output_buffer_size; // -1 if unset
+  apr_off_t input_chunk_size; // -1 if unset
+  apr_off_t form_max_size; // -1 if unset
+  int form_max_fields; // -1 if unset
+  int message_timeout; // seconds, -1 if unset
+  int timeout; // seconds, -1 if unset
 } dart_dir_config;
 
+#define DART_DEFAULT_OUTPUT_BUFFER_SIZE 65536
+#define DART_DEFAULT_INPUT_CHUNK_SIZE 65536
+#define DART_DEFAULT_FORM_MAX_SIZE 1048576
+#define DART_DEFAULT_FORM_MAX_FIELDS 1000
+#define DART_DEFAULT_MESSAGE_TIMEOUT 0
+#define DART_DEFAULT_CACHE_SIZE 8388608
+#define DART_WATCHDOG_INTERVAL apr_time_from_msec(100)
+#define DART_SNAPSHOT_DIRECTORY_DEPTH 32
+
+// A library or #source file a script snapshot was built from, as it was when it was loaded.
+typedef struct dart_snapshot_source {
+  const char *path;
+  time_t mtime;
+} dart_snapshot_source;
+
 typedef struct dart_snapshot {
+  const char *filename;
   uint8_t *buffer;
+  intptr_t size;
   time_t mtime;
   bool validate;
+  apr_pool_t *pool; // owns buffer if it was rebuilt, NULL if it lives forever
+  volatile apr_uint32_t rebuilding;
+  time_t failed_mtime; // script mtime at the last failed rebuild
+  char error[256]; // why the last rebuild failed, if it did
+  apr_array_header_t *libraries; // of dart_snapshot_source, NULL if unknown (e.g. mapped from DartSnapshotCacheDir)
+  volatile apr_uint32_t *changes; // DartSnapshotWatch events for the script and its libraries, in shared memory. NULL if unwatched
+  apr_uint32_t built_changes; // changes when buffer was created
+  apr_uint32_t failed_changes; // changes at the last failed rebuild, with DartSnapshotWatch
 } dart_snapshot;
 
 typedef struct dart_server_config {
   dart_server_config *base;
   dart_snapshot master_snapshot;
   apr_hash_t *snapshots;
+  int isolate_pool_size;
+  int isolate_max_requests;
+  int auto_snapshot_limit;
+  const char *snapshot_cache_dir;
+  int source_check_interval; // seconds
+  int snapshot_threads; // creating script snapshots at startup
+  NullableBool snapshot_watch; // use inotify rather than stat() to notice stale snapshots
+  const char *snapshot_warmup; // function called before script snapshots are created, NULL for none
+  apr_size_t cache_size; // bytes of shared memory for apache:cache and apache:shared, 0 to disable them
 } dart_server_config;
 
+// An isolate created by mod_dart, passed to the VM as the isolate's callback data.
+// Pooled isolates are created ahead of time, and may keep their script loaded between requests.
+typedef struct dart_isolate {
+  Dart_Isolate isolate;
+  server_rec *server;
+  char *script; // malloc'd, NULL until a script has been loaded
+  Dart_Handle library; // persistent handle to the script's library, so reuse needn't look it up
+  apr_time_t mtime; // of the loaded script
+  dart_snapshot *snapshot; // the script was loaded from, NULL if it was loaded from source
+  time_t snapshot_mtime; // snapshot->mtime and snapshot->built_changes when the script was loaded,
+  apr_uint32_t snapshot_changes; // which tell a rebuilt snapshot's buffer from the one that was loaded
+  apr_pool_t *libraries_pool; // unmanaged, owns libraries
+  apr_array_header_t *libraries; // of dart_snapshot_source, the files a script loaded from source imported
+  apr_time_t last_used;
+  int requests;
+  int slot; // index into isolate_pool, or -1 if this isolate isn't pooled
+  bool busy;
+  bool recycle; // don't reuse this isolate, e.g. because loading the script failed
+  dart_library_handles handles; // for the apache:handler natives
+  dart_timer *timer; // of the current request
+  int pending_messages; // notifications not yet handled, see MessageNotify
+  struct dart_isolate *next; // in live_isolates
+  struct dart_suspension *suspension; // while the request is suspended, waiting for messages
+  apr_time_t deadline; // of the current request (DartTimeout), 0 if none. Guarded by message_mutex
+  bool timed_out; // the watchdog interrupted the current request. Guarded by message_mutex
+  int pins; // the watchdog is about to interrupt the isolate, so it mustn't be shut down. Guarded by message_mutex
+  struct dart_isolate *next_due; // in the watchdog's list of isolates to interrupt
+} dart_isolate;
+
+// A request whose handler returned SUSPENDED while its isolate waits for messages (DartSuspend).
+// The MPM calls dart_resume with this as the baton, and has no way to cancel a callback,
+// so suspensions are only reused once all of their callbacks have run.
+typedef struct dart_suspension {
+  request_rec *r; // NULL once resumed
+  dart_isolate *isolate;
+  apr_time_t deadline; // of the message loop
+  int callbacks; // registered with the MPM and not yet run
+  bool wakeup; // a callback to resume straight away is registered
+  struct dart_suspension *next_free;
+} dart_suspension;
+
 extern module AP_MODULE_DECLARE_DATA dart_module;
-extern "C" Dart_Handle ApacheLibraryInit(request_rec* r);
-extern "C" Dart_Handle ApacheLibraryLoad();
 
-static bool IsolateCreate(const char* name, const char* main, void* data, char** error) {
-  request_rec *r = (request_rec*) data;
-  if (!r) {
-    *((const char**) error) = "Tried to spawn an isolate with no request (during snapshot phase?)";
-    return false;
-  }
-  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(r->server->module_config, &dart_module);
-  while (cfg->base) cfg = cfg->base;
-  if (!cfg->master_snapshot.buffer) {
-    *((const char**) error) = "dart_server_config.master_snapshot.buffer == NULL";
-    return false;
-  }
-  Dart_Isolate isolate = Dart_CreateIsolate(name, main, cfg->master_snapshot.buffer, data, error);
-  if (!isolate) return false;
-  Dart_EnterScope();
-  Builtin::SetupLibrary(Builtin::LoadLibrary(Builtin::kBuiltinLibrary), Builtin::kBuiltinLibrary);
-  Builtin::SetupLibrary(Builtin::LoadLibrary(Builtin::kIOLibrary), Builtin::kIOLibrary);
-  return true;
-}
+// Sources of scripts and libraries, shared by all of a child's isolates. Files are only stat()ed again once
+// source_check_interval has passed, or when the caller has seen a different mtime.
+typedef struct dart_source {
+  apr_pool_t *pool; // unmanaged, holds text, replaced when the file changes
+  const char *text; // NUL-terminated, NULL if the file doesn't exist
+  apr_off_t size;
+  time_t mtime;
+  apr_time_t checked;
+} dart_source;
 
-static void IsolateShutdown(void* data) {
+static apr_pool_t *source_cache_pool = NULL;
+static apr_hash_t *source_cache = NULL; // path -> dart_source, NULL until child_init
+static apr_interval_time_t source_check_interval = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *source_cache_mutex = NULL; // not held while files are stat()ed or read
+#endif
+
+static void source_cache_lock() {
+#if APR_HAS_THREADS
+  if (source_cache_mutex) apr_thread_mutex_lock(source_cache_mutex);
+#endif
 }
 
-static bool IsolateInterrupt() {
-  printf("Isolate interrupted!\n");
-  return true;
+static void source_cache_unlock() {
+#if APR_HAS_THREADS
+  if (source_cache_mutex) apr_thread_mutex_unlock(source_cache_mutex);
+#endif
 }
 
-Dart_Handle LoadFile(const char* cpath, struct stat *status_ptr) {
-  struct stat status;
-  if (stat(cpath, &status)) {
-    if (errno == ENOENT) return Dart_Null();
-    return Dart_Error("Couldn't stat %s: %s", cpath, strerror(errno));
+// Reads up to [size] bytes of [path] into [pool], and sets [text] to them as a NUL-terminated string.
+// A file that shrinks meanwhile is read up to its new end.
+static Dart_Handle read_source(apr_pool_t *pool, const char *path, apr_off_t size, const char **text) {
+  char *buffer = (char*) apr_palloc(pool, size + 1);
+  if (!buffer) return Dart_Error("Failed to allocate %ld bytes for %s", (long) size, path);
+  apr_size_t length = 0;
+  if (size) {
+    apr_file_t *file;
+    apr_status_t rv = apr_file_open(&file, path, APR_READ | APR_BINARY, APR_OS_DEFAULT, pool);
+    if (rv != APR_SUCCESS) return Dart_Error("Failed to open %s for read: %s", path, strerror(rv));
+    rv = apr_file_read_full(file, buffer, size, &length);
+    apr_file_close(file);
+    if (rv != APR_SUCCESS && rv != APR_EOF) return Dart_Error("Failed to read %s: %s", path, strerror(rv));
   }
-  if (status_ptr) *status_ptr = status;
+  buffer[length] = 0;
+  *text = buffer;
+  return Dart_Null();
+}
 
-  if (!status.st_size) return Dart_NewString("");
+// Returns the source of [path] as a Dart string, or null if it doesn't exist. If [mtime] isn't NULL, it is set
+// to the source's mtime; if it is set on entry, a cached source with another mtime is checked again straight away.
+// Before child_init (i.e. for startup snapshots) there is no cache, and the file is read just for this call.
+Dart_Handle LoadFile(const char* path, time_t *mtime) {
+  apr_time_t now = apr_time_now();
+  source_cache_lock();
+  dart_source *source = source_cache ? (dart_source*) apr_hash_get(source_cache, path, APR_HASH_KEY_STRING) : NULL;
+  if (source && now - source->checked < source_check_interval && !(mtime && *mtime && *mtime != source->mtime)) {
+    Dart_Handle result = source->text ? Dart_NewString(source->text) : Dart_Null();
+    if (mtime && source->text) *mtime = source->mtime;
+    source_cache_unlock();
+    return result;
+  }
+  source_cache_unlock();
 
-  char *bytes = (char*) malloc(status.st_size + 1);
-  if (!bytes) return Dart_Error("Failed to malloc %d bytes for %s: %s", status.st_size, cpath, strerror(errno));
+  struct stat status;
+  if (stat(path, &status)) {
+    if (errno != ENOENT) return Dart_Error("Couldn't stat %s: %s", path, strerror(errno));
+    source_cache_lock();
+    source = source_cache ? (dart_source*) apr_hash_get(source_cache, path, APR_HASH_KEY_STRING) : NULL;
+    if (source) {
+      if (source->pool) apr_pool_destroy(source->pool);
+      source->pool = NULL;
+      source->text = NULL;
+      source->checked = now;
+    }
+    source_cache_unlock();
+    return Dart_Null();
+  }
+  source_cache_lock();
+  source = source_cache ? (dart_source*) apr_hash_get(source_cache, path, APR_HASH_KEY_STRING) : NULL;
+  if (source && source->text && source->mtime == status.st_mtime && source->size == status.st_size) {
+    source->checked = now;
+    if (mtime) *mtime = source->mtime;
+    Dart_Handle result = Dart_NewString(source->text);
+    source_cache_unlock();
+    return result;
+  }
+  source_cache_unlock();
 
-  FILE *fh = fopen(cpath, "r");
-  if (!fh) {
-    free(bytes);
-    return Dart_Error("Failed to open %s for read: %s", cpath, strerror(errno));
+  apr_pool_t *pool;
+  if (apr_pool_create_unmanaged_ex(&pool, NULL, NULL) != APR_SUCCESS) return Dart_Error("Failed to create a pool for %s", path);
+  const char *text;
+  Dart_Handle result = read_source(pool, path, status.st_size, &text);
+  if (Dart_IsError(result)) {
+    apr_pool_destroy(pool);
+    return result;
+  }
+  if (mtime) *mtime = status.st_mtime;
+  result = Dart_NewString(text);
+  if (!source_cache) {
+    apr_pool_destroy(pool);
+    return result;
+  }
+  source_cache_lock();
+  // Another thread may have read the file meanwhile: this copy is at least as fresh
+  source = (dart_source*) apr_hash_get(source_cache, path, APR_HASH_KEY_STRING);
+  if (!source) {
+    source = (dart_source*) apr_pcalloc(source_cache_pool, sizeof(dart_source));
+    apr_hash_set(source_cache, apr_pstrdup(source_cache_pool, path), APR_HASH_KEY_STRING, source);
   }
+  if (source->pool) apr_pool_destroy(source->pool);
+  source->pool = pool;
+  source->text = text;
+  source->size = status.st_size;
+  source->mtime = status.st_mtime;
+  source->checked = now;
+  source_cache_unlock();
+  return result;
+}
 
-  int total = 0, r;
-  while (total < status.st_size) {
-    r = fread(&(bytes[total]), 1, status.st_size - total + 1, fh);
-    if (r == 0) {
-      free(bytes);
-      fclose(fh);
-      return Dart_Error("File was shorter: %s expected %d got %d", cpath, status.st_size, total);
+// Whether [libraries] (of dart_snapshot_source) still have the mtimes they were loaded with. Like LoadFile,
+// uses the cached mtime of a source checked within source_check_interval, and stat()s the others.
+static bool sources_current(apr_array_header_t *libraries) {
+  apr_time_t now = apr_time_now();
+  for (int i = 0; libraries && i < libraries->nelts; i++) {
+    dart_snapshot_source *library = &(((dart_snapshot_source*) libraries->elts)[i]);
+    source_cache_lock();
+    dart_source *source = source_cache ? (dart_source*) apr_hash_get(source_cache, library->path, APR_HASH_KEY_STRING) : NULL;
+    bool cached = source && now - source->checked < source_check_interval;
+    bool current = cached && source->text && source->mtime == library->mtime;
+    source_cache_unlock();
+    if (cached) {
+      if (!current) return false;
+      continue;
     }
-    total += r;
+    struct stat status;
+    if (stat(library->path, &status) || status.st_mtime != library->mtime) return false;
   }
+  return true;
+}
 
-  if (!feof(fh) || total > status.st_size) {
-    free(bytes);
-    fclose(fh);
-    return Dart_Error("File was longer: %s expected %d", cpath, status.st_size);
+// Removes "." segments from [path] in place, so "./lib.dart" and "lib.dart" share a source cache entry.
+// ".." is left alone: through a symlink, "dir/.." isn't necessarily the directory containing dir.
+static void normalize_path(char* path) {
+  char *out = path;
+  for (char *segment = path; *segment; ) {
+    char *end = strchr(segment, '/');
+    size_t length = end ? end - segment + 1 : strlen(segment);
+    if (strncmp(segment, "./", 2)) {
+      memmove(out, segment, length);
+      out += length;
+    }
+    segment += length;
   }
-
-  fclose(fh);
-  bytes[status.st_size] = 0;
-  Dart_Handle result = Dart_NewString(bytes);
-  free(bytes);
-  return result;
+  *out = 0;
 }
 
+// While a script snapshot is being created, or a pooled isolate loads a script from source,
+// the libraries and sources it loads are added to this
+static __thread apr_array_header_t *snapshot_libraries = NULL;
+
 // Returns a malloc'd string
 static char* merge_paths(const char* root, const char* relative) {
   if (*relative == '/') return strdup(relative);
@@ -122,6 +320,7 @@ static char* merge_paths(const char* root, const char* relative) {
   char* result = (char*) malloc(pos + strlen(relative) + 1);
   memmove(result, root, pos);
   memmove(&(result[pos]), relative, strlen(relative) + 1); // include 0
+  normalize_path(result);
   return result;
 }
 
@@ -140,8 +339,14 @@ static Dart_Handle LibraryTagHandler(Dart_LibraryTag type, Dart_Handle library,
     result = Dart_StringToCString(Dart_LibraryUrl(library), &root_url);
     if (Dart_IsError(result)) return result;
     char* path = merge_paths(root_url, curl);
-    source = LoadFile(path, NULL);
+    time_t mtime = 0;
+    source = LoadFile(path, snapshot_libraries ? &mtime : NULL);
     if (Dart_IsNull(source)) source = Dart_Error("File %s was not found\n", curl);
+    if (snapshot_libraries && !Dart_IsError(source)) {
+      dart_snapshot_source *loaded = (dart_snapshot_source*) apr_array_push(snapshot_libraries);
+      loaded->path = apr_pstrdup(snapshot_libraries->pool, path);
+      loaded->mtime = mtime;
+    }
     free(path);
     if (Dart_IsError(source)) return source;
   }
@@ -182,6 +387,9 @@ static Dart_Handle ScriptSnapshotLibraryTagHandler(Dart_LibraryTag type, Dart_Ha
     if (Dart_IsError(result)) return result;
     if (type == kImportTag && !strcmp(curl, "apache:handler")) {
       return ApacheLibraryLoad();
+    } else if (type == kImportTag && (!strcmp(curl, "apache:cache") || !strcmp(curl, "apache:shared"))) {
+      result = ApacheLibraryLoad(); // loads apache:cache and apache:shared too
+      return Dart_IsError(result) ? result : Dart_LookupLibrary(url);
     } else if (!strstr(curl, ":")) {
       return LibraryTagHandler(type, library, url);
     }
@@ -189,32 +397,679 @@ static Dart_Handle ScriptSnapshotLibraryTagHandler(Dart_LibraryTag type, Dart_Ha
   return MasterSnapshotLibraryTagHandler(type, library, url);
 }
 
-static bool dart_isolate_create(request_rec *r) {
-  char* error;
-  if (!IsolateCreate("name", "main", (void*) r, &error)) {
-    ap_log_rerror(APLOG_MARK, LOG_WARNING, 0, r, "Failed to create isolate: %s", error);
-    return false;
+// Messages (timers, dart:io events, other isolates) are posted to isolates from other threads. The VM tells us
+// about each one through MessageNotify, which counts it on the dart_isolate and wakes up the message loop.
+static dart_isolate *live_isolates = NULL; // all of this child's isolates, guarded by message_mutex
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *message_mutex = NULL;
+static apr_thread_cond_t *message_posted = NULL;
+#endif
+
+static void message_lock() {
+#if APR_HAS_THREADS
+  if (message_mutex) apr_thread_mutex_lock(message_mutex);
+#endif
+}
+
+static void message_unlock() {
+#if APR_HAS_THREADS
+  if (message_mutex) apr_thread_mutex_unlock(message_mutex);
+#endif
+}
+
+#ifdef AP_MPMQ_CAN_SUSPEND
+static dart_suspension *free_suspensions = NULL; // guarded by message_mutex
+static apr_pool_t *suspension_pool = NULL; // created by child_init
+static void dart_wakeup(dart_suspension *suspension);
+#endif
+
+static void MessageNotify(Dart_Isolate target) {
+  message_lock();
+  for (dart_isolate *isolate = live_isolates; isolate; isolate = isolate->next) {
+    if (isolate->isolate != target) continue;
+    isolate->pending_messages++;
+#ifdef AP_MPMQ_CAN_SUSPEND
+    if (isolate->suspension) dart_wakeup(isolate->suspension);
+#endif
   }
+#if APR_HAS_THREADS
+  if (message_posted) apr_thread_cond_broadcast(message_posted);
+#endif
+  message_unlock();
+}
+
+// Creates an isolate from the master snapshot. It is left entered, with a scope open.
+static dart_isolate *NewIsolate(server_rec *s, const char* name, const char* main, char** error) {
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(s->module_config, &dart_module);
+  while (cfg->base) cfg = cfg->base;
+  if (!cfg->master_snapshot.buffer) {
+    *((const char**) error) = "dart_server_config.master_snapshot.buffer == NULL";
+    return NULL;
+  }
+  dart_isolate *isolate = (dart_isolate*) calloc(1, sizeof(dart_isolate));
+  if (!isolate) {
+    *((const char**) error) = "Failed to allocate dart_isolate";
+    return NULL;
+  }
+  isolate->server = s;
+  isolate->slot = -1;
+  isolate->isolate = Dart_CreateIsolate(name, main, cfg->master_snapshot.buffer, isolate, error);
+  if (!isolate->isolate) {
+    free(isolate);
+    return NULL;
+  }
+  Dart_SetMessageNotifyCallback(MessageNotify);
+  message_lock();
+  isolate->next = live_isolates;
+  live_isolates = isolate;
+  message_unlock();
   Dart_EnterScope();
+  Builtin::SetupLibrary(Builtin::LoadLibrary(Builtin::kBuiltinLibrary), Builtin::kBuiltinLibrary);
+  Builtin::SetupLibrary(Builtin::LoadLibrary(Builtin::kIOLibrary), Builtin::kIOLibrary);
   Dart_SetLibraryTagHandler(LibraryTagHandler);
-  Dart_Handle result = ApacheLibraryInit(r);
-  if (Dart_IsError(result)) {
-    ap_log_rerror(APLOG_MARK, LOG_WARNING, 0, r, "Failed to initialize Apache library: %s", Dart_GetError(result));
+  return isolate;
+}
+
+static bool IsolateCreate(const char* name, const char* main, void* data, char** error) {
+  dart_isolate *parent = (dart_isolate*) data;
+  if (!parent) {
+    *((const char**) error) = "Tried to spawn an isolate with no parent (during snapshot phase?)";
     return false;
   }
+  if (!NewIsolate(parent->server, name, main, error)) return false;
+  Dart_ExitScope();
   return true;
 }
 
-static apr_status_t dart_isolate_destroy(void* ctx) {
+static void IsolateShutdown(void* data) {
+  dart_isolate *isolate = (dart_isolate*) data;
+  if (!isolate) return; // snapshot isolates have no callback data
+  message_lock();
+  for (dart_isolate **link = &live_isolates; *link; link = &(*link)->next) {
+    if (*link == isolate) {
+      *link = isolate->next;
+      break;
+    }
+  }
+  message_unlock();
+  if (isolate->libraries_pool) apr_pool_destroy(isolate->libraries_pool);
+  free(isolate->script);
+  free(isolate);
+}
+
+extern "C" dart_library_handles *DartIsolateHandles() {
+  dart_isolate *isolate = (dart_isolate*) Dart_CurrentIsolateData();
+  return isolate ? &isolate->handles : NULL; // snapshot isolates have no callback data
+}
+
+// Called on the isolate's thread after the watchdog interrupts it. Returning false terminates the script.
+static bool IsolateInterrupt() {
+  dart_isolate *isolate = (dart_isolate*) Dart_CurrentIsolateData();
+  if (!isolate) return true;
+  message_lock();
+  bool timed_out = isolate->timed_out;
+  message_unlock();
+  return !timed_out;
+}
+
+// Sets the deadline of the request the isolate is about to run, or clears it when [timeout] is 0.
+// Notifications counted during an earlier request are forgotten, so they can't wake this one.
+static void dart_set_deadline(dart_isolate *isolate, int timeout) {
+  message_lock();
+  isolate->deadline = timeout ? apr_time_now() + apr_time_from_sec(timeout) : 0;
+  isolate->timed_out = false;
+  isolate->pending_messages = 0;
+  message_unlock();
+}
+
+// Whether the current request has run out of DartTimeout: either the watchdog interrupted it, or the deadline
+// has passed and the watchdog (which only looks every DART_WATCHDOG_INTERVAL) hasn't got to it yet.
+static bool dart_timed_out(dart_isolate *isolate) {
+  message_lock();
+  bool timed_out = isolate->timed_out || (isolate->deadline && apr_time_now() >= isolate->deadline);
+  message_unlock();
+  return timed_out;
+}
+
+// Waits until the watchdog has finished interrupting [isolate], before it is shut down
+static void dart_isolate_unpin_wait(dart_isolate *isolate) {
+  message_lock();
+  while (isolate->pins) {
+    message_unlock();
+    apr_sleep(1000);
+    message_lock();
+  }
+  message_unlock();
+}
+
+#if APR_HAS_THREADS
+// Each child's watchdog thread interrupts the isolates of requests that have run past their DartTimeout.
+static apr_thread_t *watchdog = NULL;
+static bool watchdog_stop = false; // guarded by message_mutex
+static apr_thread_cond_t *watchdog_wakeup = NULL;
+
+static void * APR_THREAD_FUNC dart_watchdog_run(apr_thread_t *thread, void *data) {
+  message_lock();
+  while (!watchdog_stop) {
+    apr_thread_cond_timedwait(watchdog_wakeup, message_mutex, DART_WATCHDOG_INTERVAL);
+    apr_time_t now = apr_time_now();
+    dart_isolate *due = NULL;
+    for (dart_isolate *isolate = live_isolates; isolate; isolate = isolate->next) {
+      if (!isolate->deadline || isolate->timed_out || now < isolate->deadline) continue;
+      isolate->timed_out = true;
+      isolate->pins++; // see dart_isolate_unpin_wait
+      isolate->next_due = due;
+      due = isolate;
+    }
+    if (!due) continue;
+    // Not with message_mutex held, as the VM may hold its own locks when it calls MessageNotify
+    message_unlock();
+    for (dart_isolate *isolate = due; isolate; isolate = isolate->next_due) Dart_InterruptIsolate(isolate->isolate);
+    message_lock();
+    while (due) {
+      dart_isolate *isolate = due;
+      due = isolate->next_due;
+      isolate->pins--;
+    }
+  }
+  message_unlock();
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t dart_watchdog_destroy(void *ctx) {
+  message_lock();
+  watchdog_stop = true;
+  apr_thread_cond_signal(watchdog_wakeup);
+  message_unlock();
+  apr_status_t rv;
+  apr_thread_join(&rv, watchdog);
+  watchdog = NULL;
+  return APR_SUCCESS;
+}
+#endif
+
+// Per-child pool of idle isolates. Pooled isolates are stored exited, with no scope open.
+static dart_isolate **isolate_pool = NULL;
+static int isolate_pool_size = 0;
+#if APR_HAS_THREADS
+// Guards isolate_pool and the busy flags. Isolates are only created, entered or shut down with it released:
+// an isolate that is busy, or whose slot is NULL, belongs to a single thread.
+static apr_thread_mutex_t *isolate_pool_mutex = NULL;
+
+// Each child's filler thread creates the isolates that replace those shut down after a request, so the request's
+// worker needn't wait for them. Slots it is to refill are NULL, and flagged in pool_refills (guarded by
+// isolate_pool_mutex, as are filler and filler_stop).
+static apr_thread_t *filler = NULL;
+static apr_thread_cond_t *fill_posted = NULL;
+static bool *pool_refills = NULL;
+static bool filler_stop = false;
+#endif
+
+static void dart_pool_lock() {
+#if APR_HAS_THREADS
+  if (isolate_pool_mutex) apr_thread_mutex_lock(isolate_pool_mutex);
+#endif
+}
+
+static void dart_pool_unlock() {
+#if APR_HAS_THREADS
+  if (isolate_pool_mutex) apr_thread_mutex_unlock(isolate_pool_mutex);
+#endif
+}
+
+static void dart_snapshot_lock(bool write);
+static void dart_snapshot_unlock();
+
+// Replaces slot [slot] of the pool with a blank isolate, which is left exited.
+// If [claim], it is returned busy, for the caller to use. The slot must be NULL or owned by the caller.
+static dart_isolate *dart_pool_fill(server_rec *s, int slot, bool claim) {
+  char *error;
+  dart_pool_lock();
+  isolate_pool[slot] = NULL;
+  dart_pool_unlock();
+  dart_isolate *isolate = NewIsolate(s, "mod_dart", "main", &error);
+  if (!isolate) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, 0, s, "mod_dart: Failed to create pooled isolate: %s", error);
+    return NULL;
+  }
+  isolate->slot = slot;
+  isolate->busy = claim;
   Dart_ExitScope();
-  Dart_ShutdownIsolate();
-  return OK;
+  Dart_ExitIsolate();
+  dart_pool_lock();
+  isolate_pool[slot] = isolate;
+  dart_pool_unlock();
+  return isolate;
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC dart_filler_run(apr_thread_t *thread, void *data) {
+  server_rec *s = (server_rec*) data;
+  apr_thread_mutex_lock(isolate_pool_mutex);
+  while (!filler_stop) {
+    int slot = 0;
+    while (slot < isolate_pool_size && !pool_refills[slot]) slot++;
+    if (slot == isolate_pool_size) {
+      apr_thread_cond_wait(fill_posted, isolate_pool_mutex);
+      continue;
+    }
+    pool_refills[slot] = false;
+    apr_thread_mutex_unlock(isolate_pool_mutex);
+    dart_pool_fill(s, slot, false);
+    apr_thread_mutex_lock(isolate_pool_mutex);
+  }
+  apr_thread_mutex_unlock(isolate_pool_mutex);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
 }
 
-static bool isCurrent(char* filename, dart_snapshot *snapshot) {
+// Slots still waiting to be refilled stay empty: the child is exiting
+static apr_status_t dart_filler_destroy(void *ctx) {
+  apr_thread_mutex_lock(isolate_pool_mutex);
+  apr_thread_t *thread = filler;
+  filler = NULL;
+  filler_stop = true;
+  apr_thread_cond_signal(fill_posted);
+  apr_thread_mutex_unlock(isolate_pool_mutex);
+  apr_status_t rv;
+  apr_thread_join(&rv, thread);
+  return APR_SUCCESS;
+}
+#endif
+
+// Shuts down the current isolate, and refills its pool slot if it had one. If [claim], the new isolate is created
+// on this thread and returned (see dart_pool_fill); otherwise the filler thread creates it, if it is running.
+static dart_isolate *dart_isolate_shutdown(dart_isolate *isolate, bool claim) {
+  int slot = isolate->slot;
+  server_rec *s = isolate->server;
+  bool posted = false;
+  dart_isolate_unpin_wait(isolate);
+  if (slot >= 0) {
+    dart_pool_lock();
+    isolate_pool[slot] = NULL; // before [isolate] is freed
+#if APR_HAS_THREADS
+    if (filler && !claim) {
+      pool_refills[slot] = true;
+      apr_thread_cond_signal(fill_posted);
+      posted = true;
+    }
+#endif
+    dart_pool_unlock();
+  }
+  Dart_ShutdownIsolate(); // frees [isolate] via IsolateShutdown
+  return (slot >= 0 && !posted) ? dart_pool_fill(s, slot, claim) : NULL;
+}
+
+static apr_status_t dart_pool_destroy(void *ctx) {
+  dart_pool_lock();
+  for (int i = 0; i < isolate_pool_size; i++) {
+    dart_isolate *isolate = isolate_pool[i];
+    if (!isolate || isolate->busy) continue;
+    isolate_pool[i] = NULL;
+    dart_isolate_unpin_wait(isolate);
+    Dart_EnterIsolate(isolate->isolate);
+    Dart_ShutdownIsolate();
+  }
+  isolate_pool_size = 0;
+  dart_pool_unlock();
+  return APR_SUCCESS;
+}
+
+// Returns an isolate for the request, entered on this thread and with a scope open.
+// Prefers an idle isolate that already has this version of the script loaded, then a blank one.
+// [snapshot] is the one the script would be loaded from (see getScriptSnapshot), NULL to load it from source:
+// an isolate that loaded another version of the snapshot, or whose imported sources have changed, isn't reused.
+static dart_isolate *dart_isolate_checkout(request_rec *r, dart_snapshot *snapshot, bool debug) {
+  time_t snapshot_mtime = 0;
+  apr_uint32_t snapshot_changes = 0;
+  if (snapshot) {
+    dart_snapshot_lock(false);
+    snapshot_mtime = snapshot->mtime;
+    snapshot_changes = snapshot->built_changes;
+    dart_snapshot_unlock();
+  }
+  int match = -1, blank = -1, victim = -1;
+  dart_pool_lock();
+  for (int i = 0; i < isolate_pool_size; i++) {
+    dart_isolate *isolate = isolate_pool[i];
+    if (!isolate || isolate->busy) continue;
+    if (!isolate->script) {
+      if (blank < 0) blank = i;
+    } else if (!strcmp(isolate->script, r->filename) && isolate->mtime == r->finfo.mtime && isolate->snapshot == snapshot
+        && (!snapshot || (isolate->snapshot_mtime == snapshot_mtime && isolate->snapshot_changes == snapshot_changes))) {
+      match = i;
+      break;
+    } else if (victim < 0 || isolate->last_used < isolate_pool[victim]->last_used) {
+      victim = i;
+    }
+  }
+  int slot = (match >= 0) ? match : (blank >= 0) ? blank : victim;
+  dart_isolate *isolate = (slot >= 0) ? isolate_pool[slot] : NULL;
+  if (isolate) isolate->busy = true;
+  dart_pool_unlock();
+  if (isolate && slot == match && !sources_current(isolate->libraries)) {
+    match = -1; // an imported library changed: recycle the isolate in place
+    victim = slot;
+  }
+  if (isolate && slot == victim) {
+    // Evict the least recently used script to make room
+    Dart_EnterIsolate(isolate->isolate);
+    isolate = dart_isolate_shutdown(isolate, true);
+  }
+  if (isolate) {
+    Dart_EnterIsolate(isolate->isolate);
+    Dart_EnterScope();
+    if (debug) apr_table_set(r->headers_out, "X-Dart-Isolate", (match >= 0) ? "Reused" : "Pooled");
+  } else {
+    // The pool is disabled or exhausted: use a throwaway isolate
+    char *error;
+    isolate = NewIsolate(r->server, "mod_dart", "main", &error);
+    if (!isolate) {
+      ap_log_rerror(APLOG_MARK, LOG_WARNING, 0, r, "Failed to create isolate: %s", error);
+      return NULL;
+    }
+    isolate->busy = true;
+    if (debug) apr_table_set(r->headers_out, "X-Dart-Isolate", "New");
+  }
+  isolate->last_used = r->request_time;
+  return isolate;
+}
+
+static apr_status_t dart_isolate_checkin(void* ctx) {
+  dart_isolate *isolate = (dart_isolate*) ctx;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(isolate->server->module_config, &dart_module);
+  while (cfg->base) cfg = cfg->base;
+  dart_timer *timer = isolate->timer;
+  DartStatusSkip(timer);
+  Dart_ExitScope();
+  isolate->timer = NULL;
+  dart_set_deadline(isolate, 0);
+  if (isolate->script) isolate->requests++;
+  if (isolate->slot < 0 || isolate->recycle
+      || (isolate->script && cfg->isolate_max_requests && isolate->requests >= cfg->isolate_max_requests)) {
+    dart_isolate_shutdown(isolate, false);
+  } else {
+    Dart_ExitIsolate(); // before another thread can check it out
+    dart_pool_lock();
+    isolate->busy = false;
+    dart_pool_unlock();
+  }
+  DartStatusPhase(timer, kPhaseShutdown);
+  DartStatusFinish(timer);
+  return APR_SUCCESS;
+}
+
+// DartSnapshotWatch: a watcher process, forked by the parent once the startup snapshots exist, counts the inotify events
+// for the files the snapshots were built from in shared memory, so isCurrent needn't stat() the script. There is one
+// inotify instance however many children there are. Directories are watched rather than files, to see files replaced by
+// a rename, as are the directories holding symbolic links on the way to a file, to see a link swapped for another.
+static bool snapshot_watching = false; // set by dart_snapshots once the watcher runs
+
+// The DartSnapshotWatch events counted for [snapshot], 0 if it isn't watched
+static apr_uint32_t dart_snapshot_changes(dart_snapshot *snapshot) {
+  return snapshot->changes ? apr_atomic_read32(snapshot->changes) : 0;
+}
+
+#ifdef DART_SNAPSHOT_WATCH
+typedef struct dart_watched_dir {
+  int wd;
+  apr_hash_t *files; // name -> apr_array_header_t of the counters of the snapshots built from the file
+} dart_watched_dir;
+
+static volatile apr_uint32_t *snapshot_watch_counters = NULL; // in shared memory, one per DartSnapshot that validates
+static int snapshot_watch_count = 0;
+static int snapshot_watch_pipe = -1; // non-blocking write end, on which children send the files of rebuilt snapshots
+// Only used in the watcher process
+static int snapshot_watch_fd = -1;
+static apr_pool_t *snapshot_watch_pool = NULL;
+static apr_hash_t *snapshot_watch_dirs = NULL; // wd -> dart_watched_dir
+
+#define DART_SNAPSHOT_WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB)
+
+static void snapshot_watch_changed(apr_array_header_t *counters) {
+  for (int i = 0; i < counters->nelts; i++) apr_atomic_inc32(((volatile apr_uint32_t**) counters->elts)[i]);
+}
+
+static void snapshot_watch_dir_changed(dart_watched_dir *dir) {
+  for (apr_hash_index_t *p = apr_hash_first(NULL, dir->files); p; p = apr_hash_next(p)) {
+    void *counters;
+    apr_hash_this(p, NULL, NULL, &counters);
+    snapshot_watch_changed((apr_array_header_t*) counters);
+  }
+}
+
+// Counts the events for [name] in the directory [dir_path] in [counter].
+static void snapshot_watch_name(server_rec *s, volatile apr_uint32_t *counter, const char *dir_path, const char *name) {
+  int wd = inotify_add_watch(snapshot_watch_fd, dir_path, DART_SNAPSHOT_WATCH_EVENTS);
+  if (wd < 0) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, errno, s, "mod_dart: Couldn't watch %s, changes to %s won't be noticed", dir_path, name);
+    return;
+  }
+  dart_watched_dir *dir = (dart_watched_dir*) apr_hash_get(snapshot_watch_dirs, &wd, sizeof(int));
+  if (!dir) {
+    dir = (dart_watched_dir*) apr_pcalloc(snapshot_watch_pool, sizeof(dart_watched_dir));
+    dir->wd = wd;
+    dir->files = apr_hash_make(snapshot_watch_pool);
+    apr_hash_set(snapshot_watch_dirs, &(dir->wd), sizeof(int), dir);
+  }
+  apr_array_header_t *counters = (apr_array_header_t*) apr_hash_get(dir->files, name, APR_HASH_KEY_STRING);
+  if (!counters) {
+    counters = apr_array_make(snapshot_watch_pool, 1, sizeof(volatile apr_uint32_t*));
+    apr_hash_set(dir->files, apr_pstrdup(snapshot_watch_pool, name), APR_HASH_KEY_STRING, counters);
+  }
+  bool found = false;
+  for (int i = 0; i < counters->nelts && !found; i++) found = ((volatile apr_uint32_t**) counters->elts)[i] == counter;
+  if (!found) *(volatile apr_uint32_t**) apr_array_push(counters) = counter;
+}
+
+// Watches [path] for the snapshot counted by [counter], which was built from the version of [path] modified at [mtime].
+// If it has changed since, the snapshot is stale right away. Called by the watcher.
+static void snapshot_watch_file(server_rec *s, volatile apr_uint32_t *counter, const char *path, time_t mtime) {
+  if (*path != '/') return; // script and library paths are absolute
+  // Each symbolic link on the way, in the directory holding it, so that replacing the link is noticed
+  char *prefix = strdup(path);
+  for (char *slash = strchr(prefix + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+    if (slash) *slash = 0;
+    struct stat status;
+    char *name = strrchr(prefix, '/');
+    if (!lstat(prefix, &status) && S_ISLNK(status.st_mode)) {
+      *name = 0;
+      snapshot_watch_name(s, counter, *prefix ? prefix : "/", name + 1);
+      *name = '/';
+    }
+    if (!slash) break;
+    *slash = '/';
+  }
+  free(prefix);
+  // Then the file itself, in the directory it really is in
+  char *real = realpath(path, NULL);
+  const char *file = real ? real : path;
+  const char *slash = strrchr(file, '/');
+  char *dir_path = strndup(file, (slash == file) ? 1 : slash - file);
+  snapshot_watch_name(s, counter, dir_path, slash + 1);
+  free(dir_path);
+  free(real);
+  struct stat status;
+  if (stat(path, &status) || status.st_mtime != mtime) apr_atomic_inc32(counter);
+}
+
+// Handles the watch requests in [requests] (see snapshot_watch), returning the length of the incomplete one at the end.
+static size_t snapshot_watch_requests(server_rec *s, char *requests, size_t length) {
+  char *line = requests;
+  for (char *end; (end = (char*) memchr(line, '\n', requests + length - line)); line = end + 1) {
+    *end = 0;
+    char *next;
+    apr_int64_t index = apr_strtoi64(line, &next, 10);
+    if (*next != ' ' || index < 0 || index >= snapshot_watch_count) continue;
+    apr_int64_t mtime = apr_strtoi64(next + 1, &next, 10);
+    if (*next != ' ') continue;
+    snapshot_watch_file(s, &(snapshot_watch_counters[index]), next + 1, (time_t) mtime);
+  }
+  length -= line - requests;
+  memmove(requests, line, length);
+  return length;
+}
+
+static void snapshot_watch_events(char *events, ssize_t length) {
+  for (char *next = events; next < events + length; ) {
+    struct inotify_event *event = (struct inotify_event*) next;
+    next += sizeof(struct inotify_event) + event->len;
+    if (event->mask & IN_Q_OVERFLOW) { // events were lost, so everything may have changed
+      for (apr_hash_index_t *p = apr_hash_first(NULL, snapshot_watch_dirs); p; p = apr_hash_next(p)) {
+        void *dir;
+        apr_hash_this(p, NULL, NULL, &dir);
+        snapshot_watch_dir_changed((dart_watched_dir*) dir);
+      }
+      continue;
+    }
+    dart_watched_dir *dir = (dart_watched_dir*) apr_hash_get(snapshot_watch_dirs, &(event->wd), sizeof(int));
+    if (!dir) continue;
+    if (event->mask & IN_IGNORED) { // the directory is gone, rebuilds will watch it again if it comes back
+      snapshot_watch_dir_changed(dir);
+      apr_hash_set(snapshot_watch_dirs, &(dir->wd), sizeof(int), NULL);
+    } else if (event->len) {
+      apr_array_header_t *counters = (apr_array_header_t*) apr_hash_get(dir->files, event->name, APR_HASH_KEY_STRING);
+      if (counters) snapshot_watch_changed(counters);
+    }
+  }
+}
+
+// The watcher process: with the inotify instance in snapshot_watch_fd, watches cfg's snapshots, then the files children send, until the parent exits.
+static void dart_snapshot_watch_run(apr_pool_t *p, server_rec *s, dart_server_config *cfg, pid_t parent, int requests_fd) {
+  snapshot_watch_pool = p;
+  snapshot_watch_dirs = apr_hash_make(p);
+  for (apr_hash_index_t *i = apr_hash_first(p, cfg->snapshots); i; i = apr_hash_next(i)) {
+    void *entry;
+    apr_hash_this(i, NULL, NULL, &entry);
+    dart_snapshot *snapshot = (dart_snapshot*) entry;
+    if (!snapshot->changes) continue;
+    snapshot_watch_file(s, snapshot->changes, snapshot->filename, snapshot->mtime);
+    for (int j = 0; snapshot->libraries && j < snapshot->libraries->nelts; j++) {
+      dart_snapshot_source *source = &(((dart_snapshot_source*) snapshot->libraries->elts)[j]);
+      snapshot_watch_file(s, snapshot->changes, source->path, source->mtime);
+    }
+  }
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char requests[2 * PIPE_BUF];
+  size_t pending = 0;
+  struct pollfd fds[2] = { { snapshot_watch_fd, POLLIN, 0 }, { requests_fd, POLLIN, 0 } };
+  while (getppid() == parent) {
+    if (poll(fds, 2, 1000) <= 0) continue;
+    if (fds[0].revents & POLLIN) {
+      ssize_t length = read(snapshot_watch_fd, events, sizeof(events));
+      if (length > 0) snapshot_watch_events(events, length);
+    }
+    if (fds[1].revents & POLLIN) {
+      ssize_t length = read(requests_fd, requests + pending, sizeof(requests) - pending);
+      if (length > 0) pending = snapshot_watch_requests(s, requests, pending + length);
+      if (pending == sizeof(requests)) pending = 0; // no request is this long, see snapshot_watch
+    }
+  }
+}
+
+// Asks the watcher to watch the script of [snapshot] and the libraries it was built from, once a child has rebuilt it
+static void snapshot_watch(server_rec *s, dart_snapshot *snapshot) {
+  if (!snapshot_watching || !snapshot->changes) return;
+  apr_int64_t index = snapshot->changes - snapshot_watch_counters;
+  for (int i = -1; snapshot->libraries && i < snapshot->libraries->nelts; i++) {
+    dart_snapshot_source *source = (i >= 0) ? &(((dart_snapshot_source*) snapshot->libraries->elts)[i]) : NULL;
+    const char *path = source ? source->path : snapshot->filename;
+    time_t mtime = source ? source->mtime : snapshot->mtime;
+    // Requests up to PIPE_BUF bytes are written whole, even with other children writing
+    char request[PIPE_BUF];
+    int length = apr_snprintf(request, sizeof(request), "%" APR_INT64_T_FMT " %" APR_INT64_T_FMT " %s\n", index, (apr_int64_t) mtime, path);
+    apr_status_t rv = 0;
+    if (length < (int) sizeof(request) - 1 && write(snapshot_watch_pipe, request, length) == length) continue;
+    if (length < (int) sizeof(request) - 1) rv = errno;
+    ap_log_error(APLOG_MARK, LOG_WARNING, rv, s, "mod_dart: Couldn't ask the watcher to watch %s, changes to it won't be noticed", path);
+  }
+}
+
+static apr_status_t dart_snapshot_watch_destroy(void *ctx) {
+  snapshot_watching = false;
+  close(snapshot_watch_pipe);
+  snapshot_watch_pipe = -1;
+  snapshot_watch_counters = NULL;
+  snapshot_watch_count = 0;
+  return APR_SUCCESS;
+}
+#else
+static void snapshot_watch(server_rec *s, dart_snapshot *snapshot) {
+}
+#endif
+
+// Starts the watcher process for cfg's snapshots, if DartSnapshotWatch is on. Called by the parent, in post_config.
+// Otherwise (or if inotify isn't available) isCurrent stat()s scripts.
+static void dart_snapshot_watch_start(apr_pool_t *pconf, server_rec *s, dart_server_config *cfg) {
+  if (cfg->snapshot_watch != kYes) return;
+#ifdef DART_SNAPSHOT_WATCH
+  int count = 0;
+  for (apr_hash_index_t *i = apr_hash_first(pconf, cfg->snapshots); i; i = apr_hash_next(i)) {
+    void *snapshot;
+    apr_hash_this(i, NULL, NULL, &snapshot);
+    if (((dart_snapshot*) snapshot)->validate) count++;
+  }
+  if (!count) return;
+  apr_shm_t *shm;
+  apr_status_t rv = apr_shm_create(&shm, count * sizeof(apr_uint32_t), NULL, pconf);
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, rv, s, "mod_dart: Failed to create shared memory, DartSnapshotWatch won't work");
+    return;
+  }
+  snapshot_watch_counters = (volatile apr_uint32_t*) apr_shm_baseaddr_get(shm);
+  memset((void*) snapshot_watch_counters, 0, count * sizeof(apr_uint32_t));
+  snapshot_watch_count = count;
+  int n = 0;
+  for (apr_hash_index_t *i = apr_hash_first(pconf, cfg->snapshots); i; i = apr_hash_next(i)) {
+    void *snapshot;
+    apr_hash_this(i, NULL, NULL, &snapshot);
+    if (((dart_snapshot*) snapshot)->validate) ((dart_snapshot*) snapshot)->changes = &(snapshot_watch_counters[n++]);
+  }
+  snapshot_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (snapshot_watch_fd < 0) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, errno, s, "mod_dart: Couldn't start inotify, DartSnapshotWatch won't work");
+    return;
+  }
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC)) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, errno, s, "mod_dart: Couldn't create the watcher's pipe, DartSnapshotWatch won't work");
+    close(snapshot_watch_fd);
+    snapshot_watch_fd = -1;
+    return;
+  }
+  fcntl(fds[1], F_SETFL, O_NONBLOCK); // a child mustn't wait for a busy watcher
+  pid_t parent = getpid();
+  apr_proc_t *proc = (apr_proc_t*) apr_pcalloc(pconf, sizeof(apr_proc_t));
+  rv = apr_proc_fork(proc, pconf);
+  if (rv == APR_INCHILD) {
+    close(fds[1]);
+    dart_snapshot_watch_run(pconf, s, cfg, parent, fds[0]);
+    _exit(0); // not exit(): the VM's threads didn't survive the fork, so its exit handlers mustn't run
+  }
+  close(fds[0]);
+  close(snapshot_watch_fd); // the watcher's
+  snapshot_watch_fd = -1;
+  if (rv != APR_INPARENT) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, rv, s, "mod_dart: Couldn't start the snapshot watcher, DartSnapshotWatch won't work");
+    close(fds[1]);
+    return;
+  }
+  apr_pool_note_subprocess(pconf, proc, APR_KILL_AFTER_TIMEOUT);
+  snapshot_watch_pipe = fds[1];
+  snapshot_watching = true;
+  apr_pool_cleanup_register(pconf, NULL, dart_snapshot_watch_destroy, apr_pool_cleanup_null);
+#else
+  ap_log_error(APLOG_MARK, LOG_WARNING, 0, s, "mod_dart: DartSnapshotWatch needs inotify, checking mtimes instead");
+#endif
+}
+
+static bool isCurrent(char* filename, dart_snapshot *snapshot, time_t *mtime) {
   if (!snapshot->validate) return true;
+  if (snapshot_watching) return snapshot->built_changes == dart_snapshot_changes(snapshot);
   struct stat status;
   if (stat(filename, &status)) return false;
+  *mtime = status.st_mtime;
   return snapshot->mtime >= status.st_mtime;
 }
 
@@ -223,65 +1078,677 @@ static bool isDebug(request_rec *r) {
   return cfg->debug == kYes;
 }
 
-static dart_snapshot *getScriptSnapshot(request_rec *r) {
+static void getRequestConfig(request_rec *r, dart_request_config *config) {
+  dart_dir_config *cfg = (dart_dir_config*) ap_get_module_config(r->per_dir_config, &dart_module);
+  config->output_buffer_size = (cfg->output_buffer_size < 0) ? DART_DEFAULT_OUTPUT_BUFFER_SIZE : cfg->output_buffer_size;
+  config->input_chunk_size = (cfg->input_chunk_size < 0) ? DART_DEFAULT_INPUT_CHUNK_SIZE : cfg->input_chunk_size;
+  config->form_max_size = (cfg->form_max_size < 0) ? DART_DEFAULT_FORM_MAX_SIZE : cfg->form_max_size;
+  config->form_max_fields = (cfg->form_max_fields < 0) ? DART_DEFAULT_FORM_MAX_FIELDS : cfg->form_max_fields;
+}
+
+static bool isAutoSnapshot(request_rec *r) {
+  dart_dir_config *cfg = (dart_dir_config*) ap_get_module_config(r->per_dir_config, &dart_module);
+  return cfg->auto_snapshot == kYes;
+}
+
+typedef Dart_Handle (*dart_snapshot_creator)(apr_pool_t *pool, dart_snapshot *target, const char* name);
+// DartSnapshotWarmup: the function script snapshots call before they are created, NULL for none.
+// Set by dart_snapshots in the parent, along with the server the warm-up request is for.
+static const char *snapshot_warmup = NULL;
+static server_rec *snapshot_warmup_server = NULL;
+Dart_Handle create_script_snapshot(apr_pool_t *pool, dart_snapshot *target, const char *name);
+bool load_snapshot(dart_server_config *cfg, apr_pool_t *pool, dart_snapshot* target, const char* name, uint8_t *base_snapshot, dart_snapshot_creator creator, char **error);
+
+// Guards swapping in rebuilt snapshot buffers: readers hold it while loading from a snapshot
+#if APR_HAS_THREADS
+static apr_thread_rwlock_t *snapshot_lock = NULL;
+#endif
+
+static void dart_snapshot_lock(bool write) {
+#if APR_HAS_THREADS
+  if (!snapshot_lock) return;
+  if (write) {
+    apr_thread_rwlock_wrlock(snapshot_lock);
+  } else {
+    apr_thread_rwlock_rdlock(snapshot_lock);
+  }
+#endif
+}
+
+static void dart_snapshot_unlock() {
+#if APR_HAS_THREADS
+  if (snapshot_lock) apr_thread_rwlock_unlock(snapshot_lock);
+#endif
+}
+
+typedef struct dart_rebuild {
+  apr_pool_t *pool; // unmanaged, becomes the snapshot's pool on success
+  server_rec *server;
+  dart_server_config *cfg;
+  dart_snapshot *snapshot;
+  time_t mtime; // of the script when the rebuild was triggered
+  apr_uint32_t changes; // of the snapshot when the rebuild was triggered
+  struct dart_rebuild *next; // in rebuild_queue
+} dart_rebuild;
+
+static void dart_snapshot_rebuild_run(dart_rebuild *job) {
+  dart_snapshot *snapshot = job->snapshot;
+  dart_snapshot fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  fresh.mtime = job->mtime; // the version that made the snapshot stale, see create_script_snapshot
+  char *error;
+  if (load_snapshot(job->cfg, job->pool, &fresh, snapshot->filename, job->cfg->master_snapshot.buffer, create_script_snapshot, &error)) {
+    dart_snapshot_lock(true);
+    apr_pool_t *old = snapshot->pool;
+    snapshot->buffer = fresh.buffer;
+    snapshot->size = fresh.size;
+    snapshot->mtime = fresh.mtime;
+    snapshot->libraries = fresh.libraries;
+    snapshot->built_changes = job->changes;
+    snapshot->pool = job->pool;
+    snapshot->error[0] = 0;
+    dart_snapshot_unlock();
+    if (old) apr_pool_destroy(old);
+    snapshot_watch(job->server, snapshot); // the script may import different libraries now
+    ap_log_error(APLOG_MARK, LOG_NOTICE, 0, job->server, "mod_dart: Rebuilt stale snapshot of %s", snapshot->filename);
+  } else {
+    ap_log_error(APLOG_MARK, LOG_WARNING, 0, job->server, "mod_dart: Snapshot rebuild failed for %s: %s", snapshot->filename, error);
+    dart_snapshot_lock(true);
+    apr_cpystrn(snapshot->error, error, sizeof(snapshot->error));
+    snapshot->failed_mtime = job->mtime;
+    snapshot->failed_changes = job->changes;
+    dart_snapshot_unlock();
+    apr_pool_destroy(job->pool);
+  }
+  apr_atomic_set32(&(snapshot->rebuilding), 0);
+}
+
+#if APR_HAS_THREADS
+// Each child's rebuilder thread creates the rebuilt snapshots, one at a time, and is joined when the child exits.
+// Jobs own their pools, so nothing the thread uses is freed before it is joined.
+static apr_thread_t *rebuilder = NULL;
+static apr_thread_mutex_t *rebuild_mutex = NULL;
+static apr_thread_cond_t *rebuild_posted = NULL;
+static dart_rebuild *rebuild_queue = NULL; // guarded by rebuild_mutex, as is rebuild_stop
+static bool rebuild_stop = false;
+
+static void * APR_THREAD_FUNC dart_rebuilder_run(apr_thread_t *thread, void *data) {
+  apr_thread_mutex_lock(rebuild_mutex);
+  while (!rebuild_stop) {
+    dart_rebuild *job = rebuild_queue;
+    if (!job) {
+      apr_thread_cond_wait(rebuild_posted, rebuild_mutex);
+      continue;
+    }
+    rebuild_queue = job->next;
+    apr_thread_mutex_unlock(rebuild_mutex);
+    dart_snapshot_rebuild_run(job);
+    apr_thread_mutex_lock(rebuild_mutex);
+  }
+  apr_thread_mutex_unlock(rebuild_mutex);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t dart_rebuilder_destroy(void *ctx) {
+  apr_thread_mutex_lock(rebuild_mutex);
+  rebuild_stop = true;
+  apr_thread_cond_signal(rebuild_posted);
+  apr_thread_mutex_unlock(rebuild_mutex);
+  apr_status_t rv;
+  apr_thread_join(&rv, rebuilder);
+  rebuilder = NULL;
+  while (rebuild_queue) { // never started
+    dart_rebuild *job = rebuild_queue;
+    rebuild_queue = job->next;
+    apr_atomic_set32(&(job->snapshot->rebuilding), 0);
+    apr_pool_destroy(job->pool);
+  }
+  return APR_SUCCESS;
+}
+#endif
+
+// Starts rebuilding a stale snapshot, unless it is already being rebuilt or this version of the script failed.
+// The stale buffer keeps being used (or not) until the new one is swapped in.
+// Must be called with no isolate entered, as the rebuild may run on this thread.
+static void dart_snapshot_rebuild(request_rec *r, dart_snapshot *snapshot, dart_server_config *cfg, time_t mtime) {
+  if (mtime && snapshot->failed_mtime == mtime) return;
+  apr_uint32_t changes = dart_snapshot_changes(snapshot);
+  if (snapshot_watching && snapshot->error[0] && snapshot->failed_changes == changes) return;
+  if (apr_atomic_cas32(&(snapshot->rebuilding), 1, 0) != 0) return;
+  apr_pool_t *pool;
+  if (apr_pool_create_unmanaged_ex(&pool, NULL, NULL) != APR_SUCCESS) {
+    apr_atomic_set32(&(snapshot->rebuilding), 0);
+    return;
+  }
+  dart_rebuild *job = (dart_rebuild*) apr_pcalloc(pool, sizeof(dart_rebuild));
+  job->pool = pool;
+  job->server = r->server;
+  job->snapshot = snapshot;
+  job->cfg = cfg;
+  job->mtime = mtime;
+  job->changes = changes;
+#if APR_HAS_THREADS
+  if (rebuilder) {
+    apr_thread_mutex_lock(rebuild_mutex);
+    dart_rebuild **tail = &rebuild_queue;
+    while (*tail) tail = &((*tail)->next);
+    *tail = job;
+    apr_thread_cond_signal(rebuild_posted);
+    apr_thread_mutex_unlock(rebuild_mutex);
+    return;
+  }
+#endif
+  dart_snapshot_rebuild_run(job);
+}
+
+// A snapshot created by DartAutoSnapshot the first time a script was served.
+typedef struct dart_auto_snapshot {
+  apr_pool_t *pool; // owns this entry and its buffer, destroyed once it is evicted and unused
+  const char *filename;
+  dart_snapshot snapshot; // buffer is NULL if the snapshot failed
+  apr_time_t last_used;
+  int users; // requests that may still be loading the snapshot
+  bool evicted;
+} dart_auto_snapshot;
+
+// Per-child LRU of auto snapshots, keyed by filename
+static apr_pool_t *auto_snapshot_pool = NULL;
+static apr_hash_t *auto_snapshots = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *auto_snapshot_mutex = NULL; // guards auto_snapshots and the entries' fields
+#endif
+
+static void dart_auto_snapshot_lock() {
+#if APR_HAS_THREADS
+  if (auto_snapshot_mutex) apr_thread_mutex_lock(auto_snapshot_mutex);
+#endif
+}
+
+static void dart_auto_snapshot_unlock() {
+#if APR_HAS_THREADS
+  if (auto_snapshot_mutex) apr_thread_mutex_unlock(auto_snapshot_mutex);
+#endif
+}
+
+// Called with auto_snapshot_mutex held.
+static void dart_auto_snapshot_remove(dart_auto_snapshot *entry) {
+  apr_hash_set(auto_snapshots, entry->filename, APR_HASH_KEY_STRING, NULL);
+  entry->evicted = true;
+  if (!entry->users) apr_pool_destroy(entry->pool);
+}
+
+static apr_status_t dart_auto_snapshot_release(void *ctx) {
+  dart_auto_snapshot *entry = (dart_auto_snapshot*) ctx;
+  dart_auto_snapshot_lock();
+  if (!--entry->users && entry->evicted) apr_pool_destroy(entry->pool);
+  dart_auto_snapshot_unlock();
+  return APR_SUCCESS;
+}
+
+// Returns [entry]'s snapshot, keeping it alive until the request ends. Called with auto_snapshot_mutex held.
+static dart_snapshot *dart_auto_snapshot_use(request_rec *r, dart_auto_snapshot *entry) {
+  entry->last_used = r->request_time;
+  entry->users++;
+  apr_pool_cleanup_register(r->pool, entry, dart_auto_snapshot_release, apr_pool_cleanup_null);
+  return &(entry->snapshot);
+}
+
+// Must be called with no isolate entered, as it creates one to take the snapshot.
+static dart_snapshot *getAutoSnapshot(request_rec *r, dart_server_config *cfg, dart_timer *timer) {
+  if (!auto_snapshots || cfg->auto_snapshot_limit <= 0 || r->finfo.filetype == APR_NOFILE) {
+    DartStatusCount(timer, kCounterSnapshotNone);
+    if (isDebug(r)) apr_table_set(r->headers_out, "X-Dart-Snapshot", "No; None configured");
+    return NULL;
+  }
+  time_t mtime = apr_time_sec(r->finfo.mtime);
+  dart_auto_snapshot_lock();
+  dart_auto_snapshot *entry = (dart_auto_snapshot*) apr_hash_get(auto_snapshots, r->filename, APR_HASH_KEY_STRING);
+  if (entry && entry->snapshot.mtime == mtime) {
+    if (!entry->snapshot.buffer) {
+      entry->last_used = r->request_time;
+      dart_auto_snapshot_unlock();
+      DartStatusCount(timer, kCounterSnapshotMiss);
+      if (isDebug(r)) apr_table_set(r->headers_out, "X-Dart-Snapshot", "No; Auto snapshot failed");
+      return NULL;
+    }
+    dart_snapshot *result = dart_auto_snapshot_use(r, entry);
+    dart_auto_snapshot_unlock();
+    DartStatusCount(timer, kCounterSnapshotHit);
+    if (isDebug(r)) apr_table_set(r->headers_out, "X-Dart-Snapshot", "Yes; Auto snapshot hit");
+    return result;
+  }
+  if (entry) dart_auto_snapshot_remove(entry); // stale
+  dart_auto_snapshot_unlock();
+
+  // Other threads may be creating the same snapshot meanwhile, the last one to finish is kept
+  DartStatusCount(timer, kCounterSnapshotMiss);
+  apr_pool_t *pool;
+  dart_auto_snapshot_lock(); // auto_snapshot_pool's subpools are created and destroyed under this lock
+  apr_status_t rv = apr_pool_create(&pool, auto_snapshot_pool);
+  dart_auto_snapshot_unlock();
+  if (rv != APR_SUCCESS) return NULL;
+  entry = (dart_auto_snapshot*) apr_pcalloc(pool, sizeof(dart_auto_snapshot));
+  entry->pool = pool;
+  entry->filename = apr_pstrdup(pool, r->filename);
+  entry->snapshot.mtime = mtime; // so create_script_snapshot doesn't use a source cached before the script changed
+  char *error;
+  if (!load_snapshot(cfg, pool, &(entry->snapshot), entry->filename, cfg->master_snapshot.buffer, create_script_snapshot, &error)) {
+    // Remember the failure until the script changes, rather than retrying on every request
+    ap_log_rerror(APLOG_MARK, LOG_WARNING, 0, r, "mod_dart: Auto snapshot failed for %s: %s", entry->filename, error);
+    entry->snapshot.buffer = NULL;
+  }
+  entry->snapshot.mtime = mtime;
+
+  dart_auto_snapshot_lock();
+  dart_auto_snapshot *existing = (dart_auto_snapshot*) apr_hash_get(auto_snapshots, entry->filename, APR_HASH_KEY_STRING);
+  if (existing) {
+    dart_auto_snapshot_remove(existing);
+  } else if (apr_hash_count(auto_snapshots) >= (unsigned) cfg->auto_snapshot_limit) {
+    dart_auto_snapshot *victim = NULL, *val;
+    for (apr_hash_index_t *p = apr_hash_first(r->pool, auto_snapshots); p; p = apr_hash_next(p)) {
+      apr_hash_this(p, NULL, NULL, (void**) &val);
+      if (!victim || val->last_used < victim->last_used) victim = val;
+    }
+    dart_auto_snapshot_remove(victim);
+  }
+  apr_hash_set(auto_snapshots, entry->filename, APR_HASH_KEY_STRING, entry);
+  dart_snapshot *result = NULL;
+  if (entry->snapshot.buffer) {
+    result = dart_auto_snapshot_use(r, entry);
+  } else {
+    entry->last_used = r->request_time;
+  }
+  dart_auto_snapshot_unlock();
+  if (isDebug(r)) {
+    apr_table_set(r->headers_out, "X-Dart-Snapshot", result ? "Yes; Auto snapshot miss, created" : "No; Auto snapshot failed");
+  }
+  return result;
+}
+
+static dart_snapshot *getScriptSnapshot(request_rec *r, dart_timer *timer) {
   dart_server_config *cfg = (dart_server_config*) ap_get_module_config(r->server->module_config, &dart_module);
   while (cfg->base) cfg = cfg->base;
   dart_snapshot* result = (dart_snapshot*) apr_hash_get(cfg->snapshots, r->filename, APR_HASH_KEY_STRING);
   if (!result) {
+    if (isAutoSnapshot(r)) return getAutoSnapshot(r, cfg, timer);
+    DartStatusCount(timer, kCounterSnapshotNone);
     if (isDebug(r)) apr_table_set(r->headers_out, "X-Dart-Snapshot", "No; None configured");
     return NULL;
   }
-  if (!result->buffer) {
-    if (isDebug(r)) apr_table_set(r->headers_out, "X-Dart-Snapshot", "No; Failed to create snapshot at startup");
-    return NULL;
+  time_t mtime = 0;
+  if (isCurrent(r->filename, result, &mtime) && result->buffer) {
+    DartStatusCount(timer, kCounterSnapshotHit);
+    if (isDebug(r)) apr_table_set(r->headers_out, "X-Dart-Snapshot", "Yes");
+    return result;
   }
-  if (!isCurrent(r->filename, result)) {
-    if (isDebug(r)) apr_table_set(r->headers_out, "X-Dart-Snapshot", "No; Snapshot is stale");
-    return NULL;
+  DartStatusCount(timer, kCounterSnapshotStale);
+  if (result->validate) dart_snapshot_rebuild(r, result, cfg, mtime);
+  if (isDebug(r)) {
+    dart_snapshot_lock(false);
+    const char *reason = result->buffer ? "Snapshot is stale" : "Failed to create snapshot at startup";
+    if (apr_atomic_read32(&(result->rebuilding))) {
+      reason = apr_pstrcat(r->pool, reason, ", rebuilding", NULL);
+    } else if (result->error[0]) {
+      reason = apr_pstrcat(r->pool, "Snapshot rebuild failed: ", result->error, NULL);
+    }
+    apr_table_set(r->headers_out, "X-Dart-Snapshot", apr_pstrcat(r->pool, "No; ", reason, NULL));
+    dart_snapshot_unlock();
   }
-  if (isDebug(r)) apr_table_set(r->headers_out, "X-Dart-Snapshot", "Yes");
-  return result;
+  return NULL;
+}
+
+// The VM is initialized once per process: normally by dart_snapshots in the parent, before the children fork.
+// Only the hooks (which httpd runs on a single thread) change this, so request threads can read it freely.
+static NullableBool vmInitialized = kNull;
+
+static bool dart_vm_initialize() {
+  if (vmInitialized == kNull) {
+    bool ok = Dart_SetVMFlags(0, NULL) && Dart_Initialize(IsolateCreate, IsolateInterrupt, IsolateShutdown);
+    vmInitialized = ok ? kYes : kNo;
+  }
+  return vmInitialized == kYes;
 }
 
-static bool initializeState = false;
+static bool mpm_can_suspend = false;
 static void dart_child_init(apr_pool_t *p, server_rec *s) {
-  // This is allowed to fail, we may have already initialized the VM for snapshot creation
-  initializeState |= (Dart_SetVMFlags(0, NULL) && Dart_Initialize(IsolateCreate, IsolateInterrupt, IsolateShutdown));
+  if (!dart_vm_initialize()) return;
+
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(s->module_config, &dart_module);
+  while (cfg->base) cfg = cfg->base;
+  int pool_size = cfg->isolate_pool_size;
+  if (pool_size < 0) {
+    // One isolate per worker thread, so each concurrent request can have one ready
+    int threads = 1;
+    if (ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS || threads < 1) threads = 1;
+    pool_size = threads;
+  }
+#if APR_HAS_THREADS
+  if (apr_thread_mutex_create(&isolate_pool_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) isolate_pool_mutex = NULL;
+  if (apr_thread_mutex_create(&auto_snapshot_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) auto_snapshot_mutex = NULL;
+  if (apr_thread_mutex_create(&message_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS
+      || apr_thread_cond_create(&message_posted, p) != APR_SUCCESS) {
+    message_mutex = NULL;
+    message_posted = NULL;
+  }
+#endif
+  isolate_pool = (dart_isolate**) apr_pcalloc(p, pool_size * sizeof(dart_isolate*));
+  isolate_pool_size = pool_size;
+  for (int i = 0; i < isolate_pool_size; i++) dart_pool_fill(s, i, false);
+  apr_pool_cleanup_register(p, NULL, dart_pool_destroy, apr_pool_cleanup_null);
+  DartCacheChildInit(p, s);
+
+  // Each cache gets its own pool, guarded by the cache's mutex
+  apr_pool_create(&auto_snapshot_pool, p);
+  auto_snapshots = apr_hash_make(auto_snapshot_pool);
+#ifdef AP_MPMQ_CAN_SUSPEND
+  apr_pool_create(&suspension_pool, p);
+  int can_suspend = 0;
+  mpm_can_suspend = (ap_mpm_query(AP_MPMQ_CAN_SUSPEND, &can_suspend) == APR_SUCCESS) && can_suspend;
+#endif
+  apr_pool_create(&source_cache_pool, p);
+  source_cache = apr_hash_make(source_cache_pool);
+  source_check_interval = apr_time_from_sec(cfg->source_check_interval);
+#if APR_HAS_THREADS
+  if (apr_thread_rwlock_create(&snapshot_lock, p) != APR_SUCCESS) snapshot_lock = NULL;
+  if (apr_thread_mutex_create(&source_cache_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) source_cache_mutex = NULL;
+  if (apr_thread_mutex_create(&rebuild_mutex, APR_THREAD_MUTEX_DEFAULT, p) == APR_SUCCESS
+      && apr_thread_cond_create(&rebuild_posted, p) == APR_SUCCESS
+      && apr_thread_create(&rebuilder, NULL, dart_rebuilder_run, NULL, p) == APR_SUCCESS) {
+    apr_pool_cleanup_register(p, NULL, dart_rebuilder_destroy, apr_pool_cleanup_null);
+  } else {
+    rebuilder = NULL;
+    ap_log_error(APLOG_MARK, LOG_WARNING, 0, s, "mod_dart: Couldn't start the snapshot rebuilder thread, rebuilding inline");
+  }
+  if (isolate_pool_size && isolate_pool_mutex) {
+    pool_refills = (bool*) apr_pcalloc(p, isolate_pool_size * sizeof(bool));
+    if (apr_thread_cond_create(&fill_posted, p) == APR_SUCCESS
+        && apr_thread_create(&filler, NULL, dart_filler_run, s, p) == APR_SUCCESS) {
+      apr_pool_cleanup_register(p, NULL, dart_filler_destroy, apr_pool_cleanup_null);
+    } else {
+      filler = NULL;
+      ap_log_error(APLOG_MARK, LOG_WARNING, 0, s, "mod_dart: Couldn't start the isolate filler thread, refilling the pool inline");
+    }
+  }
+  // Registered last, so the watchdog stops before the isolates are shut down
+  if (message_mutex && apr_thread_cond_create(&watchdog_wakeup, p) == APR_SUCCESS
+      && apr_thread_create(&watchdog, NULL, dart_watchdog_run, NULL, p) == APR_SUCCESS) {
+    apr_pool_cleanup_register(p, NULL, dart_watchdog_destroy, apr_pool_cleanup_null);
+  } else {
+    ap_log_error(APLOG_MARK, LOG_WARNING, 0, s, "mod_dart: Couldn't start the watchdog thread, DartTimeout won't work");
+  }
+#endif
+}
+
+// Handles the current isolate's messages, so that timers and stream listeners fire, until it has no live ports
+// or [deadline] has passed (0 to only handle messages that have already been posted).
+// Returns the error if a callback throws.
+static Dart_Handle dart_message_loop(dart_isolate *isolate, apr_time_t deadline) {
+  while (Dart_HasLivePorts()) {
+    // No Dart calls while holding message_mutex: MessageNotify may be called with the VM's own locks held
+    message_lock();
+    apr_interval_time_t remaining;
+    while (!isolate->pending_messages && (remaining = deadline - apr_time_now()) > 0) {
+#if APR_HAS_THREADS
+      if (message_posted) {
+        apr_thread_cond_timedwait(message_posted, message_mutex, remaining);
+        continue;
+      }
+#endif
+      apr_sleep(remaining < 1000 ? remaining : 1000);
+      isolate->pending_messages = 1; // nothing to wait on, so poll
+    }
+    bool posted = isolate->pending_messages > 0;
+    if (posted) isolate->pending_messages--;
+    message_unlock();
+    if (!posted) break;
+    Dart_Handle result = Dart_HandleMessage();
+    if (Dart_IsError(result)) return result;
+  }
+  return Dart_Null();
+}
+
+static bool isSuspendable(request_rec *r) {
+  dart_dir_config *cfg = (dart_dir_config*) ap_get_module_config(r->per_dir_config, &dart_module);
+  return mpm_can_suspend && cfg->suspend == kYes;
 }
 
-static int fatal(request_rec *r, const char *format, Dart_Handle error) {
+static int getTimeout(request_rec *r) {
+  dart_dir_config *cfg = (dart_dir_config*) ap_get_module_config(r->per_dir_config, &dart_module);
+  return (cfg->timeout < 0) ? 0 : cfg->timeout;
+}
+
+static int getMessageTimeout(request_rec *r) {
+  dart_dir_config *cfg = (dart_dir_config*) ap_get_module_config(r->per_dir_config, &dart_module);
+  return (cfg->message_timeout < 0) ? DART_DEFAULT_MESSAGE_TIMEOUT : cfg->message_timeout;
+}
+
+static int fatal(request_rec *r, int status, const char *format, Dart_Handle error) {
   ap_log_rerror(APLOG_MARK, LOG_WARNING, 0, r, format, Dart_GetError(error));
-  if (!isDebug(r)) return HTTP_INTERNAL_SERVER_ERROR;
+  if (!isDebug(r)) return status;
   r->content_type = "text/plain";
-  r->status = HTTP_INTERNAL_SERVER_ERROR;
+  r->status = status;
   ap_rprintf(r, format, Dart_GetError(error));
   ap_rprintf(r, "\n");
   return OK;  
 }
 
+// Fails the request after [error] from loading the script or setting up the request, as a timeout
+// if DartTimeout ran out meanwhile. The isolate is thrown away.
+static int dart_fail(request_rec *r, dart_isolate *isolate, const char *format, Dart_Handle error) {
+  isolate->recycle = true;
+  DartStatusCount(isolate->timer, kCounterErrors);
+  if (!dart_timed_out(isolate)) return fatal(r, HTTP_INTERNAL_SERVER_ERROR, format, error);
+  DartStatusCount(isolate->timer, kCounterTimeouts);
+  return fatal(r, HTTP_SERVICE_UNAVAILABLE, "Script timed out: %s", Dart_Error("Exceeded DartTimeout (%ds)", getTimeout(r)));
+}
+
+// Sends the response once the script (including its callbacks) is done, or has failed with [result].
+static int dart_finish(request_rec *r, dart_isolate *isolate, Dart_Handle result, const char *failure) {
+  dart_timer *timer = isolate->timer;
+  int status = HTTP_INTERNAL_SERVER_ERROR;
+  if ((Dart_IsError(result) || Dart_HasLivePorts()) && dart_timed_out(isolate)) {
+    // Interrupted by the watchdog, or still waiting for messages at the deadline
+    DartStatusCount(timer, kCounterTimeouts);
+    result = Dart_Error("Exceeded DartTimeout (%ds)", getTimeout(r));
+    failure = "Script timed out: %s";
+    status = HTTP_SERVICE_UNAVAILABLE;
+  }
+  if (!Dart_IsError(result) && Dart_HasLivePorts()) {
+    // Don't let this request's callbacks run during a later one
+    isolate->recycle = true;
+    int timeout = getMessageTimeout(r);
+    if (timeout) ap_log_rerror(APLOG_MARK, LOG_WARNING, 0, r, "Ports still open after DartMessageTimeout (%ds)", timeout);
+  }
+  DartStatusPhase(timer, kPhaseMessages);
+  apr_status_t rv = ApacheLibraryFinish(r, !Dart_IsError(result));
+  DartStatusPhase(timer, kPhaseOutput);
+  if (Dart_IsError(result)) {
+    isolate->recycle = true;
+    DartStatusCount(timer, kCounterErrors);
+    return fatal(r, status, failure, result);
+  }
+  if (rv != APR_SUCCESS) {
+    DartStatusCount(timer, kCounterErrors);
+    ap_log_rerror(APLOG_MARK, LOG_WARNING, rv, r, "Failed to pass output");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  return OK;
+}
+
+#ifdef AP_MPMQ_CAN_SUSPEND
+// DartSuspend: rather than blocking a worker thread in dart_message_loop, the handler returns SUSPENDED with
+// the isolate exited (but still checked out, with its scope open). The MPM runs dart_resume on some worker
+// thread when a message is posted to the isolate, or when the deadline passes.
+static void dart_resume(void *baton);
+
+// Asks the MPM to resume [suspension] as soon as possible. Called with message_mutex held.
+static void dart_wakeup(dart_suspension *suspension) {
+  if (suspension->wakeup) return;
+  suspension->wakeup = true;
+  suspension->callbacks++;
+  ap_mpm_register_timed_callback(0, dart_resume, suspension);
+}
+
+// Suspends r until its isolate gets a message or [deadline] passes, and returns true. Messages that are already
+// pending are handled first, here: nothing may resume r before the handler has returned SUSPENDED.
+// Returns false, with the isolate still entered and [result] set, if the isolate is done or a callback threw.
+static bool dart_suspend(request_rec *r, dart_isolate *isolate, apr_time_t deadline, Dart_Handle *result) {
+  for (;;) {
+    *result = dart_message_loop(isolate, 0);
+    if (Dart_IsError(*result) || !Dart_HasLivePorts() || apr_time_now() >= deadline) return false;
+    Dart_ExitIsolate(); // before any other thread can resume it
+    message_lock();
+    if (!isolate->pending_messages) break; // still locked, so MessageNotify sees the suspension
+    message_unlock();
+    Dart_EnterIsolate(isolate->isolate);
+  }
+  dart_suspension *suspension = free_suspensions;
+  if (suspension) {
+    free_suspensions = suspension->next_free;
+  } else {
+    suspension = (dart_suspension*) apr_palloc(suspension_pool, sizeof(dart_suspension));
+  }
+  memset(suspension, 0, sizeof(dart_suspension));
+  suspension->r = r;
+  suspension->isolate = isolate;
+  suspension->deadline = deadline;
+  isolate->suspension = suspension;
+  suspension->callbacks++;
+  ap_mpm_register_timed_callback(deadline - apr_time_now(), dart_resume, suspension);
+  message_unlock();
+  return true;
+}
+
+static void dart_resume(void *baton) {
+  dart_suspension *suspension = (dart_suspension*) baton;
+  message_lock();
+  suspension->callbacks--;
+  suspension->wakeup = false;
+  request_rec *r = suspension->r;
+  dart_isolate *isolate = suspension->isolate;
+  apr_time_t deadline = suspension->deadline;
+  if (r && (isolate->pending_messages || apr_time_now() >= deadline)) {
+    suspension->r = NULL;
+    isolate->suspension = NULL;
+  } else {
+    r = NULL; // already resumed, or there's still nothing to do
+  }
+  if (!suspension->r && !suspension->callbacks) {
+    suspension->next_free = free_suspensions;
+    free_suspensions = suspension;
+  }
+  message_unlock();
+  if (!r) return;
+
+  Dart_EnterIsolate(isolate->isolate);
+  Dart_Handle result;
+  if (dart_suspend(r, isolate, deadline, &result)) return;
+  int status = dart_finish(r, isolate, result, "Uncaught exception in callback: %s");
+  apr_pool_cleanup_run(r->pool, isolate, dart_isolate_checkin);
+  if (status == OK) {
+    ap_finalize_request_protocol(r);
+  } else {
+    ap_die(status, r);
+  }
+  conn_rec *c = r->connection;
+  ap_process_request_after_handler(r);
+  ap_mpm_resume_suspended(c);
+}
+#endif
+
 static int dart_handler(request_rec *r) {
   if (strcmp(r->handler, "dart")) {
     return DECLINED;
   }
-  if (!initializeState) {
+  if (vmInitialized != kYes) {
     ap_log_rerror(APLOG_MARK, LOG_WARNING, 0, r, "Failed to initialize dart VM at startup");
     return HTTP_INTERNAL_SERVER_ERROR;
   }
-  if (!dart_isolate_create(r)) return HTTP_INTERNAL_SERVER_ERROR;
-  apr_pool_cleanup_register(r->pool, NULL, dart_isolate_destroy, apr_pool_cleanup_null);
-  dart_snapshot *snapshot = getScriptSnapshot(r);
+  // Before DartStatusStart, so requests for missing scripts don't take up dart-status slots
+  if (r->finfo.filetype != APR_REG) return HTTP_NOT_FOUND;
+  dart_timer *timer = DartStatusStart(r);
+  // A cached response (apache:cache) needs neither the script nor an isolate
+  if (DartCacheServe(r) == OK) {
+    DartStatusCount(timer, kCounterCacheHit);
+    DartStatusFinish(timer);
+    return OK;
+  }
+  // Look up the snapshot before entering an isolate: DartAutoSnapshot may need to create one
+  dart_snapshot *snapshot = getScriptSnapshot(r, timer);
+  DartStatusPhase(timer, kPhaseSnapshot);
+  dart_isolate *isolate = dart_isolate_checkout(r, snapshot, isDebug(r));
+  if (!isolate) {
+    DartStatusCount(timer, kCounterErrors);
+    DartStatusFinish(timer);
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+  isolate->timer = timer;
+  dart_set_deadline(isolate, getTimeout(r));
+  apr_pool_cleanup_register(r->pool, isolate, dart_isolate_checkin, apr_pool_cleanup_null);
+  DartStatusPhase(timer, kPhaseIsolate);
+  dart_request_config request_config;
+  getRequestConfig(r, &request_config);
+  Dart_Handle result = ApacheLibraryInit(r, &request_config);
+  if (Dart_IsError(result)) return dart_fail(r, isolate, "Failed to initialize Apache library: %s", result);
+
   Dart_Handle library;
-  if (snapshot) {
-    library = Dart_LoadScriptFromSnapshot(snapshot->buffer);
+  if (isolate->script) {
+    DartStatusCount(timer, kCounterIsolateReused);
+    library = isolate->library;
   } else {
-    Dart_Handle script = LoadFile(r->filename, NULL);
-    if (Dart_IsNull(script)) return HTTP_NOT_FOUND;
-    library = Dart_IsError(script) ? script : Dart_LoadScript(Dart_NewString(r->filename), script);
+    if (snapshot) {
+      dart_snapshot_lock(false);
+      library = Dart_LoadScriptFromSnapshot(snapshot->buffer);
+      isolate->snapshot = snapshot;
+      isolate->snapshot_mtime = snapshot->mtime;
+      isolate->snapshot_changes = snapshot->built_changes;
+      dart_snapshot_unlock();
+    } else {
+      time_t mtime = apr_time_sec(r->finfo.mtime); // so a source cached before the script changed isn't used
+      Dart_Handle script = LoadFile(r->filename, &mtime);
+      if (Dart_IsNull(script)) return HTTP_NOT_FOUND; // removed since the request was mapped, dart_isolate_checkin finishes the timer
+      // A pooled isolate may be reused, as long as the files the script imports are unchanged (see dart_isolate_checkout)
+      if (isolate->slot >= 0) {
+        if (apr_pool_create_unmanaged_ex(&(isolate->libraries_pool), NULL, NULL) == APR_SUCCESS) {
+          isolate->libraries = apr_array_make(isolate->libraries_pool, 4, sizeof(dart_snapshot_source));
+        } else {
+          isolate->recycle = true;
+        }
+      }
+      snapshot_libraries = isolate->libraries;
+      library = Dart_IsError(script) ? script : Dart_LoadScript(Dart_NewString(r->filename), script);
+      snapshot_libraries = NULL;
+    }
+    if (!Dart_IsError(library)) {
+      library = isolate->library = Dart_NewPersistentHandle(library);
+    }
+    if (!Dart_IsError(library)) {
+      isolate->script = strdup(r->filename);
+      isolate->mtime = r->finfo.mtime;
+    }
   }
-  if (Dart_IsError(library)) return fatal(r, "Failed to load script: %s", library);
-  Dart_Handle result = Dart_Invoke(library, Dart_NewString("main"), 0, NULL);
-  if (Dart_IsError(result)) return fatal(r, "Failed to execute main(): %s", result);
-  return OK;
+  if (Dart_IsError(library)) return dart_fail(r, isolate, "Failed to load script: %s", library);
+  DartStatusPhase(timer, kPhaseLoad);
+  result = Dart_Invoke(library, Dart_NewString("main"), 0, NULL);
+  DartStatusPhase(timer, kPhaseMain);
+  if (!Dart_IsError(result) && getMessageTimeout(r)) {
+    apr_time_t deadline = apr_time_now() + apr_time_from_sec(getMessageTimeout(r));
+    if (getTimeout(r)) {
+      message_lock();
+      if (isolate->deadline < deadline) deadline = isolate->deadline;
+      message_unlock();
+    }
+    bool suspend = isSuspendable(r);
+    result = dart_message_loop(isolate, suspend ? 0 : deadline);
+#ifdef AP_MPMQ_CAN_SUSPEND
+    if (suspend && !Dart_IsError(result) && Dart_HasLivePorts() && apr_time_now() < deadline) {
+      if (dart_suspend(r, isolate, deadline, &result)) return SUSPENDED;
+    }
+#endif
+    return dart_finish(r, isolate, result, "Uncaught exception in callback: %s");
+  }
+  return dart_finish(r, isolate, result, "Failed to execute main(): %s");
 }
 
 Dart_Handle create_master_snapshot(apr_pool_t *pool, dart_snapshot *target, const char* name) {
@@ -297,19 +1764,35 @@ Dart_Handle create_master_snapshot(apr_pool_t *pool, dart_snapshot *target, cons
   target->buffer = (uint8_t*) apr_pcalloc(pool, size); // This lives forever
   if (!target->buffer) return Dart_Error("Failed to allocate %ld bytes for master snapshot", size);
   memmove(target->buffer, buffer, size);
+  target->size = size;
   target->mtime = 0;
-  fprintf(stderr, "mod_dart: Created master snapshot: %ld bytes\n", size);
+  ap_log_perror(APLOG_MARK, LOG_DEBUG, 0, pool, "mod_dart: Created master snapshot: %ld bytes", (long) size);
   return Dart_Null();
 }
 
 Dart_Handle create_script_snapshot(apr_pool_t *pool, dart_snapshot *target, const char *name) {
   Dart_SetLibraryTagHandler(ScriptSnapshotLibraryTagHandler);
-  struct stat status;
-  Dart_Handle result = LoadFile(name, &status);
+  time_t mtime = target->mtime; // the version wanted, if the caller knows it
+  Dart_Handle result = LoadFile(name, &mtime);
   if (Dart_IsNull(result)) return Dart_Error("Script not found: %s", name);
   if (Dart_IsError(result)) return result;
+  target->libraries = apr_array_make(pool, 4, sizeof(dart_snapshot_source));
+  snapshot_libraries = target->libraries;
   result = Dart_LoadScript(Dart_NewString(name), result);
+  snapshot_libraries = NULL;
   if (Dart_IsError(result)) return result;
+  Dart_Handle warmup = snapshot_warmup ? Dart_LookupFunction(result, Dart_NewString(snapshot_warmup)) : Dart_Null();
+  if (Dart_IsError(warmup)) return warmup;
+  if (snapshot_warmup && Dart_IsNull(warmup)) {
+    ap_log_error(APLOG_MARK, LOG_INFO, 0, snapshot_warmup_server,
+                 "mod_dart: No DartSnapshotWarmup function %s() in %s, snapshotting it without a warm-up", snapshot_warmup, name);
+  }
+  if (!Dart_IsNull(warmup)) {
+    dart_request_config config = { DART_DEFAULT_OUTPUT_BUFFER_SIZE, DART_DEFAULT_INPUT_CHUNK_SIZE,
+                                   DART_DEFAULT_FORM_MAX_SIZE, DART_DEFAULT_FORM_MAX_FIELDS };
+    result = ApacheLibraryWarmup(snapshot_warmup_server, result, snapshot_warmup, name, &config);
+    if (Dart_IsError(result)) return result;
+  }
   uint8_t *buffer;
   intptr_t size;
   result = Dart_CreateScriptSnapshot(&buffer, &size);
@@ -317,12 +1800,13 @@ Dart_Handle create_script_snapshot(apr_pool_t *pool, dart_snapshot *target, cons
   target->buffer = (uint8_t*) apr_pcalloc(pool, size); // This lives forever
   if (!target->buffer) return Dart_Error("Failed to allocate %ld bytes for snapshot of %s", size, name);
   memmove(target->buffer, buffer, size);
-  target->mtime = status.st_mtime;
-  fprintf(stderr, "mod_dart: Created snapshot of %s: %ld bytes\n", name, size);
+  target->size = size;
+  target->mtime = mtime;
+  ap_log_perror(APLOG_MARK, LOG_DEBUG, 0, pool, "mod_dart: Created snapshot of %s: %ld bytes", name, (long) size);
   return Dart_Null();
 }
 
-bool create_snapshot(apr_pool_t *pool, dart_snapshot* target, const char* name, uint8_t *base_snapshot, Dart_Handle (*creator)(apr_pool_t *pool, dart_snapshot *target, const char* name), char **error) {
+bool create_snapshot(apr_pool_t *pool, dart_snapshot* target, const char* name, uint8_t *base_snapshot, dart_snapshot_creator creator, char **error) {
   *error = NULL;
   Dart_Isolate isolate = Dart_CreateIsolate(name, "main", base_snapshot, NULL, error);
   if (!isolate) return false;
@@ -334,6 +1818,166 @@ bool create_snapshot(apr_pool_t *pool, dart_snapshot* target, const char* name,
   return *error == NULL;
 }
 
+// Layout of a file in DartSnapshotCacheDir: this header, the cache key, padding, then the snapshot.
+// The key is followed by a line for each library the script loaded: its mtime, a space and its path.
+#define DART_SNAPSHOT_MAGIC "MODDART2"
+typedef struct dart_snapshot_file_header {
+  char magic[8];
+  apr_uint32_t key_length;
+  apr_uint32_t data_offset;
+  apr_uint64_t data_length;
+} dart_snapshot_file_header;
+
+// Whether the libraries listed after the key (from [libraries] to [end]) are unchanged. Adds them to target->libraries.
+static bool cached_libraries_current(apr_pool_t *pool, const char *libraries, const char *end, dart_snapshot *target) {
+  target->libraries = apr_array_make(pool, 4, sizeof(dart_snapshot_source));
+  while (libraries < end) {
+    const char *line_end = (const char*) memchr(libraries, '\n', end - libraries);
+    const char *space = line_end ? (const char*) memchr(libraries, ' ', line_end - libraries) : NULL;
+    if (!space) return false;
+    dart_snapshot_source *source = (dart_snapshot_source*) apr_array_push(target->libraries);
+    source->mtime = (time_t) apr_atoi64(apr_pstrndup(pool, libraries, space - libraries));
+    source->path = apr_pstrndup(pool, space + 1, line_end - space - 1);
+    struct stat status;
+    if (stat(source->path, &status) || status.st_mtime != source->mtime) return false;
+    libraries = line_end + 1;
+  }
+  return true;
+}
+
+// Maps a cached snapshot read-only, so all children share the same pages. The mapping lives as long as [pool].
+static bool read_cached_snapshot(apr_pool_t *pool, const char *path, const char *key, dart_snapshot *target) {
+  apr_file_t *file;
+  if (apr_file_open(&file, path, APR_READ | APR_BINARY, APR_OS_DEFAULT, pool) != APR_SUCCESS) return false;
+  apr_finfo_t finfo;
+  apr_mmap_t *mm = NULL;
+  bool mapped = apr_file_info_get(&finfo, APR_FINFO_SIZE, file) == APR_SUCCESS
+    && finfo.size > (apr_off_t) sizeof(dart_snapshot_file_header)
+    && apr_mmap_create(&mm, file, 0, finfo.size, APR_MMAP_READ, pool) == APR_SUCCESS;
+  apr_file_close(file);
+  if (!mapped) return false;
+
+  const dart_snapshot_file_header *header = (const dart_snapshot_file_header*) mm->mm;
+  apr_size_t key_length = strlen(key);
+  if (memcmp(header->magic, DART_SNAPSHOT_MAGIC, sizeof(header->magic))
+      || header->data_offset + header->data_length != (apr_uint64_t) finfo.size
+      || header->key_length <= key_length
+      || sizeof(dart_snapshot_file_header) + header->key_length > header->data_offset
+      || memcmp(header + 1, key, key_length)
+      || ((const char*) (header + 1))[key_length] != '\n'
+      || !cached_libraries_current(pool, (const char*) (header + 1) + key_length + 1, (const char*) (header + 1) + header->key_length, target)) {
+    target->libraries = NULL;
+    apr_mmap_delete(mm);
+    return false;
+  }
+  target->buffer = (uint8_t*) mm->mm + header->data_offset;
+  target->size = header->data_length;
+  return true;
+}
+
+// Writes to a temporary file and renames it into place, so readers never see a partial snapshot.
+static void write_cached_snapshot(apr_pool_t *pool, const char *path, const char *key, dart_snapshot *snapshot) {
+  static const char padding[16] = {0};
+  key = apr_pstrcat(pool, key, "\n", NULL);
+  for (int i = 0; snapshot->libraries && i < snapshot->libraries->nelts; i++) {
+    dart_snapshot_source *source = &(((dart_snapshot_source*) snapshot->libraries->elts)[i]);
+    key = apr_psprintf(pool, "%s%ld %s\n", key, (long) source->mtime, source->path);
+  }
+  dart_snapshot_file_header header;
+  memcpy(header.magic, DART_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.key_length = strlen(key);
+  header.data_offset = APR_ALIGN(sizeof(header) + header.key_length, sizeof(padding));
+  header.data_length = snapshot->size;
+
+  char *tmp = apr_pstrcat(pool, path, ".XXXXXX", NULL);
+  apr_file_t *file;
+  apr_size_t written;
+  apr_status_t rv = apr_file_mktemp(&file, tmp, APR_CREATE | APR_WRITE | APR_EXCL | APR_BINARY, pool);
+  if (rv != APR_SUCCESS) {
+    ap_log_perror(APLOG_MARK, LOG_WARNING, rv, pool, "mod_dart: Couldn't create %s", tmp);
+    return;
+  }
+  rv = apr_file_write_full(file, &header, sizeof(header), &written);
+  if (rv == APR_SUCCESS) rv = apr_file_write_full(file, key, header.key_length, &written);
+  if (rv == APR_SUCCESS) rv = apr_file_write_full(file, padding, header.data_offset - sizeof(header) - header.key_length, &written);
+  if (rv == APR_SUCCESS) rv = apr_file_write_full(file, snapshot->buffer, snapshot->size, &written);
+  apr_status_t close_rv = apr_file_close(file);
+  if (rv == APR_SUCCESS) rv = close_rv;
+  // mktemp creates the file private, but children may run as a different user to the parent
+  if (rv == APR_SUCCESS) rv = apr_file_perms_set(tmp, APR_FPROT_UREAD | APR_FPROT_UWRITE | APR_FPROT_GREAD | APR_FPROT_WREAD);
+  if (rv == APR_SUCCESS) rv = apr_file_rename(tmp, path, pool);
+  if (rv != APR_SUCCESS) {
+    ap_log_perror(APLOG_MARK, LOG_WARNING, rv, pool, "mod_dart: Couldn't write snapshot cache %s", path);
+    apr_file_remove(tmp, pool);
+  }
+}
+
+// Like create_snapshot, but first looks in DartSnapshotCacheDir, and saves new snapshots there.
+// Cached snapshots are keyed by script path, script mtime and build (see ApacheLibraryBuildId), and are only used
+// while the libraries the script loaded have the same mtimes as when it was snapshotted.
+bool load_snapshot(dart_server_config *cfg, apr_pool_t *pool, dart_snapshot* target, const char* name, uint8_t *base_snapshot, dart_snapshot_creator creator, char **error) {
+  if (!cfg->snapshot_cache_dir) return create_snapshot(pool, target, name, base_snapshot, creator, error);
+  time_t mtime = 0;
+  if (creator != create_master_snapshot) {
+    struct stat status;
+    if (stat(name, &status)) return create_snapshot(pool, target, name, base_snapshot, creator, error);
+    mtime = status.st_mtime;
+  }
+  const char *warmup = (creator == create_script_snapshot && snapshot_warmup) ? snapshot_warmup : "";
+  const char *key = apr_psprintf(pool, "%s|%ld|%s|%s", name, (long) mtime, snapshot_build_id, warmup);
+  const char *path = apr_pstrcat(pool, cfg->snapshot_cache_dir, "/", ap_md5(pool, (const unsigned char*) key), ".snapshot", NULL);
+  if (read_cached_snapshot(pool, path, key, target)) {
+    *error = NULL;
+    target->mtime = mtime;
+    ap_log_perror(APLOG_MARK, LOG_DEBUG, 0, pool, "mod_dart: Mapped snapshot of %s from %s: %ld bytes", name, path, (long) target->size);
+    return true;
+  }
+  if (!create_snapshot(pool, target, name, base_snapshot, creator, error)) return false;
+  if (target->mtime == mtime) write_cached_snapshot(pool, path, key, target); // else the script changed meanwhile
+  return true;
+}
+
+// The DartSnapshots created at startup, shared by DartSnapshotThreads threads.
+typedef struct dart_snapshot_batch {
+  server_rec *server;
+  dart_server_config *cfg;
+  dart_snapshot **snapshots;
+  int count;
+  volatile apr_uint32_t next; // index of the next snapshot to create
+} dart_snapshot_batch;
+
+typedef struct dart_snapshot_worker {
+  dart_snapshot_batch *batch;
+  apr_pool_t *pool; // for this thread's snapshots alone, as pools aren't thread safe
+} dart_snapshot_worker;
+
+static void dart_snapshot_build(dart_snapshot_worker *worker) {
+  dart_snapshot_batch *batch = worker->batch;
+  for (;;) {
+    apr_uint32_t next = apr_atomic_inc32(&(batch->next));
+    if (next >= (apr_uint32_t) batch->count) return;
+    dart_snapshot *snapshot = batch->snapshots[next];
+    char *error;
+    apr_time_t start = apr_time_now();
+    if (load_snapshot(batch->cfg, worker->pool, snapshot, snapshot->filename, batch->cfg->master_snapshot.buffer, create_script_snapshot, &error)) {
+      ap_log_error(APLOG_MARK, LOG_NOTICE, 0, batch->server, "mod_dart: Snapshot of %s: %ld bytes in %ldms",
+                   snapshot->filename, (long) snapshot->size, (long) apr_time_as_msec(apr_time_now() - start));
+    } else {
+      ap_log_error(APLOG_MARK, LOG_WARNING, 0, batch->server, "mod_dart: Script snapshot failed for %s: %s", snapshot->filename, error);
+      snapshot->buffer = NULL;
+      snapshot->mtime = 0;
+    }
+  }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC dart_snapshot_build_thread(apr_thread_t *thread, void *data) {
+  dart_snapshot_build((dart_snapshot_worker*) data);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+#endif
+
 int dart_snapshots(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *server) {
   // Modules are loaded twice, only actually create the snapshot on second load
   void *data = NULL;
@@ -345,32 +1989,86 @@ int dart_snapshots(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, serve
   // Only create snapshots in the root server
   dart_server_config *cfg = (dart_server_config*) ap_get_module_config(server->module_config, &dart_module);
   if (cfg->base) return OK;
-  initializeState = Dart_SetVMFlags(0, NULL) && Dart_Initialize(IsolateCreate, IsolateInterrupt, IsolateShutdown);
+  if (!dart_vm_initialize()) {
+    ap_log_error(APLOG_MARK, LOG_ERR, 0, server, "mod_dart: Failed to initialize the Dart VM");
+    return 1;
+  }
 
+  // Before the snapshots, so that warm-up functions can fill apache:shared
+  DartCacheCreate(pconf, server, cfg->cache_size);
+  snapshot_warmup = cfg->snapshot_warmup;
+  snapshot_warmup_server = server;
+  snapshot_build_id = ApacheLibraryBuildId(server->process->pool);
   char* error;
-  if (!create_snapshot(server->process->pool, &(cfg->master_snapshot), "master", NULL, create_master_snapshot, &error)) {
+  if (!load_snapshot(cfg, server->process->pool, &(cfg->master_snapshot), "master", NULL, create_master_snapshot, &error)) {
     ap_log_error(APLOG_MARK, LOG_ERR, 0, server, "mod_dart: Master snapshot failed: %s", error);
     return 1;
   }
-  dart_snapshot *val;
-  const void *key;
+
+  dart_snapshot_batch batch;
+  batch.server = server;
+  batch.cfg = cfg;
+  batch.count = apr_hash_count(cfg->snapshots);
+  batch.snapshots = (dart_snapshot**) apr_pcalloc(ptemp, (batch.count + 1) * sizeof(dart_snapshot*));
+  batch.next = 0;
+  int i = 0;
   for (apr_hash_index_t *p = apr_hash_first(ptemp, cfg->snapshots); p; p = apr_hash_next(p)) {
-    apr_hash_this(p, &key, NULL, (void**) &val);
+    apr_hash_this(p, NULL, NULL, (void**) &(batch.snapshots[i++]));
+  }
+  int threads = (cfg->snapshot_threads < batch.count) ? cfg->snapshot_threads : batch.count;
+  if (threads < 1) threads = 1;
+  apr_time_t start = apr_time_now();
+  dart_snapshot_worker *workers = (dart_snapshot_worker*) apr_pcalloc(ptemp, threads * sizeof(dart_snapshot_worker));
+  for (i = 0; i < threads; i++) {
+    workers[i].batch = &batch;
     // TODO use pconf instead of server->process->pool?
-    if (!create_snapshot(server->process->pool, val, (const char*) key, cfg->master_snapshot.buffer, create_script_snapshot, &error)) {
-      ap_log_error(APLOG_MARK, LOG_WARNING, 0, server, "mod_dart: Script snapshot failed for %s: %s", (const char*) key, error);
-      val->buffer = NULL;
-      val->mtime = 0;
+    if (threads == 1) {
+      workers[i].pool = server->process->pool;
+    } else {
+      apr_pool_create(&(workers[i].pool), server->process->pool);
+    }
+  }
+#if APR_HAS_THREADS
+  apr_thread_t **running = (apr_thread_t**) apr_pcalloc(ptemp, threads * sizeof(apr_thread_t*));
+  for (i = 1; i < threads; i++) {
+    apr_status_t rv = apr_thread_create(&(running[i]), NULL, dart_snapshot_build_thread, &(workers[i]), ptemp);
+    if (rv != APR_SUCCESS) {
+      ap_log_error(APLOG_MARK, LOG_WARNING, rv, server, "mod_dart: Couldn't start a snapshot thread");
+      running[i] = NULL;
+    }
+  }
+  dart_snapshot_build(&(workers[0]));
+  for (i = 1; i < threads; i++) {
+    apr_status_t thread_rv;
+    if (running[i]) apr_thread_join(&thread_rv, running[i]);
+  }
+#else
+  dart_snapshot_build(&(workers[0]));
+  threads = 1;
+#endif
+  if (batch.count) {
+    apr_int64_t bytes = 0;
+    int built = 0;
+    for (i = 0; i < batch.count; i++) {
+      if (!batch.snapshots[i]->buffer) continue;
+      built++;
+      bytes += batch.snapshots[i]->size;
     }
+    ap_log_error(APLOG_MARK, LOG_NOTICE, 0, server, "mod_dart: %d of %d script snapshots ready in %.2fs using %d threads, %" APR_INT64_T_FMT " bytes",
+                 built, batch.count, (double) (apr_time_now() - start) / APR_USEC_PER_SEC, threads, bytes);
   }
+  // Once the snapshots know which libraries they were built from
+  dart_snapshot_watch_start(pconf, server, cfg);
 
   return OK;
 }
 
 static void dart_register_hooks(apr_pool_t *p) {
   ap_hook_handler(dart_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_handler(DartStatusHandler, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_child_init(dart_child_init, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_post_config(dart_snapshots, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_post_config(DartStatusPostConfig, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 static const char *dart_set_debug(cmd_parms *cmd, void *cfg_, const char *arg) {
@@ -379,21 +2077,216 @@ static const char *dart_set_debug(cmd_parms *cmd, void *cfg_, const char *arg) {
   return NULL;
 }
 
-static const char *dart_set_snapshot(cmd_parms *cmd, void *cfg_, const char *arg, const char *arg2) {
+static const char *dart_set_auto_snapshot(cmd_parms *cmd, void *cfg_, const char *arg) {
+  dart_dir_config *cfg = (dart_dir_config*) cfg_;
+  cfg->auto_snapshot = strcasecmp("on", arg) ? kNo : kYes;
+  return NULL;
+}
+
+static const char *dart_set_auto_snapshot_limit(cmd_parms *cmd, void *cfg_, const char *arg) {
+  const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (err) return err;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
+  cfg->auto_snapshot_limit = atoi(arg);
+  return NULL;
+}
+
+static const char *dart_set_suspend(cmd_parms *cmd, void *cfg_, const char *arg) {
+  dart_dir_config *cfg = (dart_dir_config*) cfg_;
+  cfg->suspend = strcasecmp("on", arg) ? kNo : kYes;
+  return NULL;
+}
+
+static const char *dart_set_output_buffer_size(cmd_parms *cmd, void *cfg_, const char *arg) {
+  dart_dir_config *cfg = (dart_dir_config*) cfg_;
+  cfg->output_buffer_size = apr_atoi64(arg);
+  if (cfg->output_buffer_size < 0) return "DartOutputBufferSize must be zero or positive";
+  return NULL;
+}
+
+static const char *dart_set_input_chunk_size(cmd_parms *cmd, void *cfg_, const char *arg) {
+  dart_dir_config *cfg = (dart_dir_config*) cfg_;
+  cfg->input_chunk_size = apr_atoi64(arg);
+  if (cfg->input_chunk_size <= 0) return "DartInputChunkSize must be positive";
+  return NULL;
+}
+
+static const char *dart_set_form_max_size(cmd_parms *cmd, void *cfg_, const char *arg) {
+  dart_dir_config *cfg = (dart_dir_config*) cfg_;
+  cfg->form_max_size = apr_atoi64(arg);
+  if (cfg->form_max_size < 0) return "DartFormMaxSize must be zero or positive";
+  return NULL;
+}
+
+static const char *dart_set_form_max_fields(cmd_parms *cmd, void *cfg_, const char *arg) {
+  dart_dir_config *cfg = (dart_dir_config*) cfg_;
+  cfg->form_max_fields = atoi(arg);
+  if (cfg->form_max_fields < 0) return "DartFormMaxFields must be zero or positive";
+  return NULL;
+}
+
+static const char *dart_set_message_timeout(cmd_parms *cmd, void *cfg_, const char *arg) {
+  dart_dir_config *cfg = (dart_dir_config*) cfg_;
+  cfg->message_timeout = atoi(arg);
+  if (cfg->message_timeout < 0) return "DartMessageTimeout must be zero or positive";
+  return NULL;
+}
+
+static const char *dart_set_timeout(cmd_parms *cmd, void *cfg_, const char *arg) {
+  dart_dir_config *cfg = (dart_dir_config*) cfg_;
+  cfg->timeout = atoi(arg);
+  if (cfg->timeout < 0) return "DartTimeout must be zero or positive";
+  return NULL;
+}
+
+static void add_snapshot(cmd_parms *cmd, const char *filename, bool validate) {
   dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
   while (cfg->base) cfg = cfg->base;
   dart_snapshot *snapshot = (dart_snapshot *) apr_pcalloc(apr_hash_pool_get(cfg->snapshots), sizeof(dart_snapshot));
+  snapshot->filename = filename;
   snapshot->buffer = NULL;
   snapshot->mtime = 0;
-  snapshot->validate = (bool) cmd->info;
-  apr_hash_set(cfg->snapshots, arg, APR_HASH_KEY_STRING, (void*) snapshot);
+  snapshot->validate = validate;
+  apr_hash_set(cfg->snapshots, filename, APR_HASH_KEY_STRING, (void*) snapshot);
+}
+
+static const char *dart_set_snapshot(cmd_parms *cmd, void *cfg_, const char *arg) {
+  add_snapshot(cmd, arg, (bool) cmd->info);
+  return NULL;
+}
+
+// Adds a DartSnapshot for each .dart file in [dir], and in its subdirectories if [recursive].
+// Symbolic links are followed, [depth] stops a link cycle from recursing forever.
+static const char *add_snapshot_directory(cmd_parms *cmd, const char *dir, bool recursive, int depth) {
+  if (depth > DART_SNAPSHOT_DIRECTORY_DEPTH) {
+    return apr_psprintf(cmd->pool, "DartSnapshotDirectory %s is nested too deeply, is there a symbolic link cycle?", dir);
+  }
+  apr_dir_t *handle;
+  apr_status_t rv = apr_dir_open(&handle, dir, cmd->temp_pool);
+  if (rv != APR_SUCCESS) {
+    char buffer[256];
+    return apr_psprintf(cmd->pool, "DartSnapshotDirectory couldn't open %s: %s", dir, apr_strerror(rv, buffer, sizeof(buffer)));
+  }
+  apr_finfo_t finfo;
+  const char *error = NULL;
+  while (!error) {
+    rv = apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE, handle);
+    if (rv != APR_SUCCESS && rv != APR_INCOMPLETE) break;
+    if (finfo.name[0] == '.') continue; // also skips . and ..
+    const char *name = finfo.name; // kept, apr_stat below may not
+    const char *path = apr_pstrcat(cmd->pool, dir, "/", name, NULL);
+    size_t length = strlen(name);
+    if (finfo.filetype == APR_LNK || finfo.filetype == APR_UNKFILE || finfo.filetype == APR_NOFILE) {
+      // apr_dir_read doesn't follow links, and some filesystems don't report the type at all
+      if (apr_stat(&finfo, path, APR_FINFO_TYPE, cmd->temp_pool) != APR_SUCCESS) continue;
+    }
+    if (finfo.filetype == APR_DIR && recursive) {
+      error = add_snapshot_directory(cmd, path, recursive, depth + 1);
+    } else if (finfo.filetype == APR_REG && length > 5 && !strcmp(name + length - 5, ".dart")) {
+      add_snapshot(cmd, path, true);
+    }
+  }
+  apr_dir_close(handle);
+  return error;
+}
+
+static const char *dart_set_snapshot_directory(cmd_parms *cmd, void *cfg_, const char *arg, const char *arg2) {
+  if (arg2 && strcasecmp(arg2, "recursive")) return "DartSnapshotDirectory's second argument must be 'recursive'";
+  char *dir = ap_server_root_relative(cmd->pool, arg);
+  apr_size_t length = strlen(dir);
+  while (length > 1 && dir[length - 1] == '/') dir[--length] = 0;
+  return add_snapshot_directory(cmd, dir, arg2 != NULL, 0);
+}
+
+static const char *dart_set_snapshot_threads(cmd_parms *cmd, void *cfg_, const char *arg) {
+  const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (err) return err;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
+  cfg->snapshot_threads = atoi(arg);
+  if (cfg->snapshot_threads < 1) return "DartSnapshotThreads must be positive";
+  return NULL;
+}
+
+static const char *dart_set_snapshot_watch(cmd_parms *cmd, void *cfg_, const char *arg) {
+  const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (err) return err;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
+  cfg->snapshot_watch = strcasecmp("on", arg) ? kNo : kYes;
+  return NULL;
+}
+
+static const char *dart_set_snapshot_cache_dir(cmd_parms *cmd, void *cfg_, const char *arg) {
+  const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (err) return err;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
+  cfg->snapshot_cache_dir = ap_server_root_relative(cmd->pool, arg);
+  if (!cfg->snapshot_cache_dir) return apr_pstrcat(cmd->pool, "Invalid DartSnapshotCacheDir ", arg, NULL);
+  return NULL;
+}
+
+static const char *dart_set_snapshot_warmup(cmd_parms *cmd, void *cfg_, const char *arg) {
+  const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (err) return err;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
+  cfg->snapshot_warmup = strcasecmp(arg, "off") ? arg : NULL;
+  return NULL;
+}
+
+static const char *dart_set_source_check_interval(cmd_parms *cmd, void *cfg_, const char *arg) {
+  const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (err) return err;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
+  cfg->source_check_interval = atoi(arg);
+  if (cfg->source_check_interval < 0) return "DartSourceCheckInterval must be zero or positive";
+  return NULL;
+}
+
+static const char *dart_set_cache_size(cmd_parms *cmd, void *cfg_, const char *arg) {
+  const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (err) return err;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
+  apr_int64_t value = apr_atoi64(arg);
+  if (value < 0) return "DartCacheSize must be zero or positive";
+  cfg->cache_size = (apr_size_t) value;
+  return NULL;
+}
+
+static const char *dart_set_isolate_pool_size(cmd_parms *cmd, void *cfg_, const char *arg) {
+  const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+  if (err) return err;
+  dart_server_config *cfg = (dart_server_config*) ap_get_module_config(cmd->server->module_config, &dart_module);
+  int value = atoi(arg);
+  if (value < 0) return apr_psprintf(cmd->pool, "%s must be zero or positive", cmd->cmd->name);
+  if (cmd->info) {
+    cfg->isolate_max_requests = value;
+  } else {
+    cfg->isolate_pool_size = value;
+  }
   return NULL;
 }
 
 static const command_rec dart_directives[] = {
   AP_INIT_TAKE1("DartDebug", (cmd_func) dart_set_debug, NULL, OR_ALL, "Whether error messages should be sent to the browser"),
+  AP_INIT_TAKE1("DartOutputBufferSize", (cmd_func) dart_set_output_buffer_size, NULL, OR_ALL, "Bytes of response output buffered before it is sent, 0 to send each write immediately"),
+  AP_INIT_TAKE1("DartInputChunkSize", (cmd_func) dart_set_input_chunk_size, NULL, OR_ALL, "Bytes of request body read from the client at a time"),
+  AP_INIT_TAKE1("DartFormMaxSize", (cmd_func) dart_set_form_max_size, NULL, OR_ALL, "Largest urlencoded request body read by request.formParameters, in bytes"),
+  AP_INIT_TAKE1("DartFormMaxFields", (cmd_func) dart_set_form_max_fields, NULL, OR_ALL, "Most parameters accepted in a query string or urlencoded request body"),
+  AP_INIT_TAKE1("DartMessageTimeout", (cmd_func) dart_set_message_timeout, NULL, OR_ALL, "Seconds to keep handling an isolate's messages (timers, stream listeners) after main() returns, 0 to not handle them"),
+  AP_INIT_TAKE1("DartTimeout", (cmd_func) dart_set_timeout, NULL, OR_ALL, "Seconds a request's script may run before it is interrupted and the request fails with 503, 0 for no limit"),
+  AP_INIT_TAKE1("DartSuspend", (cmd_func) dart_set_suspend, NULL, OR_ALL, "Whether requests waiting for messages give up their worker thread, with the event MPM"),
   AP_INIT_TAKE1("DartSnapshot", (cmd_func) dart_set_snapshot, (void*) true, OR_ALL, "A dart file to be snapshotted for fast loading"),
   AP_INIT_TAKE1("DartSnapshotForever", (cmd_func) dart_set_snapshot, (void*) false, OR_ALL, "A dart file to be snapshotted for fast loading"),
+  AP_INIT_TAKE12("DartSnapshotDirectory", (cmd_func) dart_set_snapshot_directory, NULL, OR_ALL, "A directory whose .dart files are snapshotted like DartSnapshot, optionally followed by 'recursive'"),
+  AP_INIT_TAKE1("DartSnapshotThreads", (cmd_func) dart_set_snapshot_threads, NULL, RSRC_CONF, "Number of threads creating script snapshots at startup"),
+  AP_INIT_TAKE1("DartSnapshotWatch", (cmd_func) dart_set_snapshot_watch, NULL, RSRC_CONF, "On to notice changed scripts and libraries with inotify, rather than stat()ing scripts for every request"),
+  AP_INIT_TAKE1("DartSnapshotCacheDir", (cmd_func) dart_set_snapshot_cache_dir, NULL, RSRC_CONF, "Directory where snapshots are saved, to be reused across restarts"),
+  AP_INIT_TAKE1("DartSnapshotWarmup", (cmd_func) dart_set_snapshot_warmup, NULL, RSRC_CONF, "Top-level function of each script to call with a synthetic request before it is snapshotted, Off for none"),
+  AP_INIT_TAKE1("DartAutoSnapshot", (cmd_func) dart_set_auto_snapshot, NULL, OR_ALL, "Whether scripts should be snapshotted the first time they are served"),
+  AP_INIT_TAKE1("DartAutoSnapshotLimit", (cmd_func) dart_set_auto_snapshot_limit, NULL, RSRC_CONF, "Number of auto snapshots each child keeps"),
+  AP_INIT_TAKE1("DartSourceCheckInterval", (cmd_func) dart_set_source_check_interval, NULL, RSRC_CONF, "Seconds a cached script or library source is used before checking its mtime again"),
+  AP_INIT_TAKE1("DartIsolatePoolSize", (cmd_func) dart_set_isolate_pool_size, (void*) false, RSRC_CONF, "Number of idle isolates each child keeps ready"),
+  AP_INIT_TAKE1("DartCacheSize", (cmd_func) dart_set_cache_size, NULL, RSRC_CONF, "Bytes of shared memory for apache:cache responses and apache:shared entries, 0 to disable both"),
+  AP_INIT_TAKE1("DartIsolateMaxRequests", (cmd_func) dart_set_isolate_pool_size, (void*) true, RSRC_CONF, "Number of requests a pooled isolate serves before it is recycled, 0 for unlimited"),
   { NULL },
 };
 
@@ -401,6 +2294,14 @@ static void *create_dir_conf(apr_pool_t* pool, char* context_) {
   dart_dir_config *cfg = (dart_dir_config*) apr_pcalloc(pool, sizeof(dart_dir_config));
   if (cfg) {
     cfg->debug = kNull;
+    cfg->auto_snapshot = kNull;
+    cfg->suspend = kNull;
+    cfg->output_buffer_size = -1;
+    cfg->input_chunk_size = -1;
+    cfg->form_max_size = -1;
+    cfg->form_max_fields = -1;
+    cfg->message_timeout = -1;
+    cfg->timeout = -1;
   }
   return cfg;
 }
@@ -410,6 +2311,14 @@ static void *merge_dir_conf(apr_pool_t* pool, void* base_, void* add_) {
   dart_dir_config *add = (dart_dir_config*) add_;
   dart_dir_config *cfg = (dart_dir_config*) apr_pcalloc(pool, sizeof(dart_dir_config));
   cfg->debug = add->debug ? add->debug : base->debug;
+  cfg->auto_snapshot = add->auto_snapshot ? add->auto_snapshot : base->auto_snapshot;
+  cfg->suspend = add->suspend ? add->suspend : base->suspend;
+  cfg->output_buffer_size = (add->output_buffer_size >= 0) ? add->output_buffer_size : base->output_buffer_size;
+  cfg->input_chunk_size = (add->input_chunk_size >= 0) ? add->input_chunk_size : base->input_chunk_size;
+  cfg->form_max_size = (add->form_max_size >= 0) ? add->form_max_size : base->form_max_size;
+  cfg->form_max_fields = (add->form_max_fields >= 0) ? add->form_max_fields : base->form_max_fields;
+  cfg->message_timeout = (add->message_timeout >= 0) ? add->message_timeout : base->message_timeout;
+  cfg->timeout = (add->timeout >= 0) ? add->timeout : base->timeout;
   return cfg;
 }
 
@@ -418,6 +2327,12 @@ static void *create_server_conf(apr_pool_t* pool, server_rec *server) {
   if (cfg) {
     cfg->base = NULL;
     cfg->snapshots = apr_hash_make(pool);
+    cfg->isolate_pool_size = -1; // one per thread
+    cfg->isolate_max_requests = 1;
+    cfg->auto_snapshot_limit = 64;
+    cfg->source_check_interval = 1;
+    cfg->snapshot_threads = 1;
+    cfg->cache_size = DART_DEFAULT_CACHE_SIZE;
   }
   return cfg;
 }
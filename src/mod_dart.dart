@@ -4,9 +4,16 @@
 
 #library('handler');
 #import('dart:io');
-#import('dart:uri');
+#import('dart:uri'); // not used here, but puts dart:uri in the master snapshot for scripts
 
-void print(text) => response.outputStream.writeString("$text\n");
+void print(text) {
+  request._write(text is String ? text : text.toString(), _UTF_8, true);
+}
+
+// Encodings for _Request._write, numbered as in apache_library.c
+final int _UTF_8 = 0;
+final int _ISO_8859_1 = 1;
+final int _ASCII = 2;
 
 var _request;
 HttpRequest get request() {
@@ -15,16 +22,29 @@ HttpRequest get request() {
 }
 HttpResponse get response() => request._response;
 
+// Listeners are called from the isolate's message loop, which mod_dart runs after main() returns.
+void _later(void callback()) {
+  new Timer(0, (timer) => callback());
+}
+
+// Called natively before each request: pooled isolates serve several requests.
+void _resetRequest() {
+  _request = null;
+}
+
 class _Request extends RequestNative implements HttpRequest {
   _Response _response;
   _Headers _headers;
   InputStream _inputStream;
+  List _queryFields;
   Map<String, String> _queryParameters;
+  List _formFields;
+  Map<String, String> _formParameters;
   _Request() {
     _response = new _Response(this);
   }
 
-  _write(s) native 'Apache_Response_Write';
+  _write(String s, int encoding, bool newline) native 'Apache_Response_Write';
   _writeList(list, off, len) native 'Apache_Response_WriteList';
   _flush() native 'Apache_Request_Flush';
   get _responseStatusCode() native 'Apache_Response_GetStatusCode';
@@ -44,7 +64,7 @@ class _Request extends RequestNative implements HttpRequest {
 
   HttpHeaders get headers() {
     if (_headers == null) {
-      _headers = new _RequestHeaders();
+      _headers = new _RequestHeaders(this);
       _initRequestHeaders(_headers);
     }
     return _headers;
@@ -58,23 +78,50 @@ class _Request extends RequestNative implements HttpRequest {
   String get uri() native 'Apache_Request_GetUri';
   String get queryString() native 'Apache_Request_GetQueryString';
 
-  static _decode(queryPart) => decodeUriComponent(queryPart.replaceAll('+',' '));
-  Map<String, String> get queryParameters() {
-    if (_queryParameters == null) {
-      var text = queryString;
-      _queryParameters = new Map<String, String>();
-      if (text != null) text.split("&").forEach((token) {
-        if (token.isEmpty()) return;
-        var index = token.indexOf('=');
-        if (index < 0) {
-          _queryParameters[_decode(token)] = null;
-        } else {
-          _queryParameters[_decode(token.substring(0, index))] = _decode(token.substring(index+1));
-        }
-      });
+  _parseQuery() native 'Apache_Request_ParseQuery';
+  _parseForm() native 'Apache_Request_ParseForm';
+
+  // Parameters come from the natives as a flat [name, value, ...] list
+  static Map<String, String> _lastValues(List fields) {
+    var result = new Map<String, String>();
+    for (var i = 0; i < fields.length; i += 2) result[fields[i]] = fields[i + 1];
+    return result;
+  }
+  static Map<String, List<String>> _allValues(List fields) {
+    var result = new Map<String, List<String>>();
+    for (var i = 0; i < fields.length; i += 2) {
+      var values = result[fields[i]];
+      if (values == null) result[fields[i]] = values = <String>[];
+      values.add(fields[i + 1]);
     }
+    return result;
+  }
+
+  /** The query parameters. If a name is repeated, its last value is used. */
+  Map<String, String> get queryParameters() {
+    if (_queryFields == null) _queryFields = _parseQuery();
+    if (_queryParameters == null) _queryParameters = _lastValues(_queryFields);
     return _queryParameters;
   }
+  /** Every value of each query parameter, in order. */
+  Map<String, List<String>> get queryParameterValues() {
+    if (_queryFields == null) _queryFields = _parseQuery();
+    return _allValues(_queryFields);
+  }
+
+  /**
+   * The fields of an application/x-www-form-urlencoded request body (empty for other bodies).
+   * The body is read the first time this is called, and is then no longer available from [inputStream].
+   */
+  Map<String, String> get formParameters() {
+    if (_formFields == null) _formFields = _parseForm();
+    if (_formParameters == null) _formParameters = _lastValues(_formFields);
+    return _formParameters;
+  }
+  Map<String, List<String>> get formParameterValues() {
+    if (_formFields == null) _formFields = _parseForm();
+    return _allValues(_formFields);
+  }
   String get path() native 'Apache_Request_GetPath';
   String get method() native 'Apache_Request_GetMethod';
   String get protocolVersion() {
@@ -135,11 +182,22 @@ class _Response {
 
 class _ResponseOutputStream implements OutputStream {
   final _request;
+  bool _closed = false;
+  Function _onClosed;
   _ResponseOutputStream(this._request);
 
   bool writeString(String string, [Encoding encoding = Encoding.UTF_8]) {
-    if (encoding != Encoding.UTF_8) throw new StreamException("Only UTF_8 is supported");
-    _request._write(string.toString());
+    int code;
+    if (encoding == Encoding.UTF_8) {
+      code = _UTF_8;
+    } else if (encoding == Encoding.ISO_8859_1) {
+      code = _ISO_8859_1;
+    } else if (encoding == Encoding.ASCII) {
+      code = _ASCII;
+    } else {
+      throw new StreamException("Unsupported encoding $encoding");
+    }
+    _request._write(string is String ? string : string.toString(), code, false);
     return true;
   }
 
@@ -148,7 +206,7 @@ class _ResponseOutputStream implements OutputStream {
   bool write(List<int> buffer, [bool copyBuffer = true]) => writeFrom(buffer, 0, buffer.length);
 
   bool writeFrom(List<int> buffer, [int offset = 0, int len]) {
-    if (len != null) len = buffer.length - offset;
+    if (len == null) len = buffer.length - offset;
     if ((offset < 0) || (len < 0) || (offset + len > buffer.length)) {
       throw new IllegalArgumentException("Out of range: offset=$offset len=$len buffer.length=${buffer.length}");
     }
@@ -156,70 +214,163 @@ class _ResponseOutputStream implements OutputStream {
     return true;
   }
 
-  void close() => null; // TODO
-  void destroy() => null; // TODO
-  void set onClosed(void callback()) => null;
-  void set onError(void callback(e)) => null;
-  void set onNoPendingWrites(void callback()) => null;
+  void close() {
+    if (_closed) return;
+    _closed = true;
+    if (_onClosed != null) _later(_onClosed);
+  }
+  void destroy() => close();
+  void set onClosed(void callback()) {
+    _onClosed = callback;
+    if (_closed && callback != null) _later(callback);
+  }
+  void set onError(void callback(e)) => null; // errors are thrown by the write
+  // Writes complete (into the output buffer) before they return, so there are never any pending
+  void set onNoPendingWrites(void callback()) {
+    if (callback != null) _later(callback);
+  }
 }
 
 class _RequestInputStream extends RequestInputStreamNative implements InputStream {
-  var _pos, _max;
-  _RequestInputStream(request) : _pos = 0, _max = 0 {
+  final _request;
+  bool _eos = false;
+  int _reads = 0;
+  Function _onData;
+  Function _onClosed;
+  bool _scheduled = false;
+  _RequestInputStream(request) : _request = request {
     _init(request);
   }
-  int available() => _max - _pos;
+  int available() native 'Apache_RequestInputStream_Available';
   void close() => null; // TODO
-  bool get closed() => false; // TODO
-  void set onClosed(void callback()) => null;
-  void set onData(void callback()) => null;
-  void set onError(void callback(e)) => null;
+  bool get closed() => _eos;
+  void set onClosed(void callback()) {
+    _onClosed = callback;
+    _schedule();
+  }
+  void set onData(void callback()) {
+    _onData = callback;
+    _schedule();
+  }
+  void set onError(void callback(e)) => null; // errors are thrown by the read
+
+  void _endOfStream() {
+    _eos = true;
+    if (_onClosed != null) _schedule();
+  }
+  void _schedule() {
+    if (_scheduled) return;
+    _scheduled = true;
+    _later(_dispatch);
+  }
+  // Reads block until data arrives, so there is always data for onData until the end of the body.
+  // It is called again for as long as it reads something, then onClosed is called once.
+  void _dispatch() {
+    _scheduled = false;
+    if (!_eos && _onData != null) {
+      var reads = _reads;
+      _onData();
+      if (!_eos && _reads != reads) _schedule();
+    }
+    if (_eos && _onClosed != null) {
+      var callback = _onClosed;
+      _onClosed = null;
+      callback();
+    }
+  }
   void pipe(OutputStream out, [bool close = true]) {
-    var buffer = _newByteArray(1024);
-    var count;
-    while ((count = readInto(buffer)) >= 0) out.writeFrom(buffer, 0, count);
+    var buffer;
+    while ((buffer = read()) != null) out.writeFrom(buffer, 0, buffer.length);
     if (close) out.close();
   }
   _init(request) native 'Apache_RequestInputStream_Init';
-  _fillBuffer() {
-    _pos = 0;
-    _max = -1; // in case of exception
-    _max = _nativeRead();
-  }
-  _copyBuffer(target, target_offset, src_offset, length) native 'Apache_RequestInputStream_CopyBuffer';
-  _nativeRead() native 'Apache_RequestInputStream_Read';
+  _read(maxLength) native 'Apache_RequestInputStream_Read';
+  _readInto(target, offset, length) native 'Apache_RequestInputStream_ReadInto';
   List<int> read([int len]) {
-    if (_pos == _max) _fillBuffer();
-    if (_max < 0) return null;
-    var count = (len == null) ? available() : Math.min(len, available());
-    var result = _newByteArray(count);
-    _copyBuffer(result, 0, _pos, count);
-    _pos += count;
+    if (_eos) return null;
+    _reads++;
+    var result = _read(len);
+    if (result == null) _endOfStream();
     return result;
   }
   int readInto(List<int> target, [int offset = 0, int len]) {
-    if (_pos == _max) _fillBuffer();
-    if (_max < 0) return 0;
     if (len == null) len = target.length - offset;
-    var count = Math.min(len, available());
-    _copyBuffer(target, offset, _pos, count);
-    _pos += count;
-    return count;
+    if (_eos || len == 0) return 0;
+    _reads++;
+    var count = _readInto(target, offset, len);
+    if (count >= 0) return count;
+    _endOfStream();
+    return 0;
+  }
+  /**
+   * Reads the rest of the body. If the Content-Length is known, it is read straight into the result.
+   * The Content-Length comes from the client, so the result only grows (from 64KB) as the body arrives.
+   */
+  List<int> readAll() {
+    var length = _request.contentLength;
+    if (length >= 0) {
+      var result = _newByteArray(length < _READ_ALL_INITIAL ? length : _READ_ALL_INITIAL);
+      var count = 0, n;
+      while (count < length) {
+        if (count == result.length) {
+          var size = (result.length * 2 < length) ? result.length * 2 : length;
+          var grown = _newByteArray(size);
+          grown.setRange(0, count, result);
+          result = grown;
+        }
+        n = readInto(result, count, result.length - count);
+        if (n <= 0) break;
+        count += n;
+      }
+      return (count == result.length) ? result : result.getRange(0, count);
+    }
+    var chunks = [], total = 0, chunk;
+    while ((chunk = read()) != null) {
+      chunks.add(chunk);
+      total += chunk.length;
+    }
+    var result = _newByteArray(total);
+    var pos = 0;
+    chunks.forEach((c) {
+      result.setRange(pos, c.length, c);
+      pos += c.length;
+    });
+    return result;
   }
   static _newByteArray(len) native 'Apache_NewByteArray';
+  static final int _READ_ALL_INITIAL = 65536;
 }
 
 class _Headers extends HeadersNative implements HttpHeaders {
   final _request;
+  Map<String, List<String>> _values; // lower case name -> values, null until needed or after a change
+  List<String> _names; // each name as first seen, in table order
   _Headers(this._request);
 
+  // Whether only this object changes the table, so its contents can be cached
+  bool get _cacheable() => true;
+
+  void _load() {
+    var entries = _toList();
+    _values = new Map<String, List<String>>();
+    _names = <String>[];
+    for (var i = 0; i < entries.length; i += 2) {
+      var name = entries[i];
+      var lower = name.toLowerCase();
+      var values = _values[lower];
+      if (values == null) {
+        _values[lower] = values = <String>[];
+        _names.add(name);
+      }
+      values.add(entries[i + 1]);
+    }
+  }
+
   List<String> operator [](String name) {
-    name = name.toLowerCase();
-    var result = [];
-    _forEach((k,v) {
-      if (k.toLowerCase() == name) result.add(v);
-    });
-    return result;
+    if (!_cacheable) return new List<String>.from(_getAll(name.toString()));
+    if (_values == null) _load();
+    var result = _values[name.toString().toLowerCase()];
+    return (result == null) ? <String>[] : new List<String>.from(result);
   }
 
   void add(String name, Object value) {
@@ -227,6 +378,7 @@ class _Headers extends HeadersNative implements HttpHeaders {
       value.forEach((v) => add(name, _format(v)));
       return;
     }
+    _values = null;
     _add(name, _format(value));
   }
   void set(String name, Object value) {
@@ -235,15 +387,15 @@ class _Headers extends HeadersNative implements HttpHeaders {
   }
   void remove(String name, Object value) {
     value = _format(value);
-    newValues = this[name];
-    var index;
-    while ((index = newValues.indexOf(value)) >= 0) newValues.removeRange(index, 1);
-    if (index >= 0) {
-      removeAll(name);
-      add(name, newValues);
-    }
+    var values = this[name];
+    if (values.indexOf(value) < 0) return;
+    removeAll(name);
+    values.forEach((v) {
+      if (v != value) add(name, v);
+    });
   }
   void removeAll(String name) {
+    _values = null;
     _removeAll(name.toString());
   }
   String _format(Object value) {
@@ -273,18 +425,10 @@ class _Headers extends HeadersNative implements HttpHeaders {
   void set contentType(ContentType ctype) => set("Content-Type", ctype.toString());
 
   void forEach(void f(String name, List<String> values)) {
-    var nameValueMap = {};
-    var names = [];
-    _forEach((k,v) {
-      var klower = k.toLowerCase();
-      if (!nameValueMap.containsKey(klower)) {
-        names.add(k);
-        nameValueMap[klower] = [];
-      }
-      nameValueMap[klower].add(v);
-    });
-    names.forEach((name) {
-      f(name, nameValueMap[name.toLowerCase()]);
+    if (_values == null || !_cacheable) _load();
+    var values = _values;
+    _names.forEach((name) {
+      f(name, new List<String>.from(values[name.toLowerCase()]));
     });
   }
 
@@ -299,12 +443,15 @@ class _Headers extends HeadersNative implements HttpHeaders {
   String get port() => null;
 
   _get(name) native 'Apache_Headers_Get';
+  _getAll(name) native 'Apache_Headers_GetAll';
+  _toList() native 'Apache_Headers_ToList';
   _add(name, value) native 'Apache_Headers_Add';
-  _forEach(void f(name, value)) native 'Apache_Headers_Iterate';
   _removeAll(name) native 'Apache_Headers_Remove';
 }
 
 class _RequestHeaders extends _Headers {
+  _RequestHeaders(request) : super(request);
+
   String get host() => _request._getHost();
   int get port() {
     var host = value('host');
@@ -316,6 +463,9 @@ class _RequestHeaders extends _Headers {
 class _ResponseHeaders extends _Headers {
   _ResponseHeaders(request) : super(request);
 
+  // Natives like setContentLength also change the response headers
+  bool get _cacheable() => false;
+
   ContentType get contentType() => new ContentType.fromString(_request._getResponseContentType());
   void set contentType(ContentType type) => _request._setResponseContentType(type.toString());
   void add(String name, String value) {
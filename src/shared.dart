@@ -0,0 +1,29 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+#library('shared');
+
+/**
+ * A map held in shared memory, so its entries are seen by every request in every Apache child.
+ * Values are strings, ints or lists of bytes (which are read back as byte arrays).
+ * Setting a key to null removes it. When memory runs out (see DartCacheSize), the least
+ * recently used entries are discarded, so treat it as a cache of things that can be recomputed.
+ */
+class SharedMap {
+  const SharedMap();
+
+  operator [](String key) native 'Apache_Shared_Get';
+  void operator []=(String key, value) native 'Apache_Shared_Put';
+
+  /**
+   * Sets [key] to [value] only if its current value is [expected] (null meaning it has none),
+   * and returns whether it did.
+   */
+  bool compareAndSwap(String key, expected, value) native 'Apache_Shared_CompareAndSwap';
+
+  /** Atomically adds [delta] to the int value of [key] (0 if it has none), and returns the sum. */
+  int increment(String key, [int delta = 1]) native 'Apache_Shared_Increment';
+}
+
+final SharedMap shared = const SharedMap();
@@ -0,0 +1,275 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+#include <stdio.h>
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "ap_config.h"
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+
+#include "status.h"
+
+#define DART_STATUS_SCRIPTS 128 // scripts tracked separately, any more are counted together
+#define DART_STATUS_BUCKETS 32 // bucket n counts durations below 2^n microseconds (and at least 2^(n-1))
+#define DART_STATUS_FILENAME_SIZE 256
+
+// Statistics for one script, in shared memory. Children update them with atomic increments.
+typedef struct dart_script_stats {
+  volatile apr_uint32_t hash; // of filename, 0 while the slot is free
+  volatile apr_uint32_t ready; // set once filename has been written
+  char filename[DART_STATUS_FILENAME_SIZE];
+  volatile apr_uint32_t histograms[kPhaseCount][DART_STATUS_BUCKETS];
+  volatile apr_uint32_t counters[kCounterCount];
+} dart_script_stats;
+
+typedef struct dart_status {
+  apr_time_t created;
+  dart_script_stats scripts[DART_STATUS_SCRIPTS + 1]; // the last one is for scripts that didn't fit
+} dart_status;
+
+// A copy of one or more scripts' statistics, for the status page.
+typedef struct dart_status_totals {
+  const char *filename;
+  apr_uint32_t histograms[kPhaseCount][DART_STATUS_BUCKETS];
+  apr_uint32_t counters[kCounterCount];
+} dart_status_totals;
+
+static const char *phase_names[] = { "snapshot", "isolate", "load", "main", "messages", "output", "shutdown", "total" };
+static const char *counter_names[] = { "snapshot_hit", "snapshot_miss", "snapshot_stale", "snapshot_none", "isolate_reused", "errors", "timeouts", "cache_hit" };
+static const int percentiles[] = { 500, 950, 990 }; // per mille
+
+static dart_status *status = NULL; // in shared memory created before the children fork
+
+extern "C" int DartStatusPostConfig(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s) {
+  apr_shm_t *shm;
+  apr_status_t rv = apr_shm_create(&shm, sizeof(dart_status), NULL, pconf);
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, LOG_WARNING, rv, s, "mod_dart: Failed to create shared memory, dart-status is disabled");
+    status = NULL;
+    return OK;
+  }
+  status = (dart_status*) apr_shm_baseaddr_get(shm);
+  memset(status, 0, sizeof(dart_status));
+  status->created = apr_time_now();
+  return OK;
+}
+
+// Finds the slot for [filename], claiming a free one if it has none.
+static dart_script_stats *find_script(const char *filename) {
+  apr_ssize_t length = APR_HASH_KEY_STRING;
+  apr_uint32_t hash = apr_hashfunc_default(filename, &length);
+  if (!hash) hash = 1;
+  for (int i = 0; i < DART_STATUS_SCRIPTS; i++) {
+    dart_script_stats *script = &(status->scripts[(hash + i) % DART_STATUS_SCRIPTS]);
+    apr_uint32_t slot_hash = apr_atomic_read32(&(script->hash));
+    if (!slot_hash && !(slot_hash = apr_atomic_cas32(&(script->hash), hash, 0))) {
+      apr_cpystrn(script->filename, filename, sizeof(script->filename));
+      apr_atomic_set32(&(script->ready), 1);
+      return script;
+    }
+    if (slot_hash != hash) continue;
+    for (int spins = 0; !apr_atomic_read32(&(script->ready)) && spins < 10000; spins++) {
+      // another request is writing the filename
+    }
+    if (!strncmp(script->filename, filename, sizeof(script->filename) - 1)) return script;
+  }
+  return &(status->scripts[DART_STATUS_SCRIPTS]);
+}
+
+extern "C" dart_timer *DartStatusStart(request_rec *r) {
+  dart_timer *timer = (dart_timer*) apr_palloc(r->pool, sizeof(dart_timer));
+  timer->script = status ? find_script(r->filename) : NULL;
+  timer->start = timer->mark = apr_time_now();
+  return timer;
+}
+
+static void record(dart_timer *timer, dart_phase phase, apr_interval_time_t elapsed) {
+  int bucket = 0;
+  while (elapsed > 0 && bucket < DART_STATUS_BUCKETS - 1) {
+    elapsed >>= 1;
+    bucket++;
+  }
+  apr_atomic_inc32(&(timer->script->histograms[phase][bucket]));
+}
+
+extern "C" void DartStatusPhase(dart_timer *timer, dart_phase phase) {
+  if (!timer->script) return;
+  apr_time_t now = apr_time_now();
+  record(timer, phase, now - timer->mark);
+  timer->mark = now;
+}
+
+extern "C" void DartStatusSkip(dart_timer *timer) {
+  if (timer->script) timer->mark = apr_time_now();
+}
+
+extern "C" void DartStatusCount(dart_timer *timer, dart_counter counter) {
+  if (timer->script) apr_atomic_inc32(&(timer->script->counters[counter]));
+}
+
+extern "C" void DartStatusFinish(dart_timer *timer) {
+  if (timer->script) record(timer, kPhaseTotal, apr_time_now() - timer->start);
+}
+
+static void add_totals(dart_status_totals *totals, dart_script_stats *script) {
+  for (int phase = 0; phase < kPhaseCount; phase++) {
+    for (int bucket = 0; bucket < DART_STATUS_BUCKETS; bucket++) {
+      totals->histograms[phase][bucket] += apr_atomic_read32(&(script->histograms[phase][bucket]));
+    }
+  }
+  for (int counter = 0; counter < kCounterCount; counter++) {
+    totals->counters[counter] += apr_atomic_read32(&(script->counters[counter]));
+  }
+}
+
+static apr_uint64_t phase_count(const dart_status_totals *totals, int phase) {
+  apr_uint64_t count = 0;
+  for (int bucket = 0; bucket < DART_STATUS_BUCKETS; bucket++) count += totals->histograms[phase][bucket];
+  return count;
+}
+
+// The upper bound of the histogram bucket containing the given percentile, in microseconds.
+static apr_uint64_t percentile(const dart_status_totals *totals, int phase, int per_mille) {
+  apr_uint64_t count = phase_count(totals, phase);
+  if (!count) return 0;
+  apr_uint64_t target = (count * per_mille + 999) / 1000, seen = 0;
+  for (int bucket = 0; bucket < DART_STATUS_BUCKETS; bucket++) {
+    seen += totals->histograms[phase][bucket];
+    if (seen >= target) return ((apr_uint64_t) 1) << bucket;
+  }
+  return ((apr_uint64_t) 1) << (DART_STATUS_BUCKETS - 1);
+}
+
+static const char *format_micros(apr_pool_t *pool, apr_uint64_t micros) {
+  if (micros < 1000) return apr_psprintf(pool, "%d us", (int) micros);
+  if (micros < 1000000) return apr_psprintf(pool, "%.1f ms", micros / 1000.0);
+  return apr_psprintf(pool, "%.2f s", micros / 1000000.0);
+}
+
+static const char *json_string(apr_pool_t *pool, const char *text) {
+  char *result = (char*) apr_palloc(pool, strlen(text) * 6 + 3), *out = result;
+  *out++ = '"';
+  for (const unsigned char *in = (const unsigned char*) text; *in; in++) {
+    if (*in == '"' || *in == '\\') {
+      *out++ = '\\';
+      *out++ = *in;
+    } else if (*in < 0x20) {
+      out += sprintf(out, "\\u%04x", *in);
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out++ = '"';
+  *out = 0;
+  return result;
+}
+
+static void print_html(request_rec *r, const dart_status_totals *totals) {
+  ap_rprintf(r, "<h2>%s</h2>\n<p>", ap_escape_html(r->pool, totals->filename));
+  for (int counter = 0; counter < kCounterCount; counter++) {
+    ap_rprintf(r, "%s%s: %u", counter ? ", " : "", counter_names[counter], totals->counters[counter]);
+  }
+  ap_rputs("</p>\n<table border=\"1\">\n<tr><th>Phase</th><th>Count</th><th>p50</th><th>p95</th><th>p99</th></tr>\n", r);
+  for (int phase = 0; phase < kPhaseCount; phase++) {
+    ap_rprintf(r, "<tr><td>%s</td><td>%" APR_UINT64_T_FMT "</td>", phase_names[phase], phase_count(totals, phase));
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(int); i++) {
+      ap_rprintf(r, "<td>&le; %s</td>", format_micros(r->pool, percentile(totals, phase, percentiles[i])));
+    }
+    ap_rputs("</tr>\n", r);
+  }
+  ap_rputs("</table>\n", r);
+}
+
+// One line per value: filename, tab, key, tab, value. Durations are in microseconds.
+static void print_text(request_rec *r, const dart_status_totals *totals) {
+  for (int counter = 0; counter < kCounterCount; counter++) {
+    ap_rprintf(r, "%s\t%s\t%u\n", totals->filename, counter_names[counter], totals->counters[counter]);
+  }
+  for (int phase = 0; phase < kPhaseCount; phase++) {
+    ap_rprintf(r, "%s\t%s.count\t%" APR_UINT64_T_FMT "\n", totals->filename, phase_names[phase], phase_count(totals, phase));
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(int); i++) {
+      ap_rprintf(r, "%s\t%s.p%d\t%" APR_UINT64_T_FMT "\n", totals->filename, phase_names[phase], percentiles[i] / 10,
+        percentile(totals, phase, percentiles[i]));
+    }
+  }
+}
+
+static void print_json(request_rec *r, const dart_status_totals *totals) {
+  ap_rprintf(r, "{\"filename\": %s, \"counters\": {", json_string(r->pool, totals->filename));
+  for (int counter = 0; counter < kCounterCount; counter++) {
+    ap_rprintf(r, "%s\"%s\": %u", counter ? ", " : "", counter_names[counter], totals->counters[counter]);
+  }
+  ap_rputs("}, \"phases\": {", r);
+  for (int phase = 0; phase < kPhaseCount; phase++) {
+    ap_rprintf(r, "%s\"%s\": {\"count\": %" APR_UINT64_T_FMT, phase ? ", " : "", phase_names[phase], phase_count(totals, phase));
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(int); i++) {
+      ap_rprintf(r, ", \"p%d_us\": %" APR_UINT64_T_FMT, percentiles[i] / 10, percentile(totals, phase, percentiles[i]));
+    }
+    ap_rputs(", \"histogram\": [", r);
+    for (int bucket = 0; bucket < DART_STATUS_BUCKETS; bucket++) {
+      ap_rprintf(r, "%s%u", bucket ? ", " : "", totals->histograms[phase][bucket]);
+    }
+    ap_rputs("]}", r);
+  }
+  ap_rputs("}}", r);
+}
+
+// Shows the statistics of each script, and of all of them together.
+// ?auto gives tab separated text, ?json gives JSON, otherwise the page is HTML.
+extern "C" int DartStatusHandler(request_rec *r) {
+  if (strcmp(r->handler, "dart-status")) return DECLINED;
+  if (r->header_only) return OK;
+  if (!status) {
+    ap_rputs("dart-status is disabled, see the error log\n", r);
+    return OK;
+  }
+  enum { kHtml, kText, kJson } format = kHtml;
+  if (r->args && !strcmp(r->args, "auto")) format = kText;
+  if (r->args && !strcmp(r->args, "json")) format = kJson;
+
+  int count = 0;
+  dart_status_totals *totals = (dart_status_totals*) apr_pcalloc(r->pool, (DART_STATUS_SCRIPTS + 2) * sizeof(dart_status_totals));
+  totals[count++].filename = "(all scripts)";
+  for (int i = 0; i <= DART_STATUS_SCRIPTS; i++) {
+    dart_script_stats *script = &(status->scripts[i]);
+    if (i < DART_STATUS_SCRIPTS && !apr_atomic_read32(&(script->ready))) continue;
+    add_totals(&(totals[0]), script);
+    add_totals(&(totals[count]), script);
+    if (i < DART_STATUS_SCRIPTS) {
+      totals[count].filename = apr_pstrdup(r->pool, script->filename);
+    } else {
+      totals[count].filename = "(other scripts)";
+      if (!phase_count(&(totals[count]), kPhaseTotal)) continue;
+    }
+    count++;
+  }
+  long seconds = (long) apr_time_sec(apr_time_now() - status->created);
+
+  if (format == kText) {
+    ap_set_content_type(r, "text/plain; charset=ISO-8859-1");
+    ap_rprintf(r, "Uptime\t%ld\n", seconds);
+    for (int i = 0; i < count; i++) print_text(r, &(totals[i]));
+  } else if (format == kJson) {
+    ap_set_content_type(r, "application/json");
+    ap_rprintf(r, "{\"uptime\": %ld, \"scripts\": [", seconds);
+    for (int i = 0; i < count; i++) {
+      if (i) ap_rputs(",\n", r);
+      print_json(r, &(totals[i]));
+    }
+    ap_rputs("]}\n", r);
+  } else {
+    ap_set_content_type(r, "text/html; charset=ISO-8859-1");
+    ap_rprintf(r, "<html><head><title>mod_dart status</title></head><body>\n<h1>mod_dart status</h1>\n"
+      "<p>%ld seconds since Apache was (re)started. Durations are upper bounds, histograms have power-of-two buckets.</p>\n", seconds);
+    for (int i = 0; i < count; i++) print_html(r, &(totals[i]));
+    ap_rputs("</body></html>\n", r);
+  }
+  return OK;
+}
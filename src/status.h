@@ -0,0 +1,58 @@
+// Copyright 2012 Google Inc.
+// Licensed under the Apache License, Version 2.0 (the "License")
+// You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+#ifndef MOD_DART_STATUS_H
+#define MOD_DART_STATUS_H
+
+#include "httpd.h"
+
+// Parts of dart_handler that are timed separately on the dart-status page.
+typedef enum {
+  kPhaseSnapshot = 0, // finding (or creating) the script's snapshot
+  kPhaseIsolate, // checking out (or creating) an isolate
+  kPhaseLoad, // initializing apache:handler and loading the script
+  kPhaseMain, // running main()
+  kPhaseMessages, // handling messages (timers, stream listeners) after main() returned
+  kPhaseOutput, // passing the buffered output
+  kPhaseShutdown, // returning the isolate to the pool, or shutting it down
+  kPhaseTotal,
+  kPhaseCount
+} dart_phase;
+
+typedef enum {
+  kCounterSnapshotHit = 0, // the script was loaded from a snapshot
+  kCounterSnapshotMiss, // an auto snapshot had to be created (or failed)
+  kCounterSnapshotStale, // a DartSnapshot was out of date or failed
+  kCounterSnapshotNone, // no snapshot was configured
+  kCounterIsolateReused, // the isolate already had the script loaded
+  kCounterErrors,
+  kCounterTimeouts, // the script ran past its DartTimeout
+  kCounterCacheHit, // the response was served from apache:cache, without running the script
+  kCounterCount
+} dart_counter;
+
+struct dart_script_stats;
+
+// Times one request, a phase at a time. Allocated from the request pool.
+typedef struct dart_timer {
+  struct dart_script_stats *script; // NULL if statistics aren't being collected
+  apr_time_t start;
+  apr_time_t mark; // when the current phase started
+} dart_timer;
+
+// Creates the shared memory that all children record into (post_config hook).
+extern "C" int DartStatusPostConfig(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
+// Serves the dart-status page (handler hook).
+extern "C" int DartStatusHandler(request_rec *r);
+
+extern "C" dart_timer *DartStatusStart(request_rec *r);
+// Records the time since the last phase ended as [phase].
+extern "C" void DartStatusPhase(dart_timer *timer, dart_phase phase);
+// Starts the next phase now, without recording the time since the last one.
+extern "C" void DartStatusSkip(dart_timer *timer);
+extern "C" void DartStatusCount(dart_timer *timer, dart_counter counter);
+// Records kPhaseTotal, the time since DartStatusStart.
+extern "C" void DartStatusFinish(dart_timer *timer);
+
+#endif